@@ -3,23 +3,179 @@
 #include <iomanip>
 #include <sstream>
 #include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <cerrno>
 #include <string>
 #include <vector>
 #include <fstream>
 #include <cassert>
 #include <cstring>
+#include <memory>
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <chrono>
+#include <utility>
+#include <span>
+#include <iterator>
+#include <filesystem>
+#include <numeric>
+#include <cstdio>
+#include <cctype>
+#include <functional>
+#include <list>
+#include <unordered_map>
+#include <charconv>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+#ifdef __linux__
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#endif
 
 #include <openssl/evp.h>
 #include <openssl/rand.h>
+#include <openssl/crypto.h>
 
 using namespace std;
 
+constexpr size_t TGA_HEADER_SIZE = 18;
+constexpr size_t MIN_CHUNK_SIZE = 64 * 1024;
+constexpr size_t MAX_CHUNK_SIZE = 8 * 1024 * 1024;
+constexpr size_t DEFAULT_CHUNK_SIZE = 1024 * 1024;
+constexpr size_t COUNTER_BLOCK_SIZE = 16;   // chunks stay a multiple of this so segments also start on a CTR counter block
+constexpr size_t DEFAULT_PIPELINE_DEPTH = 4;
+constexpr size_t DIRECT_IO_ALIGNMENT = 4096;    // buffer address, file offset and length granularity of io_mode::direct
+constexpr size_t AES_LANES = 8;                     // independent block streams interleaved by aes_multi_buffer()
+constexpr size_t MULTI_BUFFER_FILE_LIMIT = 64 * 1024;   // batch files up to this size go through aes_multi_buffer()
+constexpr size_t MULTI_BUFFER_GROUP = 256;          // small batch files read, ciphered and written together
+constexpr size_t DEFAULT_ENGINE_CACHE_SHARDS = 16;  // independently locked parts of an engine_cache
+
+// TGA RLE stage (m_tga_rle): uncompressed image types 1/2/3 become their run-length encoded variants 9/10/11
+constexpr uint8_t TGA_RLE_TYPE_OFFSET = 8;
+constexpr uint8_t TGA_RLE_STAGE_MARK = 0xc0;    // descriptor bits 7-6 (reserved interleaving value) of images the stage compressed
+constexpr size_t TGA_RLE_PACKET_PIXELS = 128;
+constexpr size_t TGA_MAX_PIXEL_SIZE = 4;
+constexpr size_t TGA_RLE_MIN_BUFFER = 2 * (1 + TGA_RLE_PACKET_PIXELS * TGA_MAX_PIXEL_SIZE);   // two literal packets
+
+// Sealed chunk container (encrypt_container): header | chunks, each ciphertext + tag | chunk index | trailer
+constexpr uint8_t CONTAINER_MAGIC[8] = {'T', 'G', 'A', 'S', 'E', 'A', 'L', 0};
+constexpr uint32_t CONTAINER_VERSION = 1;
+constexpr size_t CONTAINER_TRAILER_SIZE = 64;
+constexpr size_t AEAD_NONCE_SIZE = 12;
+constexpr size_t AEAD_TAG_SIZE = 16;
+
+// Incremental index (encrypt_incremental): index_header followed by index_entry records sorted by path hash
+constexpr uint8_t INDEX_MAGIC[8] = {'T', 'G', 'A', 'I', 'N', 'D', 'E', 'X'};
+constexpr uint32_t INDEX_VERSION = 1;
+constexpr size_t KEY_ID_SIZE = 16;
+constexpr size_t SHA256_SIZE = 32;
+
+enum class io_mode {
+    stream,     // read()/write() through reusable chunk buffers
+    mmap,       // cipher runs from the mapped input straight into the mapped output, falls back to stream for non-regular files
+    pipeline,   // reader, cipher and writer threads pass chunks through a ring of buffers
+    uring,      // reads and writes kept in flight through io_uring (Linux), falls back to stream where unavailable
+    direct,     // O_DIRECT through aligned buffers bypassing the page cache (F_NOCACHE on macOS), falls back to stream
+};
+
+enum class digest_kind {
+    none,
+    sha256,
+    sha512,
+};
+
+// Filled by io_mode::pipeline. A stage that stalls a lot is waiting on a slower neighbour:
+// a stalled reader means cipher or disk writes are the bottleneck, a stalled cipher stage means reads are.
+struct pipeline_stats {
+    uint64_t m_read_ns = 0;
+    uint64_t m_cipher_ns = 0;
+    uint64_t m_write_ns = 0;
+    uint64_t m_reader_stall_ns = 0;     // waiting for a free buffer
+    uint64_t m_cipher_stall_ns = 0;     // waiting for data from the reader
+    uint64_t m_writer_stall_ns = 0;     // waiting for processed data from the cipher stage
+    uint64_t m_chunks = 0;
+};
+
+// Build with -DTGA_CIPHER_STATS=0 to compile the cipher_stats bookkeeping out of the hot loops altogether.
+#ifndef TGA_CIPHER_STATS
+#define TGA_CIPHER_STATS 1
+#endif
+
+/**
+ * Filled per call when `m_stats` is set. Phase timings, system calls and chunks come from the streaming loops
+ * (io_mode::stream, digests, encrypt_fd()/decrypt_fd()); the other modes report open and total time only, and
+ * multi-buffer batch files their byte counts. Batches fill one per file in batch_result and sum them into `m_stats`.
+ */
+struct cipher_stats {
+    uint64_t m_open_ns = 0;         // opening the input and creating the output
+    uint64_t m_init_ns = 0;         // keying a context (EVP_CipherInit_ex through the engine's pool)
+    uint64_t m_read_ns = 0;
+    uint64_t m_cipher_ns = 0;       // EVP_CipherUpdate
+    uint64_t m_write_ns = 0;
+    uint64_t m_final_ns = 0;        // EVP_CipherFinal_ex
+    uint64_t m_total_ns = 0;
+    uint64_t m_bytes_read = 0;
+    uint64_t m_bytes_written = 0;
+    uint64_t m_read_calls = 0;      // read()/splice() system calls
+    uint64_t m_write_calls = 0;     // write() system calls
+    uint64_t m_chunks = 0;
+    uint64_t m_files = 0;           // successfully processed
+
+    cipher_stats & operator+=(const cipher_stats & other)
+    {
+        m_open_ns += other.m_open_ns;
+        m_init_ns += other.m_init_ns;
+        m_read_ns += other.m_read_ns;
+        m_cipher_ns += other.m_cipher_ns;
+        m_write_ns += other.m_write_ns;
+        m_final_ns += other.m_final_ns;
+        m_total_ns += other.m_total_ns;
+        m_bytes_read += other.m_bytes_read;
+        m_bytes_written += other.m_bytes_written;
+        m_read_calls += other.m_read_calls;
+        m_write_calls += other.m_write_calls;
+        m_chunks += other.m_chunks;
+        m_files += other.m_files;
+        return *this;
+    }
+
+    // One flat JSON object, member names without the m_ prefix.
+    std::string to_json() const
+    {
+        std::ostringstream json;
+        json << "{\"open_ns\": " << m_open_ns << ", \"init_ns\": " << m_init_ns << ", \"read_ns\": " << m_read_ns
+             << ", \"cipher_ns\": " << m_cipher_ns << ", \"write_ns\": " << m_write_ns << ", \"final_ns\": " << m_final_ns
+             << ", \"total_ns\": " << m_total_ns << ", \"bytes_read\": " << m_bytes_read << ", \"bytes_written\": " << m_bytes_written
+             << ", \"read_calls\": " << m_read_calls << ", \"write_calls\": " << m_write_calls << ", \"chunks\": " << m_chunks
+             << ", \"files\": " << m_files << "}";
+        return json.str();
+    }
+};
+
 struct crypto_config {
     const char * m_crypto_function;
     std::unique_ptr<uint8_t[]> m_key;
     std::unique_ptr<uint8_t[]> m_IV;
     size_t m_key_len;
     size_t m_IV_len;
+    size_t m_chunk_size = DEFAULT_CHUNK_SIZE;   // bytes handed to a single EVP_*Update call, clamped to [MIN_CHUNK_SIZE, MAX_CHUNK_SIZE]
+    io_mode m_io_mode = io_mode::stream;
+    unsigned m_threads = 1;                     // workers for ECB/CTR files and CBC decryption, 0 picks std::thread::hardware_concurrency()
+    size_t m_pipeline_depth = DEFAULT_PIPELINE_DEPTH;   // chunk buffers in flight in io_mode::pipeline and io_mode::uring
+    pipeline_stats * m_pipeline_stats = nullptr;        // optional, receives the stage timings of io_mode::pipeline
+    digest_kind m_digest = digest_kind::none;   // files also get a "<output>.sha256"/".sha512" manifest of input and output digests
+    cipher_stats * m_stats = nullptr;           // optional, receives the timings and counters of every call
+    bool m_tga_rle = false;                     // run-length encode uncompressed images before encryption, expand them after decryption
 };
 
 bool check_config(crypto_config & config, const EVP_CIPHER * cypher_name)
@@ -47,352 +203,5255 @@ bool check_config(crypto_config & config, const EVP_CIPHER * cypher_name)
     return true;
 }
 
-bool encrypt_data(const std::string & in_filename, const std::string & out_filename, crypto_config & config) {
-    OpenSSL_add_all_ciphers();
+class file_descriptor {
+public:
+    explicit file_descriptor(int fd = -1) : m_fd(fd) {}
+    file_descriptor(file_descriptor && other) noexcept : m_fd(other.m_fd) { other.m_fd = -1; }
+    file_descriptor(const file_descriptor &) = delete;
+    file_descriptor & operator=(const file_descriptor &) = delete;
+    ~file_descriptor() { if (m_fd >= 0) ::close(m_fd); }
 
-    if(in_filename.empty() || out_filename.empty() || config.m_crypto_function == nullptr)
-        return false;
+    int get() const { return m_fd; }
+    bool valid() const { return m_fd >= 0; }
 
-    ifstream input_file(in_filename, std::ios::binary);
-    ofstream output_file(out_filename, std::ios::binary);
-    if (!(input_file.is_open()) || input_file.fail() || !(output_file.is_open()) || output_file.fail()) {
-        input_file.close();
-        output_file.close();
-        return false;
+    // Closes explicitly so that errors reported by close() (e.g. delayed write errors) are not lost.
+    bool close()
+    {
+        int fd = m_fd;
+        m_fd = -1;
+        return fd < 0 || ::close(fd) == 0;
     }
 
-    const EVP_CIPHER * cypher_name = EVP_get_cipherbyname(config.m_crypto_function);
-    if(!cypher_name || !check_config(config, cypher_name)) {
-        input_file.close();
-        output_file.close();
-        return false;
-    }
+private:
+    int m_fd;
+};
 
-    EVP_CIPHER_CTX * ctx = EVP_CIPHER_CTX_new();
-    if(ctx == nullptr) {
-        input_file.close();
-        output_file.close();
-        return false;
+class memory_mapping {
+public:
+    memory_mapping(int fd, size_t size, int protection)
+        : m_size(size)
+    {
+        m_data = ::mmap(nullptr, size, protection, MAP_SHARED, fd, 0);
+        if (m_data == MAP_FAILED)
+            m_data = nullptr;
+        else
+            ::madvise(m_data, size, MADV_SEQUENTIAL);
     }
+    memory_mapping(const memory_mapping &) = delete;
+    memory_mapping & operator=(const memory_mapping &) = delete;
+    ~memory_mapping() { if (m_data) ::munmap(m_data, m_size); }
 
-    if(!EVP_EncryptInit_ex(ctx, cypher_name, nullptr, config.m_key.get(), config.m_IV.get())) {
-        EVP_CIPHER_CTX_free(ctx);
+    bool valid() const { return m_data != nullptr; }
+    uint8_t * data() const { return static_cast<uint8_t*>(m_data); }
 
-        input_file.close();
-        output_file.close();
-        return false;
+private:
+    void * m_data;
+    size_t m_size;
+};
+
+#ifdef __linux__
+/**
+ * Minimal io_uring wrapper on top of the raw system calls: one submission and one completion ring, optionally
+ * with registered (fixed) buffers. Submissions are queued with next_sqe() and handed to the kernel by submit().
+ */
+class io_uring_queue {
+public:
+    explicit io_uring_queue(unsigned entries)
+    {
+        io_uring_params params {};
+        m_fd = (int)::syscall(__NR_io_uring_setup, entries, &params);
+        if (m_fd < 0)
+            return;
+
+        m_sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+        m_cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+        if (params.features & IORING_FEAT_SINGLE_MMAP)
+            m_sq_ring_size = m_cq_ring_size = std::max(m_sq_ring_size, m_cq_ring_size);
+        m_sqes_size = params.sq_entries * sizeof(io_uring_sqe);
+
+        m_sq_ring = ::mmap(nullptr, m_sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_fd, IORING_OFF_SQ_RING);
+        m_cq_ring = (params.features & IORING_FEAT_SINGLE_MMAP) ? m_sq_ring
+                    : ::mmap(nullptr, m_cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_fd, IORING_OFF_CQ_RING);
+        void * sqes = ::mmap(nullptr, m_sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_fd, IORING_OFF_SQES);
+        if (m_sq_ring == MAP_FAILED || m_cq_ring == MAP_FAILED || sqes == MAP_FAILED)
+        {
+            if (sqes != MAP_FAILED)
+                ::munmap(sqes, m_sqes_size);
+            unmap_rings();
+            ::close(m_fd);
+            m_fd = -1;
+            return;
+        }
+        m_sqes = static_cast<io_uring_sqe*>(sqes);
+
+        auto * sq = static_cast<uint8_t*>(m_sq_ring);
+        m_sq_head = reinterpret_cast<unsigned*>(sq + params.sq_off.head);
+        m_sq_tail = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+        m_sq_mask = *reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+        m_sq_entries = *reinterpret_cast<unsigned*>(sq + params.sq_off.ring_entries);
+        m_sq_array = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+
+        auto * cq = static_cast<uint8_t*>(m_cq_ring);
+        m_cq_head = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+        m_cq_tail = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+        m_cq_mask = *reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+        m_cqes = reinterpret_cast<io_uring_cqe*>(cq + params.cq_off.cqes);
+
+        m_local_tail = *m_sq_tail;
     }
 
-    int header_size = 18;
-    vector<char> header(header_size);
+    io_uring_queue(const io_uring_queue &) = delete;
+    io_uring_queue & operator=(const io_uring_queue &) = delete;
 
-    input_file.read(header.data(), header_size);
-    if(input_file.bad())
+    ~io_uring_queue()
     {
-        EVP_CIPHER_CTX_free(ctx);
-        input_file.close();
-        output_file.close();
-        return false;
+        if (m_fd < 0)
+            return;
+        ::munmap(m_sqes, m_sqes_size);
+        unmap_rings();
+        ::close(m_fd);
     }
 
-    if(input_file.gcount() < header_size)
+    bool valid() const { return m_fd >= 0; }
+
+    bool register_buffers(const iovec * buffers, unsigned count)
     {
-        EVP_CIPHER_CTX_free(ctx);
-        input_file.close();
-        output_file.close();
-        return false;
+        return ::syscall(__NR_io_uring_register, m_fd, IORING_REGISTER_BUFFERS, buffers, count) == 0;
     }
 
-    output_file.write(header.data(), (int)header.size());
-    if(output_file.bad())
+    // Zeroed submission entry, nullptr when the submission ring is full.
+    io_uring_sqe * next_sqe()
     {
-        EVP_CIPHER_CTX_free(ctx);
-        input_file.close();
-        output_file.close();
-        return false;
-    }
+        unsigned head = std::atomic_ref<unsigned>(*m_sq_head).load(std::memory_order_acquire);
+        if (m_local_tail - head >= m_sq_entries)
+            return nullptr;
 
-    int block_size =  EVP_CIPHER_block_size(cypher_name);
-    std::vector<unsigned char> block(block_size);
-    std::vector<unsigned char> encrypted_block(block.size() + block_size);
-    int out_len = 0;
+        unsigned index = m_local_tail & m_sq_mask;
+        io_uring_sqe * sqe = &m_sqes[index];
+        std::memset(sqe, 0, sizeof(*sqe));
+        m_sq_array[index] = index;
+        ++m_local_tail;
+        return sqe;
+    }
 
-    while (!input_file.eof())
+    // Publishes the queued entries and waits until at least `wait_for` completions are available.
+    bool submit(unsigned wait_for)
     {
-        input_file.read((char*)block.data(), block_size);
-        if(input_file.bad())
-        {
-            EVP_CIPHER_CTX_free(ctx);
-            input_file.close();
-            output_file.close();
-            return false;
-        }
-
-        int bytes_read = (int)input_file.gcount();
-        if (!EVP_EncryptUpdate(ctx, encrypted_block.data(), &out_len, block.data(),  bytes_read))
-        {
-            EVP_CIPHER_CTX_free(ctx);
-            input_file.close();
-            output_file.close();
-            return false;
-        }
+        unsigned to_submit = m_local_tail - *m_sq_tail;
+        std::atomic_ref<unsigned>(*m_sq_tail).store(m_local_tail, std::memory_order_release);
 
-        output_file.write((char*)encrypted_block.data(), out_len);
-        if(output_file.bad())
+        while (true)
         {
-            EVP_CIPHER_CTX_free(ctx);
-            input_file.close();
-            output_file.close();
-            return false;
+            long res = ::syscall(__NR_io_uring_enter, m_fd, to_submit, wait_for, wait_for ? IORING_ENTER_GETEVENTS : 0, nullptr, 0);
+            if (res >= 0)
+                return true;
+            if (errno != EINTR)
+                return false;
+            // Entries may already have been consumed before the interruption, let the kernel report what is left.
+            to_submit = 0;
         }
     }
 
-    if (!EVP_EncryptFinal_ex(ctx, encrypted_block.data(), &out_len))
+    bool pop_completion(io_uring_cqe & cqe)
     {
-        EVP_CIPHER_CTX_free(ctx);
-        input_file.close();
-        output_file.close();
-        return false;
+        unsigned head = *m_cq_head;
+        if (head == std::atomic_ref<unsigned>(*m_cq_tail).load(std::memory_order_acquire))
+            return false;
+
+        cqe = m_cqes[head & m_cq_mask];
+        std::atomic_ref<unsigned>(*m_cq_head).store(head + 1, std::memory_order_release);
+        return true;
     }
 
-    output_file.write((char*)encrypted_block.data(), out_len);
-    if(output_file.bad())
+private:
+    void unmap_rings()
     {
-        EVP_CIPHER_CTX_free(ctx);
-        input_file.close();
-        output_file.close();
-        return false;
+        if (m_cq_ring != MAP_FAILED && m_cq_ring != m_sq_ring)
+            ::munmap(m_cq_ring, m_cq_ring_size);
+        if (m_sq_ring != MAP_FAILED)
+            ::munmap(m_sq_ring, m_sq_ring_size);
     }
 
-    EVP_CIPHER_CTX_free(ctx);
-    input_file.close();
-    output_file.close();
+    int m_fd = -1;
+    void * m_sq_ring = MAP_FAILED;
+    void * m_cq_ring = MAP_FAILED;
+    size_t m_sq_ring_size = 0;
+    size_t m_cq_ring_size = 0;
+    size_t m_sqes_size = 0;
 
-    return true;
-}
+    unsigned * m_sq_head = nullptr;
+    unsigned * m_sq_tail = nullptr;
+    unsigned * m_sq_array = nullptr;
+    unsigned m_sq_mask = 0;
+    unsigned m_sq_entries = 0;
+    unsigned m_local_tail = 0;
+    io_uring_sqe * m_sqes = nullptr;
 
-bool decrypt_data(const std::string & in_filename, const std::string & out_filename, crypto_config & config) {
-    OpenSSL_add_all_ciphers();
+    unsigned * m_cq_head = nullptr;
+    unsigned * m_cq_tail = nullptr;
+    unsigned m_cq_mask = 0;
+    io_uring_cqe * m_cqes = nullptr;
+};
+#endif
 
-    if(in_filename.empty() || out_filename.empty() || config.m_crypto_function == nullptr) return false;
+using cipher_ctx_ptr = std::unique_ptr<EVP_CIPHER_CTX, decltype(&EVP_CIPHER_CTX_free)>;
+using digest_ctx_ptr = std::unique_ptr<EVP_MD_CTX, decltype(&EVP_MD_CTX_free)>;
 
-    ifstream input_file(in_filename, std::ios::binary);
-    ofstream output_file(out_filename, std::ios::binary);
-    if (!(input_file.is_open()) || input_file.fail() || !(output_file.is_open()) || output_file.fail())
+static const EVP_MD * digest_algorithm(digest_kind kind)
+{
+    switch (kind)
     {
-        input_file.close();
-        output_file.close();
-        return false;
+        case digest_kind::sha256: return EVP_sha256();
+        case digest_kind::sha512: return EVP_sha512();
+        default: return nullptr;
     }
+}
 
-    const EVP_CIPHER * cypher_name = EVP_get_cipherbyname(config.m_crypto_function);
-    if(!cypher_name ||
-       (config.m_key == nullptr || (int)config.m_key_len < EVP_CIPHER_key_length(cypher_name)) ||
-       (EVP_CIPHER_iv_length(cypher_name) != 0 && (config.m_IV == nullptr || (int)config.m_IV_len < EVP_CIPHER_iv_length(cypher_name))) ||
-       !check_config(config, cypher_name)) {
-        input_file.close();
-        output_file.close();
-        return false;
-    }
+static const char * digest_extension(digest_kind kind)
+{
+    return kind == digest_kind::sha512 ? ".sha512" : ".sha256";
+}
 
-    EVP_CIPHER_CTX * ctx = EVP_CIPHER_CTX_new();
-    if(ctx == nullptr)
+static std::string to_hex(const uint8_t * data, size_t length)
+{
+    static const char digits[] = "0123456789abcdef";
+    std::string hex(2 * length, '0');
+    for (size_t i = 0; i < length; ++i)
     {
-        input_file.close();
-        output_file.close();
-        return false;
+        hex[2 * i] = digits[data[i] >> 4];
+        hex[2 * i + 1] = digits[data[i] & 0x0f];
     }
+    return hex;
+}
 
-    if(!EVP_DecryptInit_ex(ctx, cypher_name, nullptr, config.m_key.get(), config.m_IV.get()))
+/**
+ * Digests of what goes into the cipher and what comes out of it, fed chunk by chunk while the data is still in cache.
+ * `kind` selects the manifest digests (none to skip them), `content_sha256` additionally asks for the SHA-256 of the
+ * input, which is shared with the manifest one when that is SHA-256 as well.
+ */
+class stream_digests {
+public:
+    explicit stream_digests(digest_kind kind, bool content_sha256 = false)
+        : m_kind(kind), m_separate_content(content_sha256 && kind != digest_kind::sha256)
     {
-        EVP_CIPHER_CTX_free(ctx);
-        input_file.close();
-        output_file.close();
-        return false;
+        const EVP_MD * md = digest_algorithm(kind);
+        m_valid = (kind == digest_kind::none ||
+                   (md != nullptr && m_input && m_output &&
+                    EVP_DigestInit_ex(m_input.get(), md, nullptr) && EVP_DigestInit_ex(m_output.get(), md, nullptr))) &&
+                  (!m_separate_content || (m_content && EVP_DigestInit_ex(m_content.get(), EVP_sha256(), nullptr)));
     }
 
-    int header_size = 18;
-    vector<char> header(header_size);
+    bool valid() const { return m_valid; }
 
-    input_file.read(header.data(), header_size);
-    if(input_file.bad())
+    bool update_input(const uint8_t * data, size_t length)
     {
-        EVP_CIPHER_CTX_free(ctx);
-        input_file.close();
-        output_file.close();
-        return false;
+        return (m_kind == digest_kind::none || EVP_DigestUpdate(m_input.get(), data, length) == 1) &&
+               (!m_separate_content || EVP_DigestUpdate(m_content.get(), data, length) == 1);
     }
 
-    if(input_file.gcount() < header_size)
+    bool update_output(const uint8_t * data, size_t length)
     {
-        EVP_CIPHER_CTX_free(ctx);
-        input_file.close();
-        output_file.close();
-        return false;
+        return m_kind == digest_kind::none || EVP_DigestUpdate(m_output.get(), data, length) == 1;
     }
 
-    output_file.write(header.data(), (int)header.size());
-    if(output_file.bad())
+    bool finish()
     {
-        EVP_CIPHER_CTX_free(ctx);
-        input_file.close();
-        output_file.close();
-        return false;
+        uint8_t digest[EVP_MAX_MD_SIZE];
+        unsigned length = 0;
+        if (m_kind != digest_kind::none)
+        {
+            if (!EVP_DigestFinal_ex(m_input.get(), digest, &length))
+                return false;
+            m_input_hex = to_hex(digest, length);
+            if (m_kind == digest_kind::sha256)
+                std::memcpy(m_content_sha256, digest, SHA256_SIZE);
+            if (!EVP_DigestFinal_ex(m_output.get(), digest, &length))
+                return false;
+            m_output_hex = to_hex(digest, length);
+        }
+        return !m_separate_content || EVP_DigestFinal_ex(m_content.get(), m_content_sha256, &length);
     }
 
-    int block_size = EVP_CIPHER_block_size(cypher_name);
-    std::vector<unsigned char> block(block_size);
-    std::vector<unsigned char> encrypted_block(block.size() + block_size);
-    int out_len = 0;
+    // Lowercase hex, as printed by sha256sum/sha512sum.
+    const std::string & input_hex() const { return m_input_hex; }
+    const std::string & output_hex() const { return m_output_hex; }
+    const uint8_t * content_sha256() const { return m_content_sha256; }
+
+private:
+    digest_kind m_kind;
+    bool m_separate_content;
+    digest_ctx_ptr m_input {EVP_MD_CTX_new(), EVP_MD_CTX_free};
+    digest_ctx_ptr m_output {EVP_MD_CTX_new(), EVP_MD_CTX_free};
+    digest_ctx_ptr m_content {EVP_MD_CTX_new(), EVP_MD_CTX_free};
+    std::string m_input_hex;
+    std::string m_output_hex;
+    uint8_t m_content_sha256[SHA256_SIZE] {};
+    bool m_valid = false;
+};
 
-    while (!input_file.eof())
+/**
+ * Reads until `length` bytes are collected or EOF is reached; short reads from pipes and signals are retried.
+ * `calls`, when given, is incremented per read() issued.
+ */
+static bool read_full(int fd, uint8_t * data, size_t length, size_t & bytes_read, uint64_t * calls = nullptr)
+{
+    bytes_read = 0;
+    while (bytes_read < length)
     {
-        input_file.read((char*)block.data(), block_size);
-        if(input_file.bad())
+        if (calls) ++*calls;
+        ssize_t res = ::read(fd, data + bytes_read, length - bytes_read);
+        if (res < 0)
         {
-            EVP_CIPHER_CTX_free(ctx);
-            input_file.close();
-            output_file.close();
+            if (errno == EINTR) continue;
             return false;
         }
+        if (res == 0) break;
+        bytes_read += (size_t)res;
+    }
+    return true;
+}
 
-        int bytes_read = (int)input_file.gcount();
-        if (!EVP_DecryptUpdate(ctx, encrypted_block.data(), &out_len, block.data(), bytes_read))
+static bool write_full(int fd, const uint8_t * data, size_t length, uint64_t * calls = nullptr)
+{
+    while (length > 0)
+    {
+        if (calls) ++*calls;
+        ssize_t res = ::write(fd, data, length);
+        if (res < 0)
         {
-            EVP_CIPHER_CTX_free(ctx);
-            input_file.close();
-            output_file.close();
+            if (errno == EINTR) continue;
             return false;
         }
+        data += res;
+        length -= (size_t)res;
+    }
+    return true;
+}
+
+static uint64_t elapsed_ns(std::chrono::steady_clock::time_point since)
+{
+    return (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - since).count();
+}
+
+/**
+ * Adds phase timings and counters to a cipher_stats when one was requested. Without one every call is a single
+ * predictable branch; with `Enabled` false (TGA_CIPHER_STATS=0) the calls compile to nothing.
+ */
+template<bool Enabled = TGA_CIPHER_STATS != 0>
+class stats_recorder {
+public:
+    using field = uint64_t cipher_stats::*;
+
+    explicit stats_recorder(cipher_stats * stats) : m_stats(Enabled ? stats : nullptr) {}
+
+    // Starts a phase, ended by stop().
+    void start()
+    {
+        if constexpr (Enabled)
+            if (m_stats)
+                m_start = std::chrono::steady_clock::now();
+    }
+    void stop(field phase)
+    {
+        if constexpr (Enabled)
+            if (m_stats)
+                m_stats->*phase += elapsed_ns(m_start);
+    }
+    void count(field counter, uint64_t amount = 1)
+    {
+        if constexpr (Enabled)
+            if (m_stats)
+                m_stats->*counter += amount;
+    }
+    // Counter to hand to read_full()/write_full(), nullptr when nothing is recorded.
+    uint64_t * calls(field counter) const
+    {
+        if constexpr (Enabled)
+            return m_stats ? &(m_stats->*counter) : nullptr;
+        return nullptr;
+    }
+
+private:
+    cipher_stats * m_stats;
+    std::chrono::steady_clock::time_point m_start {};
+};
+
+static size_t effective_chunk_size(const crypto_config & config, int block_size)
+{
+    size_t chunk_size = std::clamp(config.m_chunk_size, MIN_CHUNK_SIZE, MAX_CHUNK_SIZE);
+    return chunk_size - chunk_size % std::max((size_t)block_size, COUNTER_BLOCK_SIZE);
+}
+
+static void store_le(uint8_t * data, uint64_t value, size_t length)
+{
+    for (size_t i = 0; i < length; ++i, value >>= 8)
+        data[i] = (uint8_t)value;
+}
+
+static uint64_t load_le(const uint8_t * data, size_t length)
+{
+    uint64_t value = 0;
+    for (size_t i = length; i-- > 0;)
+        value = (value << 8) | data[i];
+    return value;
+}
+
+/**
+ * Chunk size for buffers reading the rest of `in_fd`. For regular files it is capped just above what is left to read,
+ * so small files do not pay for allocating and clearing megabyte buffers and the loop ends on the first short read.
+ */
+static size_t buffer_chunk_size(int in_fd, const crypto_config & config, int block_size)
+{
+    size_t chunk_size = effective_chunk_size(config, block_size);
+    struct stat in_stat {};
+    off_t position = ::lseek(in_fd, 0, SEEK_CUR);
+    if (position >= 0 && ::fstat(in_fd, &in_stat) == 0 && S_ISREG(in_stat.st_mode) && in_stat.st_size >= position)
+    {
+        size_t remaining = (size_t)(in_stat.st_size - position);
+        chunk_size = std::min(chunk_size, remaining - remaining % COUNTER_BLOCK_SIZE + COUNTER_BLOCK_SIZE);
+    }
+    return chunk_size;
+}
 
-        output_file.write((char*)encrypted_block.data(), out_len);
-        if(output_file.bad())
+static unsigned effective_thread_count(const crypto_config & config)
+{
+    if (config.m_threads != 0)
+        return config.m_threads;
+    return std::max(1u, std::thread::hardware_concurrency());
+}
+
+static bool pread_full(int fd, uint8_t * data, size_t length, uint64_t offset)
+{
+    while (length > 0)
+    {
+        ssize_t res = ::pread(fd, data, length, (off_t)offset);
+        if (res < 0)
         {
-            EVP_CIPHER_CTX_free(ctx);
-            input_file.close();
-            output_file.close();
+            if (errno == EINTR) continue;
             return false;
         }
+        if (res == 0) return false;
+        data += res;
+        length -= (size_t)res;
+        offset += (uint64_t)res;
     }
+    return true;
+}
 
-    if (!EVP_DecryptFinal_ex(ctx, encrypted_block.data(), &out_len))
+static bool pwrite_full(int fd, const uint8_t * data, size_t length, uint64_t offset)
+{
+    while (length > 0)
     {
-        EVP_CIPHER_CTX_free(ctx);
-        input_file.close();
-        output_file.close();
-        return false;
+        ssize_t res = ::pwrite(fd, data, length, (off_t)offset);
+        if (res < 0)
+        {
+            if (errno == EINTR) continue;
+            return false;
+        }
+        data += res;
+        length -= (size_t)res;
+        offset += (uint64_t)res;
     }
+    return true;
+}
 
-    output_file.write((char*)encrypted_block.data(), out_len);
-    if(output_file.bad())
-    {
-        EVP_CIPHER_CTX_free(ctx);
-        input_file.close();
-        output_file.close();
+// Digest of a whole file, read in DEFAULT_CHUNK_SIZE pieces.
+static bool digest_file(const std::string & filename, const EVP_MD * md, std::vector<uint8_t> & digest)
+{
+    digest_ctx_ptr ctx(EVP_MD_CTX_new(), EVP_MD_CTX_free);
+    file_descriptor file(::open(filename.c_str(), O_RDONLY | O_CLOEXEC));
+    if (md == nullptr || !ctx || !file.valid() || !EVP_DigestInit_ex(ctx.get(), md, nullptr))
         return false;
-    }
 
-    EVP_CIPHER_CTX_free(ctx);
-    input_file.close();
-    output_file.close();
+    std::vector<uint8_t> chunk(DEFAULT_CHUNK_SIZE);
+    size_t bytes_read = 0;
+    do
+    {
+        if (!read_full(file.get(), chunk.data(), chunk.size(), bytes_read) || !EVP_DigestUpdate(ctx.get(), chunk.data(), bytes_read))
+            return false;
+    } while (bytes_read == chunk.size());
 
+    unsigned length = 0;
+    digest.resize(EVP_MAX_MD_SIZE);
+    if (!EVP_DigestFinal_ex(ctx.get(), digest.data(), &length))
+        return false;
+    digest.resize(length);
     return true;
 }
 
-static bool compare_files(const std::string& a, const std::string& b)
+// Runs `worker` on `threads` threads (the calling one included) and reports whether all of them succeeded.
+template <typename Worker>
+static bool run_workers(unsigned threads, Worker worker)
 {
-    std::ifstream fa(a, std::ios::binary);
-    std::ifstream fb(b, std::ios::binary);
-    if (!fa.is_open() || !fb.is_open())
-        return false;
+    std::atomic<bool> success {true};
+    std::vector<std::thread> pool;
+    pool.reserve(threads - 1);
 
-    constexpr std::size_t BUF_SIZE = 1u << 20;
-    std::vector<unsigned char> ba(BUF_SIZE);
-    std::vector<unsigned char> bb(BUF_SIZE);
+    for (unsigned i = 1; i < threads; ++i)
+        pool.emplace_back([&] { if (!worker()) success = false; });
+    if (!worker())
+        success = false;
 
-    while (true)
+    for (std::thread & thread : pool)
+        thread.join();
+    return success;
+}
+
+// Adds `blocks` to the big-endian 128-bit counter in `counter`, the same way CTR mode advances it.
+static void advance_counter(uint8_t * counter, uint64_t blocks)
+{
+    for (int i = (int)COUNTER_BLOCK_SIZE - 1; i >= 0 && blocks != 0; --i)
     {
-        fa.read(reinterpret_cast<char*>(ba.data()),BUF_SIZE);
-        fb.read(reinterpret_cast<char*>(bb.data()),BUF_SIZE);
+        blocks += counter[i];
+        counter[i] = (uint8_t)blocks;
+        blocks >>= 8;
+    }
+}
 
-        const std::streamsize ra = fa.gcount();
-        const std::streamsize rb = fb.gcount();
+struct batch_job {
+    std::string m_input;
+    std::string m_output;
+};
+
+struct batch_result {
+    std::string m_input;
+    std::string m_output;
+    uint64_t m_size = 0;
+    bool m_success = false;
+    bool m_skipped = false;     // unchanged since the last encrypt_incremental() run, nothing was rewritten
+    cipher_stats m_stats;       // filled when the config asks for `m_stats`
+};
+
+/**
+ * Jobs are dealt out to one deque per worker. A worker takes from the front of its own deque and, once that is empty,
+ * steals from the back of the others, so the owner and the thieves rarely contend for the same end.
+ */
+class work_stealing_queue {
+public:
+    explicit work_stealing_queue(unsigned workers) : m_queues(workers) {}
 
-        if (ra != rb) return false;
-        if (ra == 0) break;
-        if (std::memcmp(ba.data(), bb.data(), static_cast<std::size_t>(ra)) != 0) return false;
-        if (fa.bad() || fb.bad()) return false;
+    void push(unsigned worker, size_t job)
+    {
+        std::lock_guard<std::mutex> lock(m_queues[worker].m_mutex);
+        m_queues[worker].m_jobs.push_back(job);
     }
 
-    if (fa.bad() || fb.bad()) return false;
+    bool pop(unsigned worker, size_t & job)
+    {
+        {
+            worker_queue & own = m_queues[worker];
+            std::lock_guard<std::mutex> lock(own.m_mutex);
+            if (!own.m_jobs.empty())
+            {
+                job = own.m_jobs.front();
+                own.m_jobs.pop_front();
+                return true;
+            }
+        }
+
+        for (size_t i = 1; i < m_queues.size(); ++i)
+        {
+            worker_queue & victim = m_queues[(worker + i) % m_queues.size()];
+            std::lock_guard<std::mutex> lock(victim.m_mutex);
+            if (!victim.m_jobs.empty())
+            {
+                job = victim.m_jobs.back();
+                victim.m_jobs.pop_back();
+                return true;
+            }
+        }
+        return false;
+    }
 
-    return true;
-}
+private:
+    struct worker_queue {
+        std::mutex m_mutex;
+        std::deque<size_t> m_jobs;
+    };
 
+    std::vector<worker_queue> m_queues;
+};
 
-int main ()
+// Runs `process(job)` for every entry of `results` on up to `threads` workers, largest m_size first.
+template <typename Process>
+static void run_largest_first(const std::vector<batch_result> & results, unsigned threads, Process process)
 {
-    crypto_config config {nullptr, nullptr, nullptr, 0, 0};
+    if (results.empty())
+        return;
 
-    // ECB mode
-    config.m_crypto_function = "AES-128-ECB";
-    config.m_key = std::make_unique<uint8_t[]>(16);
-    memset(config.m_key.get(), 0, 16);
-    config.m_key_len = 16;
+    // Largest first, so a big file picked up late does not leave every other worker idle at the end.
+    std::vector<size_t> order(results.size());
+    std::iota(order.begin(), order.end(), 0);
+    std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) { return results[a].m_size > results[b].m_size; });
 
-    assert( encrypt_data  ("testfiles/homer-simpson.TGA", "testfiles/out_file.TGA", config) &&
-            compare_files ("testfiles/out_file.TGA", "testfiles/homer-simpson_enc_ecb.TGA") );
+    threads = (unsigned)std::min<size_t>(std::max(1u, threads), results.size());
+    work_stealing_queue queue(threads);
+    for (size_t i = 0; i < order.size(); ++i)
+        queue.push((unsigned)(i % threads), order[i]);
 
-    assert( decrypt_data  ("testfiles/homer-simpson_enc_ecb.TGA", "testfiles/out_file.TGA", config) &&
-            compare_files ("testfiles/out_file.TGA", "testfiles/homer-simpson.TGA") );
+    std::atomic<unsigned> next_worker {0};
+    run_workers(threads, [&]
+    {
+        unsigned worker = next_worker++;
+        size_t job = 0;
+        while (queue.pop(worker, job))
+            process(job);
+        return true;
+    });
+}
 
-    assert( encrypt_data  ("testfiles/UCM8.TGA", "testfiles/out_file.TGA", config) &&
-            compare_files ("testfiles/out_file.TGA", "testfiles/UCM8_enc_ecb.TGA") );
+struct incremental_report {
+    std::vector<batch_result> m_results;    // per job, skipped files count as successful
+    size_t m_skipped = 0;
+    uint64_t m_bytes_saved = 0;             // input bytes that did not have to be encrypted and written again
+};
 
-    assert( decrypt_data  ("testfiles/UCM8_enc_ecb.TGA", "testfiles/out_file.TGA", config) &&
-            compare_files ("testfiles/out_file.TGA", "testfiles/UCM8.TGA") );
+/**
+ * Expanded AES key in the byte order AES-NI expects, for aes_multi_buffer(). The schedule is computed in plain C++
+ * (FIPS-197 key expansion), the decryption keys are derived from it with AESIMC when the CPU has AES-NI.
+ */
+class aes_round_keys {
+public:
+    aes_round_keys() = default;
+    aes_round_keys(const aes_round_keys &) = delete;
+    aes_round_keys & operator=(const aes_round_keys &) = delete;
+    ~aes_round_keys() { OPENSSL_cleanse(this, sizeof(*this)); }
 
-    assert( encrypt_data  ("testfiles/image_1.TGA", "testfiles/out_file.TGA", config) &&
-            compare_files ("testfiles/out_file.TGA", "testfiles/ref_1_enc_ecb.TGA") );
+    bool expand(const uint8_t * key, size_t key_length);
 
-    assert( encrypt_data  ("testfiles/image_2.TGA", "testfiles/out_file.TGA", config) &&
-            compare_files ("testfiles/out_file.TGA", "testfiles/ref_2_enc_ecb.TGA") );
+    int rounds() const { return m_rounds; }
+    const uint8_t * encryption() const { return m_encryption[0]; }
+    const uint8_t * decryption() const { return m_decryption[0]; }
 
-    assert( decrypt_data ("testfiles/image_3_enc_ecb.TGA", "testfiles/out_file.TGA", config)  &&
-            compare_files("testfiles/out_file.TGA", "testfiles/ref_3_dec_ecb.TGA") );
+private:
+    alignas(16) uint8_t m_encryption[15][16] {};
+    alignas(16) uint8_t m_decryption[15][16] {};
+    int m_rounds = 0;
+};
 
-    assert( decrypt_data ("testfiles/image_4_enc_ecb.TGA", "testfiles/out_file.TGA", config)  &&
-            compare_files("testfiles/out_file.TGA", "testfiles/ref_4_dec_ecb.TGA") );
+static const uint8_t AES_SBOX[256] = {
+    0x63, 0x7c, 0x77, 0x7b, 0xf2, 0x6b, 0x6f, 0xc5, 0x30, 0x01, 0x67, 0x2b, 0xfe, 0xd7, 0xab, 0x76,
+    0xca, 0x82, 0xc9, 0x7d, 0xfa, 0x59, 0x47, 0xf0, 0xad, 0xd4, 0xa2, 0xaf, 0x9c, 0xa4, 0x72, 0xc0,
+    0xb7, 0xfd, 0x93, 0x26, 0x36, 0x3f, 0xf7, 0xcc, 0x34, 0xa5, 0xe5, 0xf1, 0x71, 0xd8, 0x31, 0x15,
+    0x04, 0xc7, 0x23, 0xc3, 0x18, 0x96, 0x05, 0x9a, 0x07, 0x12, 0x80, 0xe2, 0xeb, 0x27, 0xb2, 0x75,
+    0x09, 0x83, 0x2c, 0x1a, 0x1b, 0x6e, 0x5a, 0xa0, 0x52, 0x3b, 0xd6, 0xb3, 0x29, 0xe3, 0x2f, 0x84,
+    0x53, 0xd1, 0x00, 0xed, 0x20, 0xfc, 0xb1, 0x5b, 0x6a, 0xcb, 0xbe, 0x39, 0x4a, 0x4c, 0x58, 0xcf,
+    0xd0, 0xef, 0xaa, 0xfb, 0x43, 0x4d, 0x33, 0x85, 0x45, 0xf9, 0x02, 0x7f, 0x50, 0x3c, 0x9f, 0xa8,
+    0x51, 0xa3, 0x40, 0x8f, 0x92, 0x9d, 0x38, 0xf5, 0xbc, 0xb6, 0xda, 0x21, 0x10, 0xff, 0xf3, 0xd2,
+    0xcd, 0x0c, 0x13, 0xec, 0x5f, 0x97, 0x44, 0x17, 0xc4, 0xa7, 0x7e, 0x3d, 0x64, 0x5d, 0x19, 0x73,
+    0x60, 0x81, 0x4f, 0xdc, 0x22, 0x2a, 0x90, 0x88, 0x46, 0xee, 0xb8, 0x14, 0xde, 0x5e, 0x0b, 0xdb,
+    0xe0, 0x32, 0x3a, 0x0a, 0x49, 0x06, 0x24, 0x5c, 0xc2, 0xd3, 0xac, 0x62, 0x91, 0x95, 0xe4, 0x79,
+    0xe7, 0xc8, 0x37, 0x6d, 0x8d, 0xd5, 0x4e, 0xa9, 0x6c, 0x56, 0xf4, 0xea, 0x65, 0x7a, 0xae, 0x08,
+    0xba, 0x78, 0x25, 0x2e, 0x1c, 0xa6, 0xb4, 0xc6, 0xe8, 0xdd, 0x74, 0x1f, 0x4b, 0xbd, 0x8b, 0x8a,
+    0x70, 0x3e, 0xb5, 0x66, 0x48, 0x03, 0xf6, 0x0e, 0x61, 0x35, 0x57, 0xb9, 0x86, 0xc1, 0x1d, 0x9e,
+    0xe1, 0xf8, 0x98, 0x11, 0x69, 0xd9, 0x8e, 0x94, 0x9b, 0x1e, 0x87, 0xe9, 0xce, 0x55, 0x28, 0xdf,
+    0x8c, 0xa1, 0x89, 0x0d, 0xbf, 0xe6, 0x42, 0x68, 0x41, 0x99, 0x2d, 0x0f, 0xb0, 0x54, 0xbb, 0x16,
+};
 
-    // CBC mode
-    config.m_crypto_function = "AES-128-CBC";
-    config.m_IV = std::make_unique<uint8_t[]>(16);
-    config.m_IV_len = 16;
-    memset(config.m_IV.get(), 0, 16);
+enum class aes_lane_mode {
+    ecb_encrypt,
+    ecb_decrypt,
+    ctr,
+};
 
-    assert( encrypt_data  ("testfiles/UCM8.TGA", "testfiles/out_file.TGA", config) &&
-            compare_files ("testfiles/out_file.TGA", "testfiles/UCM8_enc_cbc.TGA") );
+// One independent stream for aes_multi_buffer(): `m_blocks` whole blocks from `m_in` to `m_out` (which may be equal).
+struct aes_lane_job {
+    const aes_round_keys * m_keys = nullptr;
+    const uint8_t * m_in = nullptr;
+    uint8_t * m_out = nullptr;
+    size_t m_blocks = 0;
+    uint8_t m_counter[16] {};       // initial counter block in CTR mode
+};
 
-    assert( decrypt_data  ("testfiles/UCM8_enc_cbc.TGA", "testfiles/out_file.TGA", config) &&
-            compare_files ("testfiles/out_file.TGA", "testfiles/UCM8.TGA") );
+#if defined(__x86_64__) || defined(__i386__)
+static bool has_aes_ni()
+{
+    static const bool supported = []
+    {
+        __builtin_cpu_init();
+        return __builtin_cpu_supports("aes") && __builtin_cpu_supports("sse2");
+    }();
+    return supported;
+}
 
-    assert( encrypt_data  ("testfiles/homer-simpson.TGA", "testfiles/out_file.TGA", config) &&
-            compare_files ("testfiles/out_file.TGA", "testfiles/homer-simpson_enc_cbc.TGA") );
+__attribute__((target("aes,sse2")))
+static void derive_decryption_keys(const uint8_t (*encryption)[16], uint8_t (*decryption)[16], int rounds)
+{
+    _mm_store_si128((__m128i*)decryption[0], _mm_load_si128((const __m128i*)encryption[rounds]));
+    for (int i = 1; i < rounds; ++i)
+        _mm_store_si128((__m128i*)decryption[i], _mm_aesimc_si128(_mm_load_si128((const __m128i*)encryption[rounds - i])));
+    _mm_store_si128((__m128i*)decryption[rounds], _mm_load_si128((const __m128i*)encryption[0]));
+}
 
-    assert( decrypt_data  ("testfiles/homer-simpson_enc_cbc.TGA", "testfiles/out_file.TGA", config) &&
-            compare_files ("testfiles/out_file.TGA", "testfiles/homer-simpson.TGA") );
+struct aes_lane_state {
+    const __m128i * m_round_keys;
+    const uint8_t * m_in;
+    uint8_t * m_out;
+    size_t m_stride;                // 0 for idle lanes, which spin on a scratch block
+    uint64_t m_counter_high;        // CTR counter, big-endian halves held in native order
+    uint64_t m_counter_low;
+};
 
-    assert( encrypt_data  ("testfiles/image_1.TGA", "testfiles/out_file.TGA", config) &&
-            compare_files ("testfiles/out_file.TGA", "testfiles/ref_5_enc_cbc.TGA") );
+/**
+ * Runs `blocks` blocks on all AES_LANES lanes in lockstep. Every round is issued for all lanes back to back, so the
+ * AESENC/AESDEC latency of one lane is hidden behind the others instead of stalling a single dependency chain.
+ */
+__attribute__((target("aes,sse2")))
+static void aes_lanes_step(aes_lane_state * lanes, size_t blocks, int rounds, aes_lane_mode mode)
+{
+    for (size_t block = 0; block < blocks; ++block)
+    {
+        __m128i state[AES_LANES];
+        for (size_t lane = 0; lane < AES_LANES; ++lane)
+        {
+            __m128i input = mode == aes_lane_mode::ctr
+                            ? _mm_set_epi64x((long long)__builtin_bswap64(lanes[lane].m_counter_low), (long long)__builtin_bswap64(lanes[lane].m_counter_high))
+                            : _mm_loadu_si128((const __m128i*)lanes[lane].m_in);
+            state[lane] = _mm_xor_si128(input, _mm_load_si128(lanes[lane].m_round_keys));
+        }
 
-    assert( encrypt_data  ("testfiles/image_2.TGA", "testfiles/out_file.TGA", config) &&
-            compare_files ("testfiles/out_file.TGA", "testfiles/ref_6_enc_cbc.TGA") );
+        if (mode == aes_lane_mode::ecb_decrypt)
+        {
+            for (int round = 1; round < rounds; ++round)
+                for (size_t lane = 0; lane < AES_LANES; ++lane)
+                    state[lane] = _mm_aesdec_si128(state[lane], _mm_load_si128(lanes[lane].m_round_keys + round));
+            for (size_t lane = 0; lane < AES_LANES; ++lane)
+                state[lane] = _mm_aesdeclast_si128(state[lane], _mm_load_si128(lanes[lane].m_round_keys + rounds));
+        }
+        else
+        {
+            for (int round = 1; round < rounds; ++round)
+                for (size_t lane = 0; lane < AES_LANES; ++lane)
+                    state[lane] = _mm_aesenc_si128(state[lane], _mm_load_si128(lanes[lane].m_round_keys + round));
+            for (size_t lane = 0; lane < AES_LANES; ++lane)
+                state[lane] = _mm_aesenclast_si128(state[lane], _mm_load_si128(lanes[lane].m_round_keys + rounds));
+        }
 
-    assert( decrypt_data ("testfiles/image_7_enc_cbc.TGA", "testfiles/out_file.TGA", config)  &&
-            compare_files("testfiles/out_file.TGA", "testfiles/ref_7_dec_cbc.TGA") );
+        for (size_t lane = 0; lane < AES_LANES; ++lane)
+        {
+            aes_lane_state & current = lanes[lane];
+            if (mode == aes_lane_mode::ctr)
+            {
+                state[lane] = _mm_xor_si128(state[lane], _mm_loadu_si128((const __m128i*)current.m_in));
+                if (++current.m_counter_low == 0)
+                    ++current.m_counter_high;
+            }
+            _mm_storeu_si128((__m128i*)current.m_out, state[lane]);
+            current.m_in += current.m_stride;
+            current.m_out += current.m_stride;
+        }
+    }
+}
+#else
+static bool has_aes_ni() { return false; }
+#endif
 
-    assert( decrypt_data ("testfiles/image_8_enc_cbc.TGA", "testfiles/out_file.TGA", config)  &&
-            compare_files("testfiles/out_file.TGA", "testfiles/ref_8_dec_cbc.TGA") );
+bool aes_round_keys::expand(const uint8_t * key, size_t key_length)
+{
+    if (key_length != 16 && key_length != 24 && key_length != 32)
+        return false;
+
+    size_t key_words = key_length / 4;
+    m_rounds = (int)key_words + 6;
+    uint8_t * words = m_encryption[0];
+    std::memcpy(words, key, key_length);
+
+    uint8_t round_constant = 1;
+    for (size_t i = key_words; i < 4 * (size_t)(m_rounds + 1); ++i)
+    {
+        uint8_t temp[4];
+        std::memcpy(temp, words + 4 * (i - 1), 4);
+        if (i % key_words == 0)
+        {
+            uint8_t first = temp[0];
+            temp[0] = AES_SBOX[temp[1]] ^ round_constant;
+            temp[1] = AES_SBOX[temp[2]];
+            temp[2] = AES_SBOX[temp[3]];
+            temp[3] = AES_SBOX[first];
+            round_constant = (uint8_t)((round_constant << 1) ^ ((round_constant & 0x80) ? 0x1b : 0));
+        }
+        else if (key_words > 6 && i % key_words == 4)
+        {
+            for (uint8_t & byte : temp)
+                byte = AES_SBOX[byte];
+        }
+        for (size_t j = 0; j < 4; ++j)
+            words[4 * i + j] = words[4 * (i - key_words) + j] ^ temp[j];
+    }
+
+#if defined(__x86_64__) || defined(__i386__)
+    if (has_aes_ni())
+        derive_decryption_keys(m_encryption, m_decryption, m_rounds);
+#endif
+    return true;
+}
+
+/**
+ * Multi-buffer AES (ECB or CTR) over many independent jobs, possibly with different keys of the same length.
+ * AES_LANES jobs run interleaved; whenever the shortest of them is done its lane is refilled with the next job,
+ * so short files keep the AES units busy instead of each paying a full pipeline latency per block.
+ * Returns false when AES-NI is not available or the key lengths differ; the caller then uses EVP.
+ */
+static bool aes_multi_buffer(std::span<aes_lane_job> jobs, aes_lane_mode mode)
+{
+    if (!has_aes_ni())
+        return false;
+    for (const aes_lane_job & job : jobs)
+        if (job.m_keys == nullptr || job.m_keys->rounds() != jobs[0].m_keys->rounds())
+            return false;
+    int rounds = jobs.empty() ? 0 : jobs[0].m_keys->rounds();
+
+#if defined(__x86_64__) || defined(__i386__)
+    alignas(16) uint8_t scratch[16] {};
+    aes_lane_state lanes[AES_LANES];
+    size_t remaining[AES_LANES] {};
+    size_t next_job = 0;
+
+    auto fill = [&](size_t lane)
+    {
+        while (next_job < jobs.size() && jobs[next_job].m_blocks == 0)
+            ++next_job;
+        aes_lane_state & state = lanes[lane];
+        if (next_job == jobs.size())
+        {
+            // Idle lane: keeps the step uniform, works on scratch with whatever keys it had.
+            state = {reinterpret_cast<const __m128i*>(jobs[0].m_keys->encryption()), scratch, scratch, 0, 0, 0};
+            remaining[lane] = 0;
+            return;
+        }
+
+        const aes_lane_job & job = jobs[next_job++];
+        uint64_t high = 0, low = 0;
+        std::memcpy(&high, job.m_counter, 8);
+        std::memcpy(&low, job.m_counter + 8, 8);
+        const uint8_t * keys = mode == aes_lane_mode::ecb_decrypt ? job.m_keys->decryption() : job.m_keys->encryption();
+        state = {reinterpret_cast<const __m128i*>(keys), job.m_in, job.m_out, 16, __builtin_bswap64(high), __builtin_bswap64(low)};
+        remaining[lane] = job.m_blocks;
+    };
+
+    if (jobs.empty())
+        return true;
+    for (size_t lane = 0; lane < AES_LANES; ++lane)
+        fill(lane);
+
+    while (true)
+    {
+        size_t blocks = SIZE_MAX;
+        for (size_t lane = 0; lane < AES_LANES; ++lane)
+            if (remaining[lane] != 0)
+                blocks = std::min(blocks, remaining[lane]);
+        if (blocks == SIZE_MAX)
+            return true;
+
+        aes_lanes_step(lanes, blocks, rounds, mode);
+        for (size_t lane = 0; lane < AES_LANES; ++lane)
+            if (remaining[lane] != 0 && (remaining[lane] -= blocks) == 0)
+                fill(lane);
+    }
+#else
+    (void)mode;
+    return false;
+#endif
+}
+
+/**
+ * Long-lived cipher state built around a crypto_config. The cipher is fetched once, one context per direction is keyed
+ * once and serves as a template, and the contexts handed out by acquire() are recycled through a pool, so every further
+ * file, buffer or worker thread only pays for an IV reset instead of a cipher lookup, allocation and key schedule.
+ * Key material is taken from the config at construction, the remaining options (chunk size, I/O mode, threads, ...)
+ * are read from it on every call, so the config has to outlive the engine.
+ */
+class crypto_engine {
+public:
+    // Returns its context to the engine's pool when it goes out of scope.
+    class context_lease {
+    public:
+        context_lease() = default;
+        context_lease(crypto_engine * engine, bool encrypt, EVP_CIPHER_CTX * ctx) : m_engine(engine), m_encrypt(encrypt), m_ctx(ctx) {}
+        context_lease(context_lease && other) noexcept
+            : m_engine(other.m_engine), m_encrypt(other.m_encrypt), m_ctx(std::exchange(other.m_ctx, nullptr)) {}
+        context_lease(const context_lease &) = delete;
+        context_lease & operator=(const context_lease &) = delete;
+        ~context_lease() { if (m_ctx) m_engine->release(m_encrypt, m_ctx); }
+
+        EVP_CIPHER_CTX * get() const { return m_ctx; }
+        explicit operator bool() const { return m_ctx != nullptr; }
+
+    private:
+        crypto_engine * m_engine = nullptr;
+        bool m_encrypt = true;
+        EVP_CIPHER_CTX * m_ctx = nullptr;
+    };
+
+    // Aligned buffer from the engine's pool, handed back when it goes out of scope.
+    class buffer_lease {
+    public:
+        buffer_lease() = default;
+        buffer_lease(crypto_engine * engine, uint8_t * data, size_t size) : m_engine(engine), m_data(data), m_size(size) {}
+        buffer_lease(buffer_lease && other) noexcept
+            : m_engine(other.m_engine), m_data(std::exchange(other.m_data, nullptr)), m_size(other.m_size) {}
+        buffer_lease(const buffer_lease &) = delete;
+        buffer_lease & operator=(const buffer_lease &) = delete;
+        ~buffer_lease() { if (m_data) m_engine->release_buffer(m_data, m_size); }
+
+        uint8_t * data() const { return m_data; }
+        size_t size() const { return m_size; }
+        explicit operator bool() const { return m_data != nullptr; }
+
+    private:
+        crypto_engine * m_engine = nullptr;
+        uint8_t * m_data = nullptr;
+        size_t m_size = 0;
+    };
+
+    /**
+     * Missing or too short key/IV are generated like check_config() does, unless `generate_missing_key` is false
+     * (decryption can not make them up), in which case the engine is left invalid.
+     */
+    explicit crypto_engine(crypto_config & config, bool generate_missing_key = true);
+    ~crypto_engine() { OPENSSL_cleanse(m_iv.data(), m_iv.size()); }
+    crypto_engine(const crypto_engine &) = delete;
+    crypto_engine & operator=(const crypto_engine &) = delete;
+
+    bool valid() const { return m_cipher != nullptr; }
+    const EVP_CIPHER * cipher() const { return m_cipher; }
+    const crypto_config & config() const { return m_config; }
+    // IV the config carried at construction, nullptr for modes without one.
+    const uint8_t * iv() const { return m_iv.empty() ? nullptr : m_iv.data(); }
+
+    // A keyed context reset to `iv` (the engine's IV when omitted) with padding enabled.
+    context_lease acquire(bool encrypt) { return acquire(encrypt, iv()); }
+    context_lease acquire(bool encrypt, const uint8_t * iv);
+    // At least `size` bytes aligned to DIRECT_IO_ALIGNMENT, recycled between calls like the contexts.
+    buffer_lease acquire_buffer(size_t size);
+
+    bool encrypt_file(const std::string & in_filename, const std::string & out_filename) { return cipher_file(in_filename, out_filename, true, effective_thread_count(m_config), m_config.m_stats); }
+    bool decrypt_file(const std::string & in_filename, const std::string & out_filename) { return cipher_file(in_filename, out_filename, false, effective_thread_count(m_config), m_config.m_stats); }
+
+    /**
+     * Processes whatever `in_fd` delivers until EOF into `out_fd`: pipes, sockets, terminals or files from their
+     * current offset. Memory stays bounded by two chunks whatever the input size; neither descriptor is closed.
+     * `m_io_mode`, `m_threads` and `m_digest` only apply to files opened by name and are ignored here.
+     */
+    bool encrypt_fd(int in_fd, int out_fd) { return cipher_fd(in_fd, out_fd, true); }
+    bool decrypt_fd(int in_fd, int out_fd) { return cipher_fd(in_fd, out_fd, false); }
+
+    /**
+     * Output bytes needed for an `in_size` byte image (header included): the padded size when encrypting,
+     * an upper bound equal to the input size when decrypting.
+     */
+    size_t output_size(size_t in_size, bool encrypt) const;
+
+    /**
+     * In-memory counterparts of encrypt_file()/decrypt_file(). `out` may be the very same memory as `in` (in-place),
+     * any other overlap is rejected. When `out` is too small nothing is written, `out_size` reports the required size
+     * and false is returned; otherwise `out_size` is the number of bytes produced. Nothing is allocated once the
+     * engine's context pool is warm.
+     */
+    bool encrypt_buffer(std::span<const uint8_t> in, std::span<uint8_t> out, size_t & out_size) { return cipher_buffer(in, out, out_size, true); }
+    bool decrypt_buffer(std::span<const uint8_t> in, std::span<uint8_t> out, size_t & out_size) { return cipher_buffer(in, out, out_size, false); }
+
+    /**
+     * Processes many files concurrently on `m_threads` workers, each file on a single thread. Larger files are
+     * scheduled first and idle workers steal queued files from busy ones; the result of every file is reported
+     * at the index of its job.
+     */
+    std::vector<batch_result> encrypt_batch(const std::vector<batch_job> & jobs) { return cipher_batch(jobs, true); }
+    std::vector<batch_result> decrypt_batch(const std::vector<batch_job> & jobs) { return cipher_batch(jobs, false); }
+
+    /**
+     * encrypt_batch() that skips jobs recorded in the index file as already done with the same cipher, key, RLE
+     * stage and digest kind, as long as the output (and its digest manifest, if any) still exists and the input has
+     * the recorded size and either the recorded mtime or, failing that, the recorded SHA-256. The index is updated
+     * (atomically replaced) at the end; entries of jobs that are not part of this run are kept.
+     */
+    incremental_report encrypt_incremental(const std::vector<batch_job> & jobs, const std::string & index_filename);
+
+    /**
+     * Seekable container for AEAD ciphers (AES-GCM, ChaCha20-Poly1305): the payload is sealed in independent
+     * `m_chunk_size` chunks on `m_threads` workers, so any part of it can later be decrypted and authenticated
+     * on its own. See container_reader for the layout.
+     */
+    bool encrypt_container(const std::string & in_filename, const std::string & out_filename);
+    bool decrypt_container(const std::string & in_filename, const std::string & out_filename);
+    // `length` bytes of the original image starting at `offset` (header included), decrypting only the chunks involved.
+    bool decrypt_range(const std::string & filename, uint64_t offset, size_t length, std::vector<uint8_t> & out);
+
+private:
+    using cipher_ptr = std::unique_ptr<EVP_CIPHER, decltype(&EVP_CIPHER_free)>;
+
+    void release(bool encrypt, EVP_CIPHER_CTX * ctx);
+    void release_buffer(uint8_t * data, size_t size);
+    bool cipher_file(const std::string & in_filename, const std::string & out_filename, bool encrypt, unsigned threads,
+                     cipher_stats * stats, uint8_t * content_sha256 = nullptr);
+    bool cipher_opened(const std::string & in_filename, const std::string & out_filename, file_descriptor & input_file,
+                       file_descriptor & output_file, bool encrypt, unsigned threads, cipher_stats * stats, uint8_t * content_sha256);
+    bool cipher_digested(const std::string & in_filename, const std::string & out_filename, int in_fd,
+                         file_descriptor & output_file, bool encrypt, cipher_stats * stats, uint8_t * content_sha256);
+    // Where a batch job records its cipher_stats: its batch_result when `m_stats` is set, nowhere otherwise.
+    cipher_stats * job_stats(batch_result & result) const { return m_config.m_stats ? &result.m_stats : nullptr; }
+    bool cipher_fd(int in_fd, int out_fd, bool encrypt);
+    std::vector<batch_result> cipher_batch(const std::vector<batch_job> & jobs, bool encrypt);
+    void cipher_small_files(const std::vector<batch_job> & jobs, const std::vector<size_t> & files,
+                            std::vector<batch_result> & results, bool encrypt);
+    bool cipher_buffer(std::span<const uint8_t> in, std::span<uint8_t> out, size_t & out_size, bool encrypt);
+
+    crypto_config & m_config;
+    cipher_ptr m_fetched_cipher {nullptr, EVP_CIPHER_free};
+    const EVP_CIPHER * m_cipher = nullptr;
+    std::vector<uint8_t> m_iv;
+    cipher_ctx_ptr m_templates[2] {{nullptr, EVP_CIPHER_CTX_free}, {nullptr, EVP_CIPHER_CTX_free}};
+    std::mutex m_pool_mutex;
+    std::vector<cipher_ctx_ptr> m_pool[2];
+    std::vector<std::pair<size_t, std::unique_ptr<uint8_t, decltype(&std::free)>>> m_buffers;
+    uint8_t m_key_id[KEY_ID_SIZE] {};   // identifies cipher, key and IV in the incremental index without revealing them
+    aes_round_keys m_lane_keys;         // AES-ECB/CTR key for cipher_small_files(), valid when m_multi_buffer is set
+    bool m_multi_buffer = false;        // AES-NI and an AES-ECB/CTR cipher, cipher_small_files() interleaves small batch files
+};
+
+crypto_engine::crypto_engine(crypto_config & config, bool generate_missing_key)
+    : m_config(config)
+{
+    OpenSSL_add_all_ciphers();
+    if (config.m_crypto_function == nullptr)
+        return;
+
+    // An explicitly fetched cipher spares every EVP_CipherInit_ex the implicit provider lookup of a legacy EVP_CIPHER.
+    m_fetched_cipher.reset(EVP_CIPHER_fetch(nullptr, config.m_crypto_function, nullptr));
+    const EVP_CIPHER * cypher_name = m_fetched_cipher ? m_fetched_cipher.get() : EVP_get_cipherbyname(config.m_crypto_function);
+    if (!cypher_name)
+        return;
+
+    // AEAD ciphers are only used by the containers, which carry their own nonces.
+    bool needs_iv = EVP_CIPHER_iv_length(cypher_name) != 0 && !(EVP_CIPHER_flags(cypher_name) & EVP_CIPH_FLAG_AEAD_CIPHER);
+    if (!generate_missing_key &&
+        ((config.m_key == nullptr || (int)config.m_key_len < EVP_CIPHER_key_length(cypher_name)) ||
+         (needs_iv && (config.m_IV == nullptr || (int)config.m_IV_len < EVP_CIPHER_iv_length(cypher_name)))))
+        return;
+
+    if (!check_config(config, cypher_name))
+        return;
+
+    int iv_length = EVP_CIPHER_iv_length(cypher_name);
+    if (iv_length > 0)
+        m_iv.assign(config.m_IV.get(), config.m_IV.get() + iv_length);
+
+    for (int encrypt = 0; encrypt < 2; ++encrypt)
+    {
+        m_templates[encrypt].reset(EVP_CIPHER_CTX_new());
+        if (m_templates[encrypt] == nullptr ||
+            !EVP_CipherInit_ex(m_templates[encrypt].get(), cypher_name, nullptr, config.m_key.get(), iv(), encrypt))
+            return;
+    }
+
+    // Truncated SHA-256 over a label, the cipher and the key material; the key itself never reaches the index.
+    static const char label[] = "tga incremental key id";
+    int nid = EVP_CIPHER_nid(cypher_name);
+    uint8_t digest[EVP_MAX_MD_SIZE];
+    digest_ctx_ptr key_digest(EVP_MD_CTX_new(), EVP_MD_CTX_free);
+    if (!key_digest || !EVP_DigestInit_ex(key_digest.get(), EVP_sha256(), nullptr) ||
+        !EVP_DigestUpdate(key_digest.get(), label, sizeof(label)) ||
+        !EVP_DigestUpdate(key_digest.get(), &nid, sizeof(nid)) ||
+        !EVP_DigestUpdate(key_digest.get(), config.m_key.get(), (size_t)EVP_CIPHER_key_length(cypher_name)) ||
+        !EVP_DigestUpdate(key_digest.get(), m_iv.data(), m_iv.size()) ||
+        !EVP_DigestFinal_ex(key_digest.get(), digest, nullptr))
+        return;
+    std::memcpy(m_key_id, digest, KEY_ID_SIZE);
+
+    static const int multi_buffer_ciphers[] = {NID_aes_128_ecb, NID_aes_192_ecb, NID_aes_256_ecb,
+                                               NID_aes_128_ctr, NID_aes_192_ctr, NID_aes_256_ctr};
+    m_multi_buffer = has_aes_ni() && std::find(std::begin(multi_buffer_ciphers), std::end(multi_buffer_ciphers), nid) != std::end(multi_buffer_ciphers) &&
+                     m_lane_keys.expand(config.m_key.get(), (size_t)EVP_CIPHER_key_length(cypher_name));
+
+    m_cipher = cypher_name;
+}
+
+crypto_engine::context_lease crypto_engine::acquire(bool encrypt, const uint8_t * iv)
+{
+    if (!valid())
+        return {};
+
+    cipher_ctx_ptr ctx(nullptr, EVP_CIPHER_CTX_free);
+    {
+        std::lock_guard<std::mutex> lock(m_pool_mutex);
+        std::vector<cipher_ctx_ptr> & pool = m_pool[encrypt];
+        if (!pool.empty())
+        {
+            ctx = std::move(pool.back());
+            pool.pop_back();
+        }
+    }
+
+    if (ctx == nullptr)
+    {
+        ctx.reset(EVP_CIPHER_CTX_new());
+        if (ctx == nullptr || !EVP_CIPHER_CTX_copy(ctx.get(), m_templates[encrypt].get()))
+            return {};
+    }
+
+    // Re-initialising without a key keeps the key schedule and only resets the IV and the block buffer.
+    if (!EVP_CipherInit_ex(ctx.get(), nullptr, nullptr, nullptr, iv, encrypt ? 1 : 0) || !EVP_CIPHER_CTX_set_padding(ctx.get(), 1))
+        return {};
+
+    return context_lease(this, encrypt, ctx.release());
+}
+
+void crypto_engine::release(bool encrypt, EVP_CIPHER_CTX * ctx)
+{
+    cipher_ctx_ptr owned(ctx, EVP_CIPHER_CTX_free);
+    std::lock_guard<std::mutex> lock(m_pool_mutex);
+    m_pool[encrypt].push_back(std::move(owned));
+}
+
+crypto_engine::buffer_lease crypto_engine::acquire_buffer(size_t size)
+{
+    size = (size + DIRECT_IO_ALIGNMENT - 1) / DIRECT_IO_ALIGNMENT * DIRECT_IO_ALIGNMENT;
+    {
+        std::lock_guard<std::mutex> lock(m_pool_mutex);
+        for (auto it = m_buffers.begin(); it != m_buffers.end(); ++it)
+            if (it->first == size)
+            {
+                uint8_t * data = it->second.release();
+                m_buffers.erase(it);
+                return buffer_lease(this, data, size);
+            }
+    }
+
+    auto * data = static_cast<uint8_t*>(std::aligned_alloc(DIRECT_IO_ALIGNMENT, size));
+    return data ? buffer_lease(this, data, size) : buffer_lease();
+}
+
+void crypto_engine::release_buffer(uint8_t * data, size_t size)
+{
+    std::unique_ptr<uint8_t, decltype(&std::free)> owned(data, std::free);
+    std::lock_guard<std::mutex> lock(m_pool_mutex);
+    m_buffers.emplace_back(size, std::move(owned));
+}
+
+// Where the pixels of a TGA image are, from its header.
+struct tga_layout {
+    uint64_t m_prefix = 0;          // image ID and color map bytes between the header and the pixels
+    uint64_t m_pixels = 0;
+    size_t m_pixel_size = 0;
+    uint16_t m_width = 0;
+};
+
+// False for pixel depths TGA does not define and empty images.
+static bool parse_tga_layout(const uint8_t * header, tga_layout & layout)
+{
+    unsigned depth = header[16];
+    if (depth != 8 && depth != 15 && depth != 16 && depth != 24 && depth != 32)
+        return false;
+    layout.m_pixel_size = (depth + 7) / 8;
+    uint64_t color_map = header[1] == 1 ? load_le(header + 5, 2) * ((header[7] + 7) / 8) : 0;
+    layout.m_prefix = header[0] + color_map;
+    layout.m_width = (uint16_t)load_le(header + 12, 2);
+    layout.m_pixels = layout.m_width * load_le(header + 14, 2);
+    return layout.m_pixels > 0;
+}
+
+/**
+ * Run-length stage of cipher_tga_rle(). Compression turns the pixels of an uncompressed image into TGA RLE packets
+ * (a count byte with the high bit set followed by one pixel repeated (count & 0x7f) + 1 times, or with it clear
+ * followed by that many literal pixels) that never cross a scan line; expansion undoes any valid packet stream.
+ * The image ID and color map before the pixels and whatever follows them (extension area, footer) pass through.
+ * Output reaches the sink in pieces of at most `buffer_size` bytes (and at least TGA_RLE_MIN_BUFFER), so a packet
+ * expanding 128-fold costs no memory.
+ */
+class tga_rle_stage {
+public:
+    using sink = std::function<bool(const uint8_t *, size_t)>;
+
+    tga_rle_stage(const tga_layout & layout, bool compress, size_t buffer_size, sink output)
+        : m_layout(layout), m_compress(compress), m_prefix_left(layout.m_prefix), m_pixels_left(layout.m_pixels),
+          m_output(std::move(output)), m_buffer_size(buffer_size)
+    {
+    }
+
+    // Bytes following the header, in any pieces.
+    bool update(const uint8_t * data, size_t length)
+    {
+        while (length > 0 && m_ok)
+        {
+            size_t used = length;
+            if (m_prefix_left > 0)
+            {
+                used = (size_t)std::min<uint64_t>(length, m_prefix_left);
+                m_prefix_left -= used;
+                put(data, used);
+            }
+            else if (m_pixels_left > 0)
+                used = m_compress ? compress(data, length) : expand(data, length);
+            else
+                put(data, length);
+            data += used;
+            length -= used;
+        }
+        return m_ok;
+    }
+
+    // False when the input ended inside the pixels.
+    bool finish()
+    {
+        return m_ok && m_pixels_left == 0 && m_packet_left == 0 && m_fill == 0 && flush();
+    }
+
+private:
+    // Room for `length` more bytes in m_out, flushing it first when they do not fit.
+    uint8_t * reserve(size_t length)
+    {
+        if (!m_out)
+            m_out.reset(new uint8_t[m_buffer_size]);
+        if (m_out_size + length > m_buffer_size)
+            flush();
+        return m_out.get() + m_out_size;
+    }
+
+    void put(const uint8_t * data, size_t length)
+    {
+        if (length > m_buffer_size)
+        {
+            flush();
+            m_ok = m_ok && m_output(data, length);
+            return;
+        }
+        std::memcpy(reserve(length), data, length);
+        m_out_size += length;
+    }
+
+    void put_repeated(const uint8_t * pixel, size_t count)
+    {
+        size_t pixel_size = m_layout.m_pixel_size;
+        uint8_t * out = reserve(count * pixel_size);
+        for (size_t i = 0; i < count; ++i)
+            std::memcpy(out + i * pixel_size, pixel, pixel_size);
+        m_out_size += count * pixel_size;
+    }
+
+    bool flush()
+    {
+        m_ok = m_ok && (m_out_size == 0 || m_output(m_out.get(), m_out_size));
+        m_out_size = 0;
+        return m_ok;
+    }
+
+    size_t compress(const uint8_t * data, size_t length)
+    {
+        size_t used = 0;
+        while (used < length && m_pixels_left > 0)
+        {
+            // Whole scan lines in the buffer are encoded in place, the pixel by pixel path only deals with the seams.
+            size_t line_bytes = (size_t)m_layout.m_width * m_layout.m_pixel_size;
+            if (m_x == 0 && m_fill == 0 && m_pixels_left >= m_layout.m_width && length - used >= line_bytes)
+            {
+                switch (m_layout.m_pixel_size)
+                {
+                    case 1: encode_line<1>(data + used); break;
+                    case 2: encode_line<2>(data + used); break;
+                    case 3: encode_line<3>(data + used); break;
+                    default: encode_line<4>(data + used); break;
+                }
+                used += line_bytes;
+                m_pixels_left -= m_layout.m_width;
+                continue;
+            }
+
+            size_t n = std::min(m_layout.m_pixel_size - m_fill, length - used);
+            std::memcpy(m_pixel + m_fill, data + used, n);
+            m_fill += n;
+            used += n;
+            if (m_fill < m_layout.m_pixel_size)
+                break;
+            m_fill = 0;
+            add_pixel();
+        }
+        return used;
+    }
+
+    template<size_t PixelSize>
+    void encode_line(const uint8_t * line)
+    {
+        auto same = [line](size_t a, size_t b) { return std::memcmp(line + a * PixelSize, line + b * PixelSize, PixelSize) == 0; };
+        size_t width = m_layout.m_width, literals = 0, i = 0;
+        while (i < width)
+        {
+            size_t end = i + 1;
+            while (end < width && end - i < TGA_RLE_PACKET_PIXELS && same(end, i))
+                ++end;
+            if (end - i >= 2)
+            {
+                put_literals(line + literals * PixelSize, i - literals);
+                uint8_t count = (uint8_t)(0x80 | (end - i - 1));
+                put(&count, 1);
+                put(line + i * PixelSize, PixelSize);
+                literals = end;
+            }
+            i = end;
+        }
+        put_literals(line + literals * PixelSize, width - literals);
+    }
+
+    void put_literals(const uint8_t * pixels, size_t count)
+    {
+        for (size_t packet = 0; packet < count; packet += TGA_RLE_PACKET_PIXELS)
+        {
+            size_t pixels_in_packet = std::min(TGA_RLE_PACKET_PIXELS, count - packet);
+            uint8_t header = (uint8_t)(pixels_in_packet - 1);
+            put(&header, 1);
+            put(pixels + packet * m_layout.m_pixel_size, pixels_in_packet * m_layout.m_pixel_size);
+        }
+    }
+
+    void add_pixel()
+    {
+        size_t pixel_size = m_layout.m_pixel_size;
+        if (m_run_count > 0 && std::memcmp(m_pixel, m_run_pixel, pixel_size) == 0)
+            ++m_run_count;
+        else
+        {
+            end_run();
+            std::memcpy(m_run_pixel, m_pixel, pixel_size);
+            m_run_count = 1;
+        }
+        if (m_run_count == TGA_RLE_PACKET_PIXELS)
+            end_run();
+
+        --m_pixels_left;
+        if (++m_x == m_layout.m_width || m_pixels_left == 0)
+        {
+            end_run();
+            flush_literals();
+            m_x = 0;
+        }
+    }
+
+    // A run of two already pays off for pixels of two bytes and more; a single pixel joins the literals.
+    void end_run()
+    {
+        size_t pixel_size = m_layout.m_pixel_size;
+        if (m_run_count >= 2)
+        {
+            flush_literals();
+            uint8_t count = (uint8_t)(0x80 | (m_run_count - 1));
+            put(&count, 1);
+            put(m_run_pixel, pixel_size);
+        }
+        else if (m_run_count == 1)
+        {
+            if (m_literal_count == TGA_RLE_PACKET_PIXELS)
+                flush_literals();
+            std::memcpy(m_literals + m_literal_count * pixel_size, m_run_pixel, pixel_size);
+            ++m_literal_count;
+        }
+        m_run_count = 0;
+    }
+
+    void flush_literals()
+    {
+        put_literals(m_literals, m_literal_count);
+        m_literal_count = 0;
+    }
+
+    size_t expand(const uint8_t * data, size_t length)
+    {
+        size_t pixel_size = m_layout.m_pixel_size;
+        size_t used = 0;
+        while (used < length && m_pixels_left > 0 && m_ok)
+        {
+            if (m_packet_left == 0)
+            {
+                // Whole packets in the buffer are expanded in place, the byte by byte path only deals with the seams.
+                switch (pixel_size)
+                {
+                    case 1: used += expand_packets<1>(data + used, length - used); break;
+                    case 2: used += expand_packets<2>(data + used, length - used); break;
+                    case 3: used += expand_packets<3>(data + used, length - used); break;
+                    default: used += expand_packets<4>(data + used, length - used); break;
+                }
+                if (used == length || m_pixels_left == 0 || !m_ok)
+                    break;
+
+                uint8_t count = data[used++];
+                m_packet_run = (count & 0x80) != 0;
+                m_packet_left = (count & 0x7f) + 1u;
+                m_packet_bytes = m_packet_run ? pixel_size : m_packet_left * pixel_size;
+                m_ok = m_packet_left <= m_pixels_left;
+                continue;
+            }
+
+            size_t n = std::min(m_packet_bytes, length - used);
+            if (m_packet_run)
+                std::memcpy(m_pixel + (pixel_size - m_packet_bytes), data + used, n);
+            else
+                put(data + used, n);
+            used += n;
+            m_packet_bytes -= n;
+            if (m_packet_bytes > 0)
+                break;
+
+            if (m_packet_run)
+                put_repeated(m_pixel, m_packet_left);
+            m_pixels_left -= m_packet_left;
+            m_packet_left = 0;
+        }
+        return m_ok ? used : length;
+    }
+
+    template<size_t PixelSize>
+    size_t expand_packets(const uint8_t * data, size_t length)
+    {
+        size_t used = 0;
+        while (m_pixels_left > 0 && length - used >= 1 + TGA_RLE_PACKET_PIXELS * PixelSize)
+        {
+            uint8_t header = data[used++];
+            size_t count = (header & 0x7fu) + 1;
+            if (count > m_pixels_left)
+            {
+                m_ok = false;
+                break;
+            }
+            uint8_t * out = reserve(count * PixelSize);
+            if (header & 0x80)
+            {
+                for (size_t i = 0; i < count; ++i)
+                    std::memcpy(out + i * PixelSize, data + used, PixelSize);
+                used += PixelSize;
+            }
+            else
+            {
+                std::memcpy(out, data + used, count * PixelSize);
+                used += count * PixelSize;
+            }
+            m_out_size += count * PixelSize;
+            m_pixels_left -= count;
+        }
+        return used;
+    }
+
+    tga_layout m_layout;
+    bool m_compress;
+    bool m_ok = true;
+    uint64_t m_prefix_left;
+    uint64_t m_pixels_left;
+    sink m_output;
+    size_t m_buffer_size;
+    std::unique_ptr<uint8_t[]> m_out;
+    size_t m_out_size = 0;
+    uint8_t m_pixel[TGA_MAX_PIXEL_SIZE] {};      // pixel being assembled (compression) or repeated by a run packet (expansion)
+    size_t m_fill = 0;
+    // compression
+    uint8_t m_run_pixel[TGA_MAX_PIXEL_SIZE] {};
+    size_t m_run_count = 0;
+    uint8_t m_literals[TGA_RLE_PACKET_PIXELS * TGA_MAX_PIXEL_SIZE] {};
+    size_t m_literal_count = 0;
+    size_t m_x = 0;
+    // expansion
+    bool m_packet_run = false;
+    size_t m_packet_left = 0;       // pixels of the current packet
+    size_t m_packet_bytes = 0;      // bytes of the current packet still to read
+};
+
+/**
+ * cipher_stream() with the RLE stage of `m_tga_rle`. Encryption compresses uncompressed images (types 1/2/3) of
+ * regular files holding all of their pixels: the header written gets the RLE type and TGA_RLE_STAGE_MARK, and
+ * the packets rather than the pixels go through the cipher. Decryption expands marked images back to the original
+ * bytes. Other images, and inputs whose size is unknown, are processed exactly like cipher_stream() does.
+ * The mark lives in the clear header, so an RLE image that already carries it would be expanded on decryption
+ * although it was never staged; encryption refuses such images instead of producing an ambiguous file.
+ */
+static bool cipher_tga_rle(int in_fd, int out_fd, crypto_engine & engine, bool encrypt, stream_digests * digests,
+                           cipher_stats * stats)
+{
+    const crypto_config & config = engine.config();
+    stats_recorder<> record(stats);
+    record.start();
+    crypto_engine::context_lease ctx = engine.acquire(encrypt);
+    record.stop(&cipher_stats::m_init_ns);
+    if (!ctx)
+        return false;
+
+    uint8_t header[TGA_HEADER_SIZE], out_header[TGA_HEADER_SIZE];
+    size_t bytes_read = 0;
+    if (!read_full(in_fd, header, TGA_HEADER_SIZE, bytes_read, record.calls(&cipher_stats::m_read_calls)) || bytes_read < TGA_HEADER_SIZE)
+        return false;
+    std::memcpy(out_header, header, TGA_HEADER_SIZE);
+
+    tga_layout layout;
+    bool staged = false;
+    if (encrypt)
+    {
+        if (header[2] >= 1 + TGA_RLE_TYPE_OFFSET && header[2] <= 3 + TGA_RLE_TYPE_OFFSET &&
+            (header[17] & TGA_RLE_STAGE_MARK) == TGA_RLE_STAGE_MARK)
+            return false;
+        struct stat in_stat {};
+        off_t position = ::lseek(in_fd, 0, SEEK_CUR);
+        staged = header[2] >= 1 && header[2] <= 3 && (header[17] & TGA_RLE_STAGE_MARK) == 0 && parse_tga_layout(header, layout) &&
+                 position >= 0 && ::fstat(in_fd, &in_stat) == 0 && S_ISREG(in_stat.st_mode) &&
+                 (uint64_t)in_stat.st_size >= (uint64_t)position + layout.m_prefix + layout.m_pixels * layout.m_pixel_size;
+        if (staged)
+        {
+            out_header[2] += TGA_RLE_TYPE_OFFSET;
+            out_header[17] |= TGA_RLE_STAGE_MARK;
+        }
+    }
+    else
+    {
+        staged = header[2] >= 1 + TGA_RLE_TYPE_OFFSET && header[2] <= 3 + TGA_RLE_TYPE_OFFSET &&
+                 (header[17] & TGA_RLE_STAGE_MARK) == TGA_RLE_STAGE_MARK && parse_tga_layout(header, layout);
+        if (staged)
+        {
+            out_header[2] -= TGA_RLE_TYPE_OFFSET;
+            out_header[17] &= (uint8_t)~TGA_RLE_STAGE_MARK;
+        }
+    }
+
+    if (!write_full(out_fd, out_header, TGA_HEADER_SIZE, record.calls(&cipher_stats::m_write_calls)))
+        return false;
+    if (digests && (!digests->update_input(header, TGA_HEADER_SIZE) || !digests->update_output(out_header, TGA_HEADER_SIZE)))
+        return false;
+    record.count(&cipher_stats::m_bytes_read, TGA_HEADER_SIZE);
+    record.count(&cipher_stats::m_bytes_written, TGA_HEADER_SIZE);
+
+    int block_size = EVP_CIPHER_block_size(engine.cipher());
+    size_t chunk_size = buffer_chunk_size(in_fd, config, block_size);
+    size_t piece_size = std::max(chunk_size, TGA_RLE_MIN_BUFFER);
+    std::vector<uint8_t> chunk(chunk_size);
+    std::vector<uint8_t> processed_chunk(piece_size + block_size);
+    size_t processed_length = 0;
+
+    auto write_out = [&](const uint8_t * data, size_t length)
+    {
+        record.start();
+        if (!write_full(out_fd, data, length, record.calls(&cipher_stats::m_write_calls)))
+            return false;
+        record.stop(&cipher_stats::m_write_ns);
+        record.count(&cipher_stats::m_bytes_written, length);
+        return !digests || digests->update_output(data, length);
+    };
+    // Pieces handed over by the stage are at most `piece_size` bytes. Expansion picks the plaintext up from processed_chunk.
+    auto cipher_out = [&](const uint8_t * data, size_t length)
+    {
+        int out_len = 0;
+        record.start();
+        if (!EVP_CipherUpdate(ctx.get(), processed_chunk.data(), &out_len, data, (int)length))
+            return false;
+        record.stop(&cipher_stats::m_cipher_ns);
+        processed_length = (size_t)out_len;
+        return encrypt || !staged ? write_out(processed_chunk.data(), processed_length) : true;
+    };
+    tga_rle_stage stage(layout, encrypt, piece_size, encrypt ? tga_rle_stage::sink(cipher_out) : tga_rle_stage::sink(write_out));
+
+    int out_len = 0;
+    do
+    {
+        record.start();
+        if (!read_full(in_fd, chunk.data(), chunk_size, bytes_read, record.calls(&cipher_stats::m_read_calls)))
+            return false;
+        record.stop(&cipher_stats::m_read_ns);
+        record.count(&cipher_stats::m_bytes_read, bytes_read);
+        record.count(&cipher_stats::m_chunks);
+        if (digests && !digests->update_input(chunk.data(), bytes_read))
+            return false;
+
+        if (encrypt && staged)
+        {
+            if (!stage.update(chunk.data(), bytes_read))
+                return false;
+        }
+        else
+        {
+            if (!cipher_out(chunk.data(), bytes_read) ||
+                (!encrypt && staged && !stage.update(processed_chunk.data(), processed_length)))
+                return false;
+        }
+    } while (bytes_read == chunk_size);
+
+    if (encrypt && staged && !stage.finish())
+        return false;
+    record.start();
+    if (!EVP_CipherFinal_ex(ctx.get(), processed_chunk.data(), &out_len))
+        return false;
+    record.stop(&cipher_stats::m_final_ns);
+    if (!encrypt && staged)
+        return stage.update(processed_chunk.data(), (size_t)out_len) && stage.finish();
+    return write_out(processed_chunk.data(), (size_t)out_len);
+}
+
+/**
+ * Copies the TGA header and runs the rest of `in_fd` through the cipher in chunks of `m_chunk_size` bytes.
+ * Both buffers are allocated once per call, lengths passed to OpenSSL stay far below INT_MAX
+ * and the file offset is only tracked by the kernel, so inputs larger than 2 GiB are fine.
+ * When `digests` is given, every chunk is also hashed on both sides of the cipher, when `stats` is given every phase is timed.
+ */
+static bool cipher_stream(int in_fd, int out_fd, crypto_engine & engine, bool encrypt, stream_digests * digests = nullptr,
+                          cipher_stats * stats = nullptr)
+{
+    const crypto_config & config = engine.config();
+    if (config.m_tga_rle)
+        return cipher_tga_rle(in_fd, out_fd, engine, encrypt, digests, stats);
+    stats_recorder<> record(stats);
+    record.start();
+    crypto_engine::context_lease ctx = engine.acquire(encrypt);
+    record.stop(&cipher_stats::m_init_ns);
+    if (!ctx)
+        return false;
+
+    uint8_t header[TGA_HEADER_SIZE];
+    size_t bytes_read = 0;
+    record.start();
+    if (!read_full(in_fd, header, TGA_HEADER_SIZE, bytes_read, record.calls(&cipher_stats::m_read_calls)) || bytes_read < TGA_HEADER_SIZE)
+        return false;
+    record.stop(&cipher_stats::m_read_ns);
+    record.start();
+    if (!write_full(out_fd, header, TGA_HEADER_SIZE, record.calls(&cipher_stats::m_write_calls)))
+        return false;
+    record.stop(&cipher_stats::m_write_ns);
+    record.count(&cipher_stats::m_bytes_read, TGA_HEADER_SIZE);
+    record.count(&cipher_stats::m_bytes_written, TGA_HEADER_SIZE);
+    if (digests && (!digests->update_input(header, TGA_HEADER_SIZE) || !digests->update_output(header, TGA_HEADER_SIZE)))
+        return false;
+
+    int block_size = EVP_CIPHER_block_size(engine.cipher());
+    size_t chunk_size = buffer_chunk_size(in_fd, config, block_size);
+    std::vector<uint8_t> chunk(chunk_size);
+    std::vector<uint8_t> processed_chunk(chunk_size + block_size);
+    int out_len = 0;
+
+    do
+    {
+        record.start();
+        if (!read_full(in_fd, chunk.data(), chunk_size, bytes_read, record.calls(&cipher_stats::m_read_calls)))
+            return false;
+        record.stop(&cipher_stats::m_read_ns);
+        record.start();
+        if (!EVP_CipherUpdate(ctx.get(), processed_chunk.data(), &out_len, chunk.data(), (int)bytes_read))
+            return false;
+        record.stop(&cipher_stats::m_cipher_ns);
+        record.start();
+        if (!write_full(out_fd, processed_chunk.data(), (size_t)out_len, record.calls(&cipher_stats::m_write_calls)))
+            return false;
+        record.stop(&cipher_stats::m_write_ns);
+        if (digests && (!digests->update_input(chunk.data(), bytes_read) || !digests->update_output(processed_chunk.data(), (size_t)out_len)))
+            return false;
+        record.count(&cipher_stats::m_bytes_read, bytes_read);
+        record.count(&cipher_stats::m_bytes_written, (uint64_t)out_len);
+        record.count(&cipher_stats::m_chunks);
+    } while (bytes_read == chunk_size);
+
+    record.start();
+    if (!EVP_CipherFinal_ex(ctx.get(), processed_chunk.data(), &out_len))
+        return false;
+    record.stop(&cipher_stats::m_final_ns);
+    if (digests && !digests->update_output(processed_chunk.data(), (size_t)out_len))
+        return false;
+    record.start();
+    if (!write_full(out_fd, processed_chunk.data(), (size_t)out_len, record.calls(&cipher_stats::m_write_calls)))
+        return false;
+    record.stop(&cipher_stats::m_write_ns);
+    record.count(&cipher_stats::m_bytes_written, (uint64_t)out_len);
+    return true;
+}
+
+/**
+ * Maps the input read-only and the pre-sized output read-write and lets the cipher write directly into the output
+ * mapping. The output is sized for the worst case (one extra padding block) and trimmed once the final length is known.
+ * Non-regular files (pipes, character devices, ...) and failed mappings are handled by cipher_stream() instead.
+ */
+static bool cipher_mapped(int in_fd, int out_fd, crypto_engine & engine, bool encrypt)
+{
+    const crypto_config & config = engine.config();
+    struct stat in_stat {}, out_stat {};
+    if (::fstat(in_fd, &in_stat) != 0 || ::fstat(out_fd, &out_stat) != 0)
+        return false;
+    if (!S_ISREG(in_stat.st_mode) || !S_ISREG(out_stat.st_mode))
+        return cipher_stream(in_fd, out_fd, engine, encrypt);
+
+    size_t in_size = (size_t)in_stat.st_size;
+    if (in_size < TGA_HEADER_SIZE)
+        return false;
+
+    int block_size = EVP_CIPHER_block_size(engine.cipher());
+    size_t out_capacity = in_size + (block_size > 1 ? (size_t)block_size : 0);
+    if (::ftruncate(out_fd, (off_t)out_capacity) != 0)
+        return false;
+#ifdef __linux__
+    // Reserve the blocks now, running out of space while writing through the mapping would raise SIGBUS.
+    if (::posix_fallocate(out_fd, 0, (off_t)out_capacity) != 0)
+        return false;
+#endif
+
+    memory_mapping input(in_fd, in_size, PROT_READ);
+    memory_mapping output(out_fd, out_capacity, PROT_READ | PROT_WRITE);
+    if (!input.valid() || !output.valid())
+        return ::ftruncate(out_fd, 0) == 0 && cipher_stream(in_fd, out_fd, engine, encrypt);
+
+    crypto_engine::context_lease ctx = engine.acquire(encrypt);
+    if (!ctx)
+        return false;
+
+    std::memcpy(output.data(), input.data(), TGA_HEADER_SIZE);
+
+    size_t chunk_size = effective_chunk_size(config, block_size);
+    size_t in_offset = TGA_HEADER_SIZE;
+    size_t out_offset = TGA_HEADER_SIZE;
+    int out_len = 0;
+
+    while (in_offset < in_size)
+    {
+        size_t length = std::min(chunk_size, in_size - in_offset);
+        if (!EVP_CipherUpdate(ctx.get(), output.data() + out_offset, &out_len, input.data() + in_offset, (int)length))
+            return false;
+        in_offset += length;
+        out_offset += (size_t)out_len;
+    }
+
+    if (!EVP_CipherFinal_ex(ctx.get(), output.data() + out_offset, &out_len))
+        return false;
+    out_offset += (size_t)out_len;
+
+    return ::ftruncate(out_fd, (off_t)out_offset) == 0;
+}
+
+// Hands buffer indices from one pipeline stage to the next. close() wakes up every waiting stage and makes pop() fail.
+class slot_queue {
+public:
+    void push(size_t slot)
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_slots.push_back(slot);
+        }
+        m_cv.notify_one();
+    }
+
+    bool pop(size_t & slot, uint64_t & stall_ns)
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        if (m_slots.empty() && !m_closed)
+        {
+            auto start = std::chrono::steady_clock::now();
+            m_cv.wait(lock, [this] { return !m_slots.empty() || m_closed; });
+            stall_ns += elapsed_ns(start);
+        }
+        if (m_closed)
+            return false;
+
+        slot = m_slots.front();
+        m_slots.pop_front();
+        return true;
+    }
+
+    void close()
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_closed = true;
+        }
+        m_cv.notify_all();
+    }
+
+private:
+    std::mutex m_mutex;
+    std::condition_variable m_cv;
+    std::deque<size_t> m_slots;
+    bool m_closed = false;
+};
+
+struct pipeline_slot {
+    std::vector<uint8_t> m_data;
+    std::vector<uint8_t> m_processed;
+    size_t m_length = 0;
+    size_t m_processed_length = 0;
+    bool m_last = false;
+};
+
+/**
+ * Three stage version of cipher_stream(): a reader thread fills free buffers, the calling thread runs the cipher and
+ * a writer thread drains the results, so disk and CPU work overlap even for serial modes such as CBC encryption.
+ * Buffers circulate free -> read -> processed -> free, `m_pipeline_depth` of them are allocated once per call.
+ */
+static bool cipher_pipelined(int in_fd, int out_fd, crypto_engine & engine, bool encrypt)
+{
+    const crypto_config & config = engine.config();
+    crypto_engine::context_lease ctx = engine.acquire(encrypt);
+    if (!ctx)
+        return false;
+
+    uint8_t header[TGA_HEADER_SIZE];
+    size_t bytes_read = 0;
+    if (!read_full(in_fd, header, TGA_HEADER_SIZE, bytes_read) || bytes_read < TGA_HEADER_SIZE)
+        return false;
+    if (!write_full(out_fd, header, TGA_HEADER_SIZE))
+        return false;
+
+    int block_size = EVP_CIPHER_block_size(engine.cipher());
+    size_t chunk_size = buffer_chunk_size(in_fd, config, block_size);
+    std::vector<pipeline_slot> slots(std::max<size_t>(2, config.m_pipeline_depth));
+    slot_queue free_slots, read_slots, processed_slots;
+    for (size_t i = 0; i < slots.size(); ++i)
+    {
+        slots[i].m_data.resize(chunk_size);
+        slots[i].m_processed.resize(chunk_size + block_size);
+        free_slots.push(i);
+    }
+
+    pipeline_stats stats;
+    std::atomic<bool> failed {false};
+    auto abort = [&]
+    {
+        failed = true;
+        free_slots.close();
+        read_slots.close();
+        processed_slots.close();
+    };
+
+    std::thread reader([&]
+    {
+        size_t index = 0;
+        while (free_slots.pop(index, stats.m_reader_stall_ns))
+        {
+            pipeline_slot & slot = slots[index];
+            auto start = std::chrono::steady_clock::now();
+            if (!read_full(in_fd, slot.m_data.data(), chunk_size, slot.m_length))
+                return abort();
+            stats.m_read_ns += elapsed_ns(start);
+
+            // The slot belongs to the next stage once pushed, so its fields must not be touched afterwards.
+            bool last = slot.m_length < chunk_size;
+            slot.m_last = last;
+            read_slots.push(index);
+            if (last)
+                return;
+        }
+    });
+
+    std::thread writer([&]
+    {
+        size_t index = 0;
+        while (processed_slots.pop(index, stats.m_writer_stall_ns))
+        {
+            pipeline_slot & slot = slots[index];
+            auto start = std::chrono::steady_clock::now();
+            if (!write_full(out_fd, slot.m_processed.data(), slot.m_processed_length))
+                return abort();
+            stats.m_write_ns += elapsed_ns(start);
+
+            if (slot.m_last)
+                return;
+            free_slots.push(index);
+        }
+    });
+
+    size_t index = 0;
+    while (read_slots.pop(index, stats.m_cipher_stall_ns))
+    {
+        pipeline_slot & slot = slots[index];
+        auto start = std::chrono::steady_clock::now();
+        int out_len = 0, final_len = 0;
+        if (!EVP_CipherUpdate(ctx.get(), slot.m_processed.data(), &out_len, slot.m_data.data(), (int)slot.m_length) ||
+            (slot.m_last && !EVP_CipherFinal_ex(ctx.get(), slot.m_processed.data() + out_len, &final_len)))
+        {
+            abort();
+            break;
+        }
+        stats.m_cipher_ns += elapsed_ns(start);
+        ++stats.m_chunks;
+
+        slot.m_processed_length = (size_t)(out_len + final_len);
+        bool last = slot.m_last;
+        processed_slots.push(index);
+        if (last)
+            break;
+    }
+
+    reader.join();
+    writer.join();
+
+    if (config.m_pipeline_stats)
+        *config.m_pipeline_stats = stats;
+    return !failed;
+}
+
+#ifdef __linux__
+struct uring_slot {
+    std::vector<uint8_t> m_data;
+    std::vector<uint8_t> m_processed;
+    uint64_t m_chunk = 0;           // index of the chunk held in m_data
+    size_t m_requested = 0;         // bytes asked for by the read of m_chunk
+    size_t m_received = 0;
+    bool m_read_pending = false;
+    bool m_read_done = false;
+    size_t m_write_length = 0;
+    size_t m_written = 0;
+    uint64_t m_write_offset = 0;
+    bool m_write_pending = false;
+};
+
+/**
+ * io_uring variant of cipher_stream() for regular files. Reads of the next `m_pipeline_depth` chunks and the writes of
+ * already processed chunks stay in flight in the kernel while the calling thread runs the cipher on the oldest
+ * completed read, in file order. Every slot owns an input and an output buffer, both registered with the ring,
+ * so the input buffer is refilled as soon as it has been ciphered and only the output buffer waits for its write.
+ * Short reads and writes are resubmitted for the remainder. Returns false through `available` when io_uring can not
+ * be used at all, so that the caller can fall back to another path.
+ */
+static bool cipher_uring(int in_fd, int out_fd, crypto_engine & engine, bool encrypt, bool & available)
+{
+    const crypto_config & config = engine.config();
+    available = false;
+
+    struct stat in_stat {}, out_stat {};
+    if (::fstat(in_fd, &in_stat) != 0 || ::fstat(out_fd, &out_stat) != 0 || !S_ISREG(in_stat.st_mode) || !S_ISREG(out_stat.st_mode))
+        return false;
+
+    size_t depth = std::max<size_t>(2, config.m_pipeline_depth);
+    io_uring_queue ring((unsigned)(2 * depth));
+    if (!ring.valid())
+        return false;
+
+    int block_size = EVP_CIPHER_block_size(engine.cipher());
+    uint64_t in_size = (uint64_t)in_stat.st_size;
+    if (in_size < TGA_HEADER_SIZE)
+        return false;
+    uint64_t payload_size = in_size - TGA_HEADER_SIZE;
+    size_t chunk_size = (size_t)std::min<uint64_t>(effective_chunk_size(config, block_size), payload_size - payload_size % COUNTER_BLOCK_SIZE + COUNTER_BLOCK_SIZE);
+    uint64_t chunk_count = (payload_size + chunk_size - 1) / chunk_size;
+    depth = (size_t)std::min<uint64_t>(depth, std::max<uint64_t>(1, chunk_count));
+
+    std::vector<uring_slot> slots(depth);
+    std::vector<iovec> buffers;
+    for (uring_slot & slot : slots)
+    {
+        slot.m_data.resize(chunk_size);
+        slot.m_processed.resize(chunk_size + 2 * (size_t)block_size);   // last chunk also takes EVP_CipherFinal_ex output
+        buffers.push_back({slot.m_data.data(), slot.m_data.size()});
+        buffers.push_back({slot.m_processed.data(), slot.m_processed.size()});
+    }
+    if (!ring.register_buffers(buffers.data(), (unsigned)buffers.size()))
+        return false;
+    available = true;
+
+    crypto_engine::context_lease ctx = engine.acquire(encrypt);
+    if (!ctx)
+        return false;
+
+    uint8_t header[TGA_HEADER_SIZE];
+    if (!pread_full(in_fd, header, TGA_HEADER_SIZE, 0) || !pwrite_full(out_fd, header, TGA_HEADER_SIZE, 0))
+        return false;
+
+    // user_data: slot index shifted left, lowest bit set for writes.
+    auto queue_read = [&](size_t index) -> bool
+    {
+        uring_slot & slot = slots[index];
+        io_uring_sqe * sqe = ring.next_sqe();
+        if (sqe == nullptr)
+            return false;
+        sqe->opcode = IORING_OP_READ_FIXED;
+        sqe->fd = in_fd;
+        sqe->off = TGA_HEADER_SIZE + slot.m_chunk * chunk_size + slot.m_received;
+        sqe->addr = (uint64_t)(uintptr_t)(slot.m_data.data() + slot.m_received);
+        sqe->len = (uint32_t)(slot.m_requested - slot.m_received);
+        sqe->buf_index = (uint16_t)(2 * index);
+        sqe->user_data = index << 1;
+        slot.m_read_pending = true;
+        return true;
+    };
+    auto queue_write = [&](size_t index) -> bool
+    {
+        uring_slot & slot = slots[index];
+        io_uring_sqe * sqe = ring.next_sqe();
+        if (sqe == nullptr)
+            return false;
+        sqe->opcode = IORING_OP_WRITE_FIXED;
+        sqe->fd = out_fd;
+        sqe->off = slot.m_write_offset + slot.m_written;
+        sqe->addr = (uint64_t)(uintptr_t)(slot.m_processed.data() + slot.m_written);
+        sqe->len = (uint32_t)(slot.m_write_length - slot.m_written);
+        sqe->buf_index = (uint16_t)(2 * index + 1);
+        sqe->user_data = (index << 1) | 1;
+        slot.m_write_pending = true;
+        return true;
+    };
+    auto start_read = [&](size_t index, uint64_t chunk) -> bool
+    {
+        uring_slot & slot = slots[index];
+        slot.m_chunk = chunk;
+        slot.m_requested = (size_t)std::min<uint64_t>(chunk_size, payload_size - chunk * chunk_size);
+        slot.m_received = 0;
+        slot.m_read_done = false;
+        return queue_read(index);
+    };
+
+    // Reaps every available completion, resubmitting short transfers. Waits for at least one when `wait` is set.
+    auto reap = [&](bool wait) -> bool
+    {
+        if (!ring.submit(wait ? 1 : 0))
+            return false;
+
+        io_uring_cqe cqe {};
+        while (ring.pop_completion(cqe))
+        {
+            size_t index = (size_t)(cqe.user_data >> 1);
+            uring_slot & slot = slots[index];
+            if (cqe.res < 0 && cqe.res != -EINTR && cqe.res != -EAGAIN)
+                return false;
+            size_t transferred = cqe.res > 0 ? (size_t)cqe.res : 0;
+
+            if (cqe.user_data & 1)
+            {
+                slot.m_write_pending = false;
+                slot.m_written += transferred;
+                if (slot.m_written < slot.m_write_length && !queue_write(index))
+                    return false;
+            }
+            else
+            {
+                slot.m_read_pending = false;
+                slot.m_received += transferred;
+                // A read returning nothing before the expected end means the file shrank underneath us.
+                if (cqe.res == 0 && slot.m_received < slot.m_requested)
+                    return false;
+                if (slot.m_received < slot.m_requested)
+                {
+                    if (!queue_read(index))
+                        return false;
+                }
+                else
+                    slot.m_read_done = true;
+            }
+        }
+        return true;
+    };
+
+    uint64_t next_read = 0;
+    for (size_t index = 0; index < depth && next_read < chunk_count; ++index)
+        if (!start_read(index, next_read++))
+            return false;
+
+    uint64_t out_offset = TGA_HEADER_SIZE;
+    // An empty payload still has to go through EVP_CipherFinal_ex (padding block or padding check).
+    for (uint64_t chunk = 0; chunk < std::max<uint64_t>(1, chunk_count); ++chunk)
+    {
+        size_t index = (size_t)(chunk % depth);
+        uring_slot & slot = slots[index];
+        bool last = chunk + 1 >= chunk_count;
+
+        if (chunk_count != 0)
+            while (!slot.m_read_done || slot.m_write_pending || slot.m_written < slot.m_write_length)
+                if (!reap(true))
+                    return false;
+
+        int out_len = 0, final_len = 0;
+        size_t length = chunk_count != 0 ? slot.m_requested : 0;
+        if (!EVP_CipherUpdate(ctx.get(), slot.m_processed.data(), &out_len, slot.m_data.data(), (int)length) ||
+            (last && !EVP_CipherFinal_ex(ctx.get(), slot.m_processed.data() + out_len, &final_len)))
+            return false;
+
+        slot.m_write_length = (size_t)(out_len + final_len);
+        slot.m_written = 0;
+        slot.m_write_offset = out_offset;
+        out_offset += slot.m_write_length;
+        if (slot.m_write_length > 0 && !queue_write(index))
+            return false;
+
+        if (next_read < chunk_count && !start_read(index, next_read++))
+            return false;
+        if (!reap(false))
+            return false;
+    }
+
+    for (const uring_slot & slot : slots)
+        while (slot.m_write_pending || slot.m_written < slot.m_write_length || slot.m_read_pending)
+            if (!reap(true))
+                return false;
+    return true;
+}
+#endif
+
+// Restores the status flags of a descriptor (O_DIRECT in particular) when it goes out of scope.
+class fd_flags_guard {
+public:
+    explicit fd_flags_guard(int fd) : m_fd(fd), m_flags(::fcntl(fd, F_GETFL)) {}
+    fd_flags_guard(const fd_flags_guard &) = delete;
+    fd_flags_guard & operator=(const fd_flags_guard &) = delete;
+    ~fd_flags_guard() { restore(); }
+
+    bool valid() const { return m_flags >= 0; }
+    bool set(int flags) { return ::fcntl(m_fd, F_SETFL, m_flags | flags) == 0; }
+    bool restore() { return m_flags < 0 || ::fcntl(m_fd, F_SETFL, m_flags) == 0; }
+
+private:
+    int m_fd;
+    int m_flags;
+};
+
+#ifdef O_DIRECT
+/**
+ * Like pread_full(), but a short count that is not a multiple of the alignment can only be the end of the file
+ * and ends the read, as does a zero count. Fills `bytes_read`, errno is left as set by the failing pread().
+ */
+static bool pread_direct(int fd, uint8_t * data, size_t length, uint64_t offset, size_t & bytes_read)
+{
+    bytes_read = 0;
+    while (bytes_read < length)
+    {
+        ssize_t res = ::pread(fd, data + bytes_read, length - bytes_read, (off_t)(offset + bytes_read));
+        if (res < 0)
+        {
+            if (errno == EINTR) continue;
+            return false;
+        }
+        bytes_read += (size_t)res;
+        if (res == 0 || bytes_read % DIRECT_IO_ALIGNMENT != 0)
+            break;
+    }
+    return true;
+}
+#endif
+
+/**
+ * cipher_stream() without the page cache. On Linux both files are switched to O_DIRECT and go through aligned
+ * pooled buffers: the input is read in aligned chunks from offset 0 (header included), the cipher output is
+ * collected behind the header and written whenever whole DIRECT_IO_ALIGNMENT blocks are available, the remainder
+ * being carried over to the front of the buffer. The final sub-block tail, padding included, is written after
+ * clearing O_DIRECT again. On macOS F_NOCACHE gets the same effect without alignment rules. `available` is false when
+ * direct I/O can not be used for these files (non-regular files, a file system refusing O_DIRECT with EINVAL before
+ * anything was written) and the caller should fall back.
+ */
+static bool cipher_direct(int in_fd, int out_fd, crypto_engine & engine, bool encrypt, bool & available)
+{
+    available = false;
+    struct stat in_stat {}, out_stat {};
+    if (::fstat(in_fd, &in_stat) != 0 || ::fstat(out_fd, &out_stat) != 0 || !S_ISREG(in_stat.st_mode) || !S_ISREG(out_stat.st_mode))
+        return false;
+
+#if defined(O_DIRECT)
+    const crypto_config & config = engine.config();
+    fd_flags_guard in_flags(in_fd), out_flags(out_fd);
+    if (!in_flags.valid() || !out_flags.valid() || !in_flags.set(O_DIRECT) || !out_flags.set(O_DIRECT))
+        return false;
+
+    crypto_engine::context_lease ctx = engine.acquire(encrypt);
+    size_t chunk_size = effective_chunk_size(config, EVP_CIPHER_block_size(engine.cipher()));
+    chunk_size -= chunk_size % DIRECT_IO_ALIGNMENT;
+    // Output: carried-over tail (< one alignment block) + one processed chunk + final block.
+    crypto_engine::buffer_lease in = engine.acquire_buffer(chunk_size);
+    crypto_engine::buffer_lease out = engine.acquire_buffer(chunk_size + 2 * DIRECT_IO_ALIGNMENT);
+    if (!ctx || !in || !out)
+        return false;
+
+    uint64_t in_offset = 0, out_offset = 0;
+    size_t out_fill = 0, bytes_read = 0;
+    bool end_of_file = false;
+    while (!end_of_file)
+    {
+        if (!pread_direct(in_fd, in.data(), chunk_size, in_offset, bytes_read))
+        {
+            available = errno != EINVAL || out_offset != 0;
+            return false;
+        }
+        end_of_file = bytes_read < chunk_size;
+
+        const uint8_t * data = in.data();
+        size_t length = bytes_read;
+        if (in_offset == 0)
+        {
+            if (length < TGA_HEADER_SIZE)
+            {
+                available = true;
+                return false;
+            }
+            std::memcpy(out.data(), data, TGA_HEADER_SIZE);
+            out_fill = TGA_HEADER_SIZE;
+            data += TGA_HEADER_SIZE;
+            length -= TGA_HEADER_SIZE;
+        }
+        in_offset += bytes_read;
+
+        int out_len = 0, final_len = 0;
+        available = true;
+        if (!EVP_CipherUpdate(ctx.get(), out.data() + out_fill, &out_len, data, (int)length) ||
+            (end_of_file && !EVP_CipherFinal_ex(ctx.get(), out.data() + out_fill + out_len, &final_len)))
+            return false;
+        out_fill += (size_t)(out_len + final_len);
+
+        size_t aligned = out_fill - out_fill % DIRECT_IO_ALIGNMENT;
+        if (aligned == 0)
+            continue;
+        if (!pwrite_full(out_fd, out.data(), aligned, out_offset))
+        {
+            available = errno != EINVAL || out_offset != 0;
+            return false;
+        }
+        std::memmove(out.data(), out.data() + aligned, out_fill - aligned);
+        out_offset += aligned;
+        out_fill -= aligned;
+    }
+
+    // The tail is shorter than a block, which O_DIRECT can not write.
+    return out_fill == 0 || (out_flags.restore() && pwrite_full(out_fd, out.data(), out_fill, out_offset));
+#elif defined(__APPLE__)
+    if (::fcntl(in_fd, F_NOCACHE, 1) != 0 || ::fcntl(out_fd, F_NOCACHE, 1) != 0)
+        return false;
+    available = true;
+    return cipher_stream(in_fd, out_fd, engine, encrypt);
+#else
+    (void)engine;
+    (void)encrypt;
+    return false;
+#endif
+}
+
+#ifdef __linux__
+static bool is_pipe(int fd)
+{
+    struct stat st {};
+    return ::fstat(fd, &st) == 0 && S_ISFIFO(st.st_mode);
+}
+
+/**
+ * Moves `length` bytes from `in_fd` to `out_fd` without copying them through user space; one of the two must be a pipe.
+ * `available` is false when splice() refused the descriptors before anything was moved and the caller should fall back.
+ */
+static bool splice_full(int in_fd, int out_fd, size_t length, bool & available, uint64_t * calls = nullptr)
+{
+    available = true;
+    size_t moved = 0;
+    while (moved < length)
+    {
+        if (calls) ++*calls;
+        ssize_t res = ::splice(in_fd, nullptr, out_fd, nullptr, length - moved, 0);
+        if (res < 0)
+        {
+            if (errno == EINTR) continue;
+            available = moved != 0 || (errno != EINVAL && errno != ENOSYS);
+            return false;
+        }
+        if (res == 0) return false;
+        moved += (size_t)res;
+    }
+    return true;
+}
+
+/**
+ * cipher_stream() for descriptors of which at least one is a pipe. The TGA header is spliced straight from the input
+ * to the output. When the output is a pipe, it is grown to the chunk size so that every processed chunk goes out with
+ * a single write(). The chunks themselves are copied into the pipe rather than vmspliced: the pages of a spliced
+ * buffer may still be referenced by whatever the reader splices them on to (tee(), sockets, pv), so they could not
+ * be reused safely.
+ */
+static bool cipher_spliced(int in_fd, int out_fd, crypto_engine & engine, bool encrypt, cipher_stats * stats)
+{
+    stats_recorder<> record(stats);
+    record.start();
+    crypto_engine::context_lease ctx = engine.acquire(encrypt);
+    record.stop(&cipher_stats::m_init_ns);
+    if (!ctx)
+        return false;
+
+    bool available = false;
+    record.start();
+    if (!splice_full(in_fd, out_fd, TGA_HEADER_SIZE, available, record.calls(&cipher_stats::m_read_calls)))
+    {
+        uint8_t header[TGA_HEADER_SIZE];
+        size_t bytes_read = 0;
+        if (available || !read_full(in_fd, header, TGA_HEADER_SIZE, bytes_read, record.calls(&cipher_stats::m_read_calls)) ||
+            bytes_read < TGA_HEADER_SIZE || !write_full(out_fd, header, TGA_HEADER_SIZE, record.calls(&cipher_stats::m_write_calls)))
+            return false;
+    }
+    record.stop(&cipher_stats::m_read_ns);
+    record.count(&cipher_stats::m_bytes_read, TGA_HEADER_SIZE);
+    record.count(&cipher_stats::m_bytes_written, TGA_HEADER_SIZE);
+
+    int block_size = EVP_CIPHER_block_size(engine.cipher());
+    size_t chunk_size = effective_chunk_size(engine.config(), block_size);
+    // Growing the pipe fails above /proc/sys/fs/pipe-max-size for unprivileged users, the current size is kept then.
+    if (is_pipe(out_fd))
+        ::fcntl(out_fd, F_SETPIPE_SZ, (int)chunk_size);
+
+    crypto_engine::buffer_lease in = engine.acquire_buffer(chunk_size);
+    crypto_engine::buffer_lease out = engine.acquire_buffer(chunk_size + 2 * (size_t)block_size);
+    if (!in || !out)
+        return false;
+
+    size_t bytes_read = 0;
+    for (;;)
+    {
+        record.start();
+        if (!read_full(in_fd, in.data(), chunk_size, bytes_read, record.calls(&cipher_stats::m_read_calls)))
+            return false;
+        record.stop(&cipher_stats::m_read_ns);
+        bool end_of_file = bytes_read < chunk_size;
+
+        uint8_t * processed = out.data();
+        int out_len = 0, final_len = 0;
+        record.start();
+        if (!EVP_CipherUpdate(ctx.get(), processed, &out_len, in.data(), (int)bytes_read))
+            return false;
+        record.stop(&cipher_stats::m_cipher_ns);
+        if (end_of_file)
+        {
+            record.start();
+            if (!EVP_CipherFinal_ex(ctx.get(), processed + out_len, &final_len))
+                return false;
+            record.stop(&cipher_stats::m_final_ns);
+        }
+
+        size_t length = (size_t)(out_len + final_len);
+        record.start();
+        if (!write_full(out_fd, processed, length, record.calls(&cipher_stats::m_write_calls)))
+            return false;
+        record.stop(&cipher_stats::m_write_ns);
+        record.count(&cipher_stats::m_bytes_read, bytes_read);
+        record.count(&cipher_stats::m_bytes_written, length);
+        record.count(&cipher_stats::m_chunks);
+        if (end_of_file)
+            return true;
+    }
+}
+#endif
+
+bool crypto_engine::cipher_fd(int in_fd, int out_fd, bool encrypt)
+{
+    if (!valid())
+        return false;
+    stats_recorder<> record(m_config.m_stats);
+    if (m_config.m_stats)
+        *m_config.m_stats = {};
+    record.start();
+    bool result = false;
+#ifdef __linux__
+    if ((is_pipe(in_fd) || is_pipe(out_fd)) && !m_config.m_tga_rle)
+        result = cipher_spliced(in_fd, out_fd, *this, encrypt, m_config.m_stats);
+    else
+#endif
+        result = cipher_stream(in_fd, out_fd, *this, encrypt, nullptr, m_config.m_stats);
+    record.stop(&cipher_stats::m_total_ns);
+    record.count(&cipher_stats::m_files, result ? 1 : 0);
+    return result;
+}
+
+/**
+ * Whether the payload can be cut into independently processed segments: ECB and CTR have no chaining between blocks
+ * and CBC decryption only needs the ciphertext block preceding each segment as its IV.
+ */
+static bool is_segmentable(const EVP_CIPHER * cypher_name, bool encrypt)
+{
+    int mode = EVP_CIPHER_mode(cypher_name);
+    return mode == EVP_CIPH_ECB_MODE || mode == EVP_CIPH_CTR_MODE ||
+           (mode == EVP_CIPH_CBC_MODE && !encrypt && EVP_CIPHER_block_size(cypher_name) <= (int)COUNTER_BLOCK_SIZE);
+}
+
+/**
+ * Splits the payload after the TGA header into chunk-sized segments and processes them on a pool of workers,
+ * each with its own EVP_CIPHER_CTX and buffers. Segments are read and written with pread()/pwrite(), so the output
+ * lands at the same offsets as in the serial path. Only the last segment keeps padding enabled and calls
+ * EVP_CipherFinal_ex(), every other one is a plain sequence of whole blocks. In CTR mode each segment starts
+ * from the IV advanced by the number of blocks preceding it, CBC decryption seeds it with the previous ciphertext block.
+ */
+static bool cipher_segmented(int in_fd, int out_fd, crypto_engine & engine, bool encrypt, unsigned max_threads)
+{
+    const crypto_config & config = engine.config();
+    struct stat in_stat {}, out_stat {};
+    if (::fstat(in_fd, &in_stat) != 0 || ::fstat(out_fd, &out_stat) != 0)
+        return false;
+    if (!S_ISREG(in_stat.st_mode) || !S_ISREG(out_stat.st_mode))
+        return cipher_stream(in_fd, out_fd, engine, encrypt);
+
+    uint64_t in_size = (uint64_t)in_stat.st_size;
+    if (in_size < TGA_HEADER_SIZE)
+        return false;
+
+    uint8_t header[TGA_HEADER_SIZE];
+    if (!pread_full(in_fd, header, TGA_HEADER_SIZE, 0) || !pwrite_full(out_fd, header, TGA_HEADER_SIZE, 0))
+        return false;
+
+    int block_size = EVP_CIPHER_block_size(engine.cipher());
+    int mode = EVP_CIPHER_mode(engine.cipher());
+    uint64_t payload_size = in_size - TGA_HEADER_SIZE;
+    size_t segment_size = effective_chunk_size(config, block_size);
+    uint64_t segment_count = std::max<uint64_t>(1, (payload_size + segment_size - 1) / segment_size);
+    unsigned threads = (unsigned)std::min<uint64_t>(max_threads, segment_count);
+
+    std::atomic<uint64_t> next_segment {0};
+    std::atomic<bool> failed {false};
+    uint64_t out_size = 0;
+
+    auto worker = [&]() -> bool
+    {
+        crypto_engine::context_lease ctx = engine.acquire(encrypt);
+        if (!ctx)
+        {
+            failed = true;
+            return false;
+        }
+
+        size_t buffer_size = (size_t)std::min<uint64_t>(segment_size, payload_size);
+        std::vector<uint8_t> segment(buffer_size);
+        std::vector<uint8_t> processed_segment(buffer_size + block_size);
+        uint8_t segment_iv[COUNTER_BLOCK_SIZE];
+
+        for (uint64_t index = next_segment++; index < segment_count && !failed; index = next_segment++)
+        {
+            uint64_t offset = index * segment_size;
+            size_t length = (size_t)std::min<uint64_t>(segment_size, payload_size - offset);
+            bool last = index == segment_count - 1;
+
+            const uint8_t * iv = nullptr;
+            if (mode == EVP_CIPH_CTR_MODE)
+            {
+                std::memcpy(segment_iv, engine.iv(), COUNTER_BLOCK_SIZE);
+                advance_counter(segment_iv, offset / COUNTER_BLOCK_SIZE);
+                iv = segment_iv;
+            }
+            else if (mode == EVP_CIPH_CBC_MODE)
+            {
+                iv = engine.iv();
+                if (offset != 0)
+                {
+                    if (!pread_full(in_fd, segment_iv, (size_t)block_size, TGA_HEADER_SIZE + offset - block_size))
+                    {
+                        failed = true;
+                        return false;
+                    }
+                    iv = segment_iv;
+                }
+            }
+
+            int out_len = 0, final_len = 0;
+            bool ok = EVP_CipherInit_ex(ctx.get(), nullptr, nullptr, nullptr, iv, encrypt ? 1 : 0) &&
+                      EVP_CIPHER_CTX_set_padding(ctx.get(), last ? 1 : 0) &&
+                      pread_full(in_fd, segment.data(), length, TGA_HEADER_SIZE + offset) &&
+                      EVP_CipherUpdate(ctx.get(), processed_segment.data(), &out_len, segment.data(), (int)length) &&
+                      (!last || EVP_CipherFinal_ex(ctx.get(), processed_segment.data() + out_len, &final_len)) &&
+                      pwrite_full(out_fd, processed_segment.data(), (size_t)(out_len + final_len), TGA_HEADER_SIZE + offset);
+            if (!ok)
+            {
+                failed = true;
+                return false;
+            }
+
+            if (last)
+                out_size = TGA_HEADER_SIZE + offset + (uint64_t)(out_len + final_len);
+        }
+        return true;
+    };
+
+    if (!run_workers(threads, worker))
+        return false;
+    return ::ftruncate(out_fd, (off_t)out_size) == 0;
+}
+
+bool crypto_engine::cipher_file(const std::string & in_filename, const std::string & out_filename, bool encrypt, unsigned threads,
+                                cipher_stats * stats, uint8_t * content_sha256)
+{
+    if(in_filename.empty() || out_filename.empty() || !valid())
+        return false;
+
+    if (stats)
+        *stats = {};
+    stats_recorder<> total(stats), record(stats);
+    total.start();
+    record.start();
+    // The output is only created once the input is known to exist, a failed job must not leave an empty file behind.
+    file_descriptor input_file(::open(in_filename.c_str(), O_RDONLY | O_CLOEXEC));
+    if (!input_file.valid())
+        return false;
+
+    // A shared writable mapping needs the output opened for reading as well.
+    int out_access = m_config.m_io_mode == io_mode::mmap ? O_RDWR : O_WRONLY;
+    file_descriptor output_file(::open(out_filename.c_str(), out_access | O_CREAT | O_TRUNC | O_CLOEXEC, 0666));
+    if (!output_file.valid())
+        return false;
+    record.stop(&cipher_stats::m_open_ns);
+
+    bool result = cipher_opened(in_filename, out_filename, input_file, output_file, encrypt, threads, stats, content_sha256);
+    total.stop(&cipher_stats::m_total_ns);
+    total.count(&cipher_stats::m_files, result ? 1 : 0);
+    return result;
+}
+
+// The I/O mode dispatch of cipher_file() once both files are open.
+bool crypto_engine::cipher_opened(const std::string & in_filename, const std::string & out_filename, file_descriptor & input_file,
+                                  file_descriptor & output_file, bool encrypt, unsigned threads, cipher_stats * stats,
+                                  uint8_t * content_sha256)
+{
+    // Digests need the data in file order, so they always take the serial streaming path.
+    if (m_config.m_digest != digest_kind::none || content_sha256 != nullptr)
+        return cipher_digested(in_filename, out_filename, input_file.get(), output_file, encrypt, stats, content_sha256);
+    // So does the RLE stage, packets can not be cut into independent segments or mapped ahead of time.
+    if (m_config.m_tga_rle)
+        return cipher_stream(input_file.get(), output_file.get(), *this, encrypt, nullptr, stats) && output_file.close();
+
+    if (threads > 1 && is_segmentable(m_cipher, encrypt))
+        return cipher_segmented(input_file.get(), output_file.get(), *this, encrypt, threads) && output_file.close();
+
+    bool result = false;
+    switch (m_config.m_io_mode)
+    {
+        case io_mode::stream:
+            result = cipher_stream(input_file.get(), output_file.get(), *this, encrypt, nullptr, stats);
+            break;
+        case io_mode::mmap:
+            result = cipher_mapped(input_file.get(), output_file.get(), *this, encrypt);
+            break;
+        case io_mode::pipeline:
+            result = cipher_pipelined(input_file.get(), output_file.get(), *this, encrypt);
+            break;
+        case io_mode::uring:
+        {
+            bool available = false;
+#ifdef __linux__
+            result = cipher_uring(input_file.get(), output_file.get(), *this, encrypt, available);
+#endif
+            if (!available)
+                result = cipher_stream(input_file.get(), output_file.get(), *this, encrypt);
+            break;
+        }
+        case io_mode::direct:
+        {
+            bool available = false;
+            result = cipher_direct(input_file.get(), output_file.get(), *this, encrypt, available);
+            if (!available)
+                result = cipher_stream(input_file.get(), output_file.get(), *this, encrypt);
+            break;
+        }
+    }
+
+    return result && output_file.close();
+}
+
+/**
+ * sha256sum/sha512sum compatible manifest next to the output: one "<hex digest>  <path>" line for the input
+ * and one for the output, so that verify_digest_manifest() or `sha256sum -c` can check both without the key.
+ * `content_sha256`, when given, receives the SHA-256 of the input.
+ */
+bool crypto_engine::cipher_digested(const std::string & in_filename, const std::string & out_filename, int in_fd,
+                                    file_descriptor & output_file, bool encrypt, cipher_stats * stats, uint8_t * content_sha256)
+{
+    stream_digests digests(m_config.m_digest, content_sha256 != nullptr);
+    if (!digests.valid() || !cipher_stream(in_fd, output_file.get(), *this, encrypt, &digests, stats) ||
+        !output_file.close() || !digests.finish())
+        return false;
+
+    if (content_sha256 != nullptr)
+        std::memcpy(content_sha256, digests.content_sha256(), SHA256_SIZE);
+    if (m_config.m_digest == digest_kind::none)
+        return true;
+
+    std::ofstream manifest(out_filename + digest_extension(m_config.m_digest), std::ios::trunc);
+    manifest << digests.input_hex() << "  " << in_filename << "\n"
+             << digests.output_hex() << "  " << out_filename << "\n";
+    manifest.close();
+    return !manifest.fail();
+}
+
+// Sums the per-file stats of a batch into `stats` (timings add up across workers, they are not wall-clock time).
+static void collect_batch_stats(const std::vector<batch_result> & results, cipher_stats * stats)
+{
+    if (!stats)
+        return;
+    *stats = {};
+    for (const batch_result & result : results)
+        *stats += result.m_stats;
+}
+
+std::vector<batch_result> crypto_engine::cipher_batch(const std::vector<batch_job> & jobs, bool encrypt)
+{
+    std::vector<batch_result> results(jobs.size());
+    for (size_t i = 0; i < jobs.size(); ++i)
+    {
+        std::error_code error;
+        results[i].m_input = jobs[i].m_input;
+        results[i].m_output = jobs[i].m_output;
+        uintmax_t size = std::filesystem::file_size(jobs[i].m_input, error);
+        results[i].m_size = error ? 0 : (uint64_t)size;
+    }
+    if (!valid())
+        return results;
+
+    // Tiny files spend more time setting up a cipher pass per file than in AES itself, they are batched instead.
+    std::vector<uint8_t> small(jobs.size());
+    std::vector<size_t> small_files;
+    bool batch_small = m_multi_buffer && m_config.m_digest == digest_kind::none && m_config.m_io_mode != io_mode::direct &&
+                       !m_config.m_tga_rle;
+    for (size_t i = 0; i < jobs.size() && batch_small; ++i)
+        if (results[i].m_size >= TGA_HEADER_SIZE && results[i].m_size <= MULTI_BUFFER_FILE_LIMIT)
+        {
+            small[i] = 1;
+            small_files.push_back(i);
+        }
+
+    run_largest_first(results, effective_thread_count(m_config), [&](size_t job)
+    {
+        if (!small[job])
+            results[job].m_success = cipher_file(jobs[job].m_input, jobs[job].m_output, encrypt, 1, job_stats(results[job]));
+    });
+    cipher_small_files(jobs, small_files, results, encrypt);
+    collect_batch_stats(results, m_config.m_stats);
+    return results;
+}
+
+/**
+ * Batch path for files of at most MULTI_BUFFER_FILE_LIMIT bytes with AES-ECB/CTR: every worker reads a group of
+ * MULTI_BUFFER_GROUP files into memory, pads them (ECB encryption) and runs all payloads through aes_multi_buffer()
+ * in place, then checks the padding (ECB decryption) and writes the outputs. The result is byte for byte what
+ * cipher_file() produces; files that changed size meanwhile and groups the kernel refuses go through cipher_file().
+ */
+void crypto_engine::cipher_small_files(const std::vector<batch_job> & jobs, const std::vector<size_t> & files,
+                                       std::vector<batch_result> & results, bool encrypt)
+{
+    if (files.empty())
+        return;
+
+    bool ctr = EVP_CIPHER_mode(m_cipher) == EVP_CIPH_CTR_MODE;
+    aes_lane_mode mode = ctr ? aes_lane_mode::ctr : encrypt ? aes_lane_mode::ecb_encrypt : aes_lane_mode::ecb_decrypt;
+    size_t groups = (files.size() + MULTI_BUFFER_GROUP - 1) / MULTI_BUFFER_GROUP;
+    unsigned threads = (unsigned)std::min<size_t>(effective_thread_count(m_config), groups);
+    std::atomic<size_t> next_group {0};
+
+    run_workers(threads, [&]
+    {
+        std::vector<uint8_t> arena;
+        std::vector<size_t> offsets, lengths;
+        std::vector<aes_lane_job> lanes;
+        std::vector<size_t> members;
+
+        for (size_t group = next_group++; group < groups; group = next_group++)
+        {
+            // One allocation per group: every file gets a byte more than its known size (to notice growth) and a padding block.
+            size_t begin = group * MULTI_BUFFER_GROUP, end = std::min(files.size(), begin + MULTI_BUFFER_GROUP);
+            offsets.assign(1, 0);
+            for (size_t k = begin; k < end; ++k)
+                offsets.push_back(offsets.back() + (size_t)results[files[k]].m_size + 1 + 16);
+            arena.resize(offsets.back());
+            lanes.clear();
+            members.clear();
+            lengths.clear();
+
+            for (size_t k = begin; k < end; ++k)
+            {
+                size_t job = files[k];
+                uint8_t * data = arena.data() + offsets[k - begin];
+                file_descriptor input(::open(jobs[job].m_input.c_str(), O_RDONLY | O_CLOEXEC));
+                size_t length = 0;
+                if (!input.valid() || !read_full(input.get(), data, (size_t)results[job].m_size + 1, length) ||
+                    length != results[job].m_size)
+                {
+                    results[job].m_success = cipher_file(jobs[job].m_input, jobs[job].m_output, encrypt, 1, job_stats(results[job]));
+                    continue;
+                }
+
+                size_t payload = length - TGA_HEADER_SIZE;
+                if (mode == aes_lane_mode::ecb_decrypt && (payload == 0 || payload % 16 != 0))
+                    continue;   // not a whole number of blocks, EVP_DecryptFinal_ex would fail as well
+
+                size_t padded = (payload + 16) / 16 * 16;
+                if (mode == aes_lane_mode::ctr || mode == aes_lane_mode::ecb_decrypt)
+                    padded = (payload + 15) / 16 * 16;
+                // PKCS#7 for ECB encryption; zeros for CTR, whose extra keystream bytes are never written.
+                std::memset(data + length, mode == aes_lane_mode::ecb_encrypt ? (int)(padded - payload) : 0, padded - payload);
+
+                aes_lane_job lane;
+                lane.m_keys = &m_lane_keys;
+                lane.m_in = lane.m_out = data + TGA_HEADER_SIZE;
+                lane.m_blocks = padded / 16;
+                if (ctr)
+                    std::memcpy(lane.m_counter, m_iv.data(), 16);
+                lanes.push_back(lane);
+                lengths.push_back(mode == aes_lane_mode::ecb_encrypt ? TGA_HEADER_SIZE + padded : length);
+                members.push_back(job);
+            }
+
+            if (!aes_multi_buffer(lanes, mode))
+            {
+                for (size_t job : members)
+                    results[job].m_success = cipher_file(jobs[job].m_input, jobs[job].m_output, encrypt, 1, job_stats(results[job]));
+                continue;
+            }
+
+            for (size_t member = 0; member < members.size(); ++member)
+            {
+                const uint8_t * data = lanes[member].m_out - TGA_HEADER_SIZE;
+                size_t length = lengths[member];
+                if (mode == aes_lane_mode::ecb_decrypt)
+                {
+                    uint8_t padding = data[length - 1];
+                    if (padding == 0 || padding > 16)
+                        continue;
+                    for (size_t i = length - padding; i < length; ++i)
+                        if (data[i] != padding)
+                            padding = 0;
+                    if (padding == 0)
+                        continue;
+                    length -= padding;
+                }
+
+                size_t job = members[member];
+                file_descriptor output(::open(jobs[job].m_output.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666));
+                results[job].m_success = output.valid() && write_full(output.get(), data, length) && output.close();
+                stats_recorder<> record(job_stats(results[job]));
+                record.count(&cipher_stats::m_bytes_read, results[job].m_size);
+                record.count(&cipher_stats::m_bytes_written, length);
+                record.count(&cipher_stats::m_files, results[job].m_success ? 1 : 0);
+            }
+        }
+        return true;
+    });
+}
+
+// On-disk records of the incremental index, stored in host byte order so that the file can be mapped and searched as is.
+struct index_header {
+    uint8_t m_magic[8];
+    uint32_t m_version;
+    uint32_t m_entry_size;
+    uint64_t m_count;
+    uint64_t m_reserved;
+};
+
+struct index_entry {
+    uint8_t m_job_hash[16];             // truncated SHA-256 of the absolute input and output paths
+    uint64_t m_size;
+    int64_t m_mtime_ns;
+    uint8_t m_content_sha256[SHA256_SIZE];
+    uint8_t m_key_id[KEY_ID_SIZE];
+};
+
+static_assert(sizeof(index_header) == 32 && sizeof(index_entry) == 80, "the index layout must not depend on padding");
+
+static bool operator<(const index_entry & a, const index_entry & b)
+{
+    return std::memcmp(a.m_job_hash, b.m_job_hash, sizeof(a.m_job_hash)) < 0;
+}
+
+/**
+ * Read side of the incremental index: the file is mapped and looked up with a binary search, so opening an index
+ * of millions of entries costs one mmap() and lookups only touch the pages they hit. A missing, truncated or
+ * foreign file reads as an empty index.
+ */
+class incremental_index {
+public:
+    explicit incremental_index(const std::string & filename)
+        : m_file(::open(filename.c_str(), O_RDONLY | O_CLOEXEC))
+    {
+        struct stat file_stat {};
+        if (!m_file.valid() || ::fstat(m_file.get(), &file_stat) != 0 || (uint64_t)file_stat.st_size <= sizeof(index_header))
+            return;
+
+        m_mapping = std::make_unique<memory_mapping>(m_file.get(), (size_t)file_stat.st_size, PROT_READ);
+        if (!m_mapping->valid())
+            return;
+        ::madvise(m_mapping->data(), (size_t)file_stat.st_size, MADV_RANDOM);
+
+        index_header header;
+        std::memcpy(&header, m_mapping->data(), sizeof(header));
+        if (std::memcmp(header.m_magic, INDEX_MAGIC, sizeof(INDEX_MAGIC)) != 0 || header.m_version != INDEX_VERSION ||
+            header.m_entry_size != sizeof(index_entry) ||
+            header.m_count != ((uint64_t)file_stat.st_size - sizeof(index_header)) / sizeof(index_entry) ||
+            ((uint64_t)file_stat.st_size - sizeof(index_header)) % sizeof(index_entry) != 0)
+            return;
+
+        m_entries = std::span<const index_entry>(reinterpret_cast<const index_entry*>(m_mapping->data() + sizeof(index_header)),
+                                                 (size_t)header.m_count);
+    }
+
+    std::span<const index_entry> entries() const { return m_entries; }
+
+    const index_entry * find(const index_entry & key) const
+    {
+        auto it = std::lower_bound(m_entries.begin(), m_entries.end(), key);
+        return it != m_entries.end() && !(key < *it) ? &*it : nullptr;
+    }
+
+    // Writes `entries` (sorted) next to `filename` and renames the result over it, readers never see a partial index.
+    static bool write(const std::string & filename, const std::vector<index_entry> & entries)
+    {
+        index_header header {};
+        std::memcpy(header.m_magic, INDEX_MAGIC, sizeof(INDEX_MAGIC));
+        header.m_version = INDEX_VERSION;
+        header.m_entry_size = sizeof(index_entry);
+        header.m_count = entries.size();
+
+        std::string temporary = filename + ".tmp";
+        file_descriptor file(::open(temporary.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666));
+        bool written = file.valid() &&
+                       write_full(file.get(), reinterpret_cast<const uint8_t*>(&header), sizeof(header)) &&
+                       write_full(file.get(), reinterpret_cast<const uint8_t*>(entries.data()), entries.size() * sizeof(index_entry)) &&
+                       file.close() && std::rename(temporary.c_str(), filename.c_str()) == 0;
+        if (!written)
+            std::remove(temporary.c_str());
+        return written;
+    }
+
+private:
+    file_descriptor m_file;
+    std::unique_ptr<memory_mapping> m_mapping;
+    std::span<const index_entry> m_entries;
+};
+
+incremental_report crypto_engine::encrypt_incremental(const std::vector<batch_job> & jobs, const std::string & index_filename)
+{
+    namespace fs = std::filesystem;
+    incremental_report report;
+    report.m_results.resize(jobs.size());
+    std::vector<index_entry> entries(jobs.size());
+    std::vector<uint8_t> recorded(jobs.size());     // written by the workers, so no packed std::vector<bool>
+
+    // The recorded id also covers the options that shape the output, a changed RLE stage or digest redoes every file.
+    uint8_t format[KEY_ID_SIZE + 2], format_id[EVP_MAX_MD_SIZE];
+    std::memcpy(format, m_key_id, KEY_ID_SIZE);
+    format[KEY_ID_SIZE] = (uint8_t)m_config.m_tga_rle;
+    format[KEY_ID_SIZE + 1] = (uint8_t)m_config.m_digest;
+    EVP_Digest(format, sizeof(format), format_id, nullptr, EVP_sha256(), nullptr);
+
+    for (size_t i = 0; i < jobs.size(); ++i)
+    {
+        batch_result & result = report.m_results[i];
+        index_entry & entry = entries[i];
+        result.m_input = jobs[i].m_input;
+        result.m_output = jobs[i].m_output;
+
+        std::error_code error;
+        std::string job_paths = fs::absolute(jobs[i].m_input, error).lexically_normal().string() + '\0' +
+                                fs::absolute(jobs[i].m_output, error).lexically_normal().string();
+        uint8_t digest[EVP_MAX_MD_SIZE];
+        EVP_Digest(job_paths.data(), job_paths.size(), digest, nullptr, EVP_sha256(), nullptr);
+        std::memcpy(entry.m_job_hash, digest, sizeof(entry.m_job_hash));
+        std::memcpy(entry.m_key_id, format_id, KEY_ID_SIZE);
+    }
+    if (!valid())
+        return report;
+
+    incremental_index index(index_filename);
+    run_largest_first(report.m_results, effective_thread_count(m_config), [&](size_t job)
+    {
+        batch_result & result = report.m_results[job];
+        index_entry & entry = entries[job];
+
+        // Size and mtime are taken before reading, a file changing during encryption is picked up by the next run.
+        std::error_code size_error, time_error, error;
+        uintmax_t size = fs::file_size(jobs[job].m_input, size_error);
+        fs::file_time_type mtime = fs::last_write_time(jobs[job].m_input, time_error);
+        if (size_error || time_error)
+            return;
+        entry.m_size = result.m_size = (uint64_t)size;
+        entry.m_mtime_ns = (int64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(mtime.time_since_epoch()).count();
+
+        const index_entry * previous = index.find(entry);
+        bool unchanged = previous != nullptr && previous->m_size == entry.m_size &&
+                         std::memcmp(previous->m_key_id, entry.m_key_id, KEY_ID_SIZE) == 0 && fs::exists(jobs[job].m_output, error) &&
+                         (m_config.m_digest == digest_kind::none ||
+                          fs::exists(jobs[job].m_output + digest_extension(m_config.m_digest), error));
+        if (unchanged && previous->m_mtime_ns != entry.m_mtime_ns)
+        {
+            // Touched but maybe not modified: reading the input once is still cheaper than encrypting and writing it.
+            std::vector<uint8_t> content;
+            unchanged = digest_file(jobs[job].m_input, EVP_sha256(), content) &&
+                        std::memcmp(content.data(), previous->m_content_sha256, SHA256_SIZE) == 0;
+        }
+
+        if (unchanged)
+        {
+            std::memcpy(entry.m_content_sha256, previous->m_content_sha256, SHA256_SIZE);
+            result.m_success = result.m_skipped = true;
+        }
+        else
+            result.m_success = cipher_file(jobs[job].m_input, jobs[job].m_output, true, 1, job_stats(result), entry.m_content_sha256);
+        recorded[job] = result.m_success;
+    });
+
+    for (const batch_result & result : report.m_results)
+        if (result.m_skipped)
+        {
+            ++report.m_skipped;
+            report.m_bytes_saved += result.m_size;
+        }
+    collect_batch_stats(report.m_results, m_config.m_stats);
+
+    // Entries of this run replace the old ones; a failed job loses its entry, its output can not be trusted.
+    std::vector<index_entry> touched(entries);
+    std::sort(touched.begin(), touched.end());
+    std::vector<index_entry> updated;
+    updated.reserve(index.entries().size() + entries.size());
+    for (const index_entry & entry : index.entries())
+        if (!std::binary_search(touched.begin(), touched.end(), entry))
+            updated.push_back(entry);
+    for (size_t i = 0; i < entries.size(); ++i)
+        if (recorded[i])
+            updated.push_back(entries[i]);
+    std::sort(updated.begin(), updated.end());
+    updated.erase(std::unique(updated.begin(), updated.end(), [](const index_entry & a, const index_entry & b) { return !(a < b) && !(b < a); }),
+                  updated.end());
+
+    // Without a saved index the next run would redo everything, which the caller should hear about.
+    if (!incremental_index::write(index_filename, updated))
+        for (batch_result & result : report.m_results)
+            result.m_success = false;
+    return report;
+}
+
+size_t crypto_engine::output_size(size_t in_size, bool encrypt) const
+{
+    if (!valid() || in_size < TGA_HEADER_SIZE)
+        return TGA_HEADER_SIZE;
+
+    size_t block_size = (size_t)EVP_CIPHER_block_size(m_cipher);
+    if (!encrypt || block_size == 1)
+        return in_size;
+    size_t payload_size = in_size - TGA_HEADER_SIZE;
+    return TGA_HEADER_SIZE + payload_size - payload_size % block_size + block_size;
+}
+
+bool crypto_engine::cipher_buffer(std::span<const uint8_t> in, std::span<uint8_t> out, size_t & out_size, bool encrypt)
+{
+    out_size = 0;
+    if (!valid() || in.size() < TGA_HEADER_SIZE)
+        return false;
+
+    size_t required_size = output_size(in.size(), encrypt);
+    if (out.size() < required_size)
+    {
+        out_size = required_size;
+        return false;
+    }
+
+    const uint8_t * in_begin = in.data();
+    const uint8_t * out_begin = out.data();
+    bool in_place = in_begin == out_begin;
+    if (!in_place && in_begin < out_begin + out.size() && out_begin < in_begin + in.size())
+        return false;
+
+    context_lease ctx = acquire(encrypt);
+    if (!ctx)
+        return false;
+
+    if (!in_place)
+        std::memcpy(out.data(), in.data(), TGA_HEADER_SIZE);
+
+    // Written bytes never run ahead of consumed ones, which is what keeps the in-place case safe.
+    size_t in_offset = TGA_HEADER_SIZE;
+    size_t out_offset = TGA_HEADER_SIZE;
+    int out_len = 0;
+    while (in_offset < in.size())
+    {
+        size_t length = std::min(MAX_CHUNK_SIZE, in.size() - in_offset);
+        if (!EVP_CipherUpdate(ctx.get(), out.data() + out_offset, &out_len, in.data() + in_offset, (int)length))
+            return false;
+        in_offset += length;
+        out_offset += (size_t)out_len;
+    }
+
+    if (!EVP_CipherFinal_ex(ctx.get(), out.data() + out_offset, &out_len))
+        return false;
+
+    out_size = out_offset + (size_t)out_len;
+    return true;
+}
+
+struct container_trailer {
+    uint32_t m_cipher_nid = 0;
+    uint32_t m_chunk_size = 0;
+    uint64_t m_payload_size = 0;
+    uint64_t m_chunk_count = 0;
+    uint64_t m_index_offset = 0;
+    uint8_t m_nonce_base[AEAD_NONCE_SIZE] {};
+
+    // magic[8] | version u32 | cipher nid u32 | chunk size u32 | reserved u32 | payload u64 | chunks u64 | index offset u64 | nonce base[12] | reserved[4]
+    void store(uint8_t * data) const
+    {
+        std::memset(data, 0, CONTAINER_TRAILER_SIZE);
+        std::memcpy(data, CONTAINER_MAGIC, sizeof(CONTAINER_MAGIC));
+        store_le(data + 8, CONTAINER_VERSION, 4);
+        store_le(data + 12, m_cipher_nid, 4);
+        store_le(data + 16, m_chunk_size, 4);
+        store_le(data + 24, m_payload_size, 8);
+        store_le(data + 32, m_chunk_count, 8);
+        store_le(data + 40, m_index_offset, 8);
+        std::memcpy(data + 48, m_nonce_base, AEAD_NONCE_SIZE);
+    }
+
+    bool load(const uint8_t * data)
+    {
+        if (std::memcmp(data, CONTAINER_MAGIC, sizeof(CONTAINER_MAGIC)) != 0 || load_le(data + 8, 4) != CONTAINER_VERSION)
+            return false;
+        m_cipher_nid = (uint32_t)load_le(data + 12, 4);
+        m_chunk_size = (uint32_t)load_le(data + 16, 4);
+        m_payload_size = load_le(data + 24, 8);
+        m_chunk_count = load_le(data + 32, 8);
+        m_index_offset = load_le(data + 40, 8);
+        std::memcpy(m_nonce_base, data + 48, AEAD_NONCE_SIZE);
+        return true;
+    }
+
+    /**
+     * Whether a container of `file_size` bytes matches this layout, every chunk (the last one possibly empty) followed
+     * by its tag. Payload and chunk count are bounded by the real size before any sum or product is formed, so a
+     * crafted trailer can not wrap them around to a plausible size.
+     */
+    bool consistent(uint64_t file_size) const
+    {
+        if (m_chunk_size < COUNTER_BLOCK_SIZE || m_chunk_size > MAX_CHUNK_SIZE || m_payload_size > file_size ||
+            m_chunk_count > (file_size - m_payload_size) / AEAD_TAG_SIZE)
+            return false;
+        return m_chunk_count == std::max<uint64_t>(1, (m_payload_size + m_chunk_size - 1) / m_chunk_size) &&
+               m_index_offset == TGA_HEADER_SIZE + m_payload_size + m_chunk_count * AEAD_TAG_SIZE &&
+               m_index_offset + m_chunk_count * 8 + CONTAINER_TRAILER_SIZE == file_size;
+    }
+};
+
+static bool is_container_cipher(const EVP_CIPHER * cypher_name)
+{
+    return cypher_name != nullptr && (EVP_CIPHER_flags(cypher_name) & EVP_CIPH_FLAG_AEAD_CIPHER) &&
+           EVP_CIPHER_iv_length(cypher_name) == (int)AEAD_NONCE_SIZE;
+}
+
+/**
+ * Per-chunk nonce and associated data. The nonce is the file's random base with the chunk index mixed into its
+ * last 8 bytes, the associated data binds each chunk to the image header, the trailer, its own index and offset
+ * and whether it is the last one, so chunks can not be reordered, moved between files or truncated away.
+ */
+class chunk_binding {
+public:
+    chunk_binding(const uint8_t * header, const container_trailer & trailer)
+    {
+        std::memcpy(m_aad, header, TGA_HEADER_SIZE);
+        trailer.store(m_aad + TGA_HEADER_SIZE);
+        std::memcpy(m_nonce_base, trailer.m_nonce_base, AEAD_NONCE_SIZE);
+        m_chunk_count = trailer.m_chunk_count;
+    }
+
+    bool apply(EVP_CIPHER_CTX * ctx, uint64_t index, uint64_t offset, bool encrypt)
+    {
+        uint8_t nonce[AEAD_NONCE_SIZE];
+        std::memcpy(nonce, m_nonce_base, AEAD_NONCE_SIZE);
+        for (size_t i = 0; i < 8; ++i)
+            nonce[AEAD_NONCE_SIZE - 1 - i] ^= (uint8_t)(index >> (8 * i));
+
+        uint8_t * chunk_part = m_aad + TGA_HEADER_SIZE + CONTAINER_TRAILER_SIZE;
+        store_le(chunk_part, index, 8);
+        store_le(chunk_part + 8, offset, 8);
+        chunk_part[16] = index + 1 == m_chunk_count ? 1 : 0;
+
+        int out_len = 0;
+        return EVP_CipherInit_ex(ctx, nullptr, nullptr, nullptr, nonce, encrypt ? 1 : 0) &&
+               EVP_CipherUpdate(ctx, nullptr, &out_len, m_aad, (int)sizeof(m_aad));
+    }
+
+private:
+    uint8_t m_aad[TGA_HEADER_SIZE + CONTAINER_TRAILER_SIZE + 17];
+    uint8_t m_nonce_base[AEAD_NONCE_SIZE];
+    uint64_t m_chunk_count;
+};
+
+/**
+ * Random access into a file written by crypto_engine::encrypt_container(). Layout:
+ *   TGA header (18 bytes, plaintext)
+ *   chunk_count x [ciphertext of up to chunk_size payload bytes | 16 byte tag]
+ *   chunk index: chunk_count x u64 offset of each sealed chunk
+ *   trailer (CONTAINER_TRAILER_SIZE bytes, see container_trailer::store)
+ * All integers are little-endian. The trailer and the index are read once on opening, so a viewer keeping the
+ * reader around pays one pread() and one authenticated decryption per chunk touched by read().
+ */
+class container_reader {
+public:
+    container_reader(crypto_engine & engine, const std::string & filename)
+        : m_engine(engine), m_file(::open(filename.c_str(), O_RDONLY | O_CLOEXEC))
+    {
+        struct stat file_stat {};
+        if (!m_file.valid() || !is_container_cipher(engine.cipher()) || ::fstat(m_file.get(), &file_stat) != 0 ||
+            (uint64_t)file_stat.st_size < TGA_HEADER_SIZE + CONTAINER_TRAILER_SIZE)
+            return;
+
+        uint8_t trailer[CONTAINER_TRAILER_SIZE];
+        if (!pread_full(m_file.get(), trailer, CONTAINER_TRAILER_SIZE, (uint64_t)file_stat.st_size - CONTAINER_TRAILER_SIZE) ||
+            !m_trailer.load(trailer) || !m_trailer.consistent((uint64_t)file_stat.st_size) ||
+            m_trailer.m_cipher_nid != (uint32_t)EVP_CIPHER_nid(engine.cipher()))
+            return;
+
+        std::vector<uint8_t> index(m_trailer.m_chunk_count * 8);
+        if (!pread_full(m_file.get(), m_header, TGA_HEADER_SIZE, 0) ||
+            !pread_full(m_file.get(), index.data(), index.size(), m_trailer.m_index_offset))
+            return;
+
+        m_offsets.resize(m_trailer.m_chunk_count);
+        for (uint64_t i = 0; i < m_trailer.m_chunk_count; ++i)
+        {
+            m_offsets[i] = load_le(index.data() + 8 * i, 8);
+            if (m_offsets[i] > m_trailer.m_index_offset || m_trailer.m_index_offset - m_offsets[i] < chunk_length(i) + AEAD_TAG_SIZE)
+                return;
+        }
+        m_valid = true;
+    }
+
+    bool valid() const { return m_valid; }
+    // Size of the original image, header included.
+    uint64_t size() const { return TGA_HEADER_SIZE + m_trailer.m_payload_size; }
+    const uint8_t * header() const { return m_header; }
+    uint64_t chunk_count() const { return m_trailer.m_chunk_count; }
+    size_t chunk_size() const { return m_trailer.m_chunk_size; }
+    size_t chunk_length(uint64_t index) const
+    {
+        return (size_t)std::min<uint64_t>(m_trailer.m_chunk_size, m_trailer.m_payload_size - index * m_trailer.m_chunk_size);
+    }
+
+    /**
+     * Decrypts and authenticates chunk `index` into `out` (chunk_length(index) bytes), `sealed` is scratch space of
+     * at least chunk_size() + AEAD_TAG_SIZE bytes. Nothing is left in `out` unless the tag matched.
+     */
+    bool read_chunk(EVP_CIPHER_CTX * ctx, uint64_t index, uint8_t * out, uint8_t * sealed) const
+    {
+        size_t length = chunk_length(index);
+        chunk_binding binding(m_header, m_trailer);
+        int out_len = 0, final_len = 0;
+        bool ok = pread_full(m_file.get(), sealed, length + AEAD_TAG_SIZE, m_offsets[index]) &&
+                  binding.apply(ctx, index, m_offsets[index], false) &&
+                  EVP_CipherUpdate(ctx, out, &out_len, sealed, (int)length) &&
+                  EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_AEAD_SET_TAG, (int)AEAD_TAG_SIZE, sealed + length) &&
+                  EVP_CipherFinal_ex(ctx, out + out_len, &final_len);
+        if (!ok)
+            std::memset(out, 0, length);
+        return ok;
+    }
+
+    // `length` bytes of the original image from `offset`; the chunks involved are decrypted on up to `m_threads` workers.
+    bool read(uint64_t offset, size_t length, std::vector<uint8_t> & out) const
+    {
+        out.clear();
+        if (!m_valid || offset > size() || length > size() - offset)
+            return false;
+        out.resize(length);
+        if (length == 0)
+            return true;
+
+        uint64_t end = offset + length;
+        if (offset < TGA_HEADER_SIZE)
+            std::memcpy(out.data(), m_header + offset, (size_t)std::min<uint64_t>(end, TGA_HEADER_SIZE) - offset);
+        if (end <= TGA_HEADER_SIZE)
+            return true;
+
+        uint64_t payload_begin = std::max<uint64_t>(offset, TGA_HEADER_SIZE) - TGA_HEADER_SIZE;
+        uint64_t payload_end = end - TGA_HEADER_SIZE;
+        uint64_t first = payload_begin / m_trailer.m_chunk_size;
+        uint64_t last = (payload_end - 1) / m_trailer.m_chunk_size;
+        unsigned threads = (unsigned)std::min<uint64_t>(effective_thread_count(m_engine.config()), last - first + 1);
+
+        std::atomic<uint64_t> next_chunk {first};
+        std::atomic<bool> failed {false};
+        bool decrypted = run_workers(threads, [&]() -> bool
+        {
+            crypto_engine::context_lease ctx = m_engine.acquire(false);
+            std::vector<uint8_t> plain(m_trailer.m_chunk_size), sealed(m_trailer.m_chunk_size + AEAD_TAG_SIZE);
+            for (uint64_t index = next_chunk++; index <= last && !failed; index = next_chunk++)
+            {
+                if (!ctx || !read_chunk(ctx.get(), index, plain.data(), sealed.data()))
+                {
+                    failed = true;
+                    return false;
+                }
+                uint64_t chunk_begin = index * m_trailer.m_chunk_size;
+                uint64_t copy_begin = std::max(chunk_begin, payload_begin);
+                uint64_t copy_end = std::min<uint64_t>(chunk_begin + chunk_length(index), payload_end);
+                std::memcpy(out.data() + (TGA_HEADER_SIZE + copy_begin - offset), plain.data() + (copy_begin - chunk_begin),
+                            (size_t)(copy_end - copy_begin));
+            }
+            return true;
+        });
+
+        if (!decrypted)
+            out.clear();
+        return decrypted;
+    }
+
+private:
+    crypto_engine & m_engine;
+    file_descriptor m_file;
+    container_trailer m_trailer;
+    uint8_t m_header[TGA_HEADER_SIZE] {};
+    std::vector<uint64_t> m_offsets;
+    bool m_valid = false;
+};
+
+bool crypto_engine::encrypt_container(const std::string & in_filename, const std::string & out_filename)
+{
+    if (in_filename.empty() || out_filename.empty() || !is_container_cipher(m_cipher))
+        return false;
+
+    file_descriptor input_file(::open(in_filename.c_str(), O_RDONLY | O_CLOEXEC));
+    struct stat in_stat {};
+    uint8_t header[TGA_HEADER_SIZE];
+    if (!input_file.valid() || ::fstat(input_file.get(), &in_stat) != 0 || !S_ISREG(in_stat.st_mode) ||
+        (uint64_t)in_stat.st_size < TGA_HEADER_SIZE || !pread_full(input_file.get(), header, TGA_HEADER_SIZE, 0))
+        return false;
+
+    container_trailer trailer;
+    trailer.m_cipher_nid = (uint32_t)EVP_CIPHER_nid(m_cipher);
+    trailer.m_chunk_size = (uint32_t)effective_chunk_size(m_config, EVP_CIPHER_block_size(m_cipher));
+    trailer.m_payload_size = (uint64_t)in_stat.st_size - TGA_HEADER_SIZE;
+    trailer.m_chunk_count = std::max<uint64_t>(1, (trailer.m_payload_size + trailer.m_chunk_size - 1) / trailer.m_chunk_size);
+    trailer.m_index_offset = TGA_HEADER_SIZE + trailer.m_payload_size + trailer.m_chunk_count * AEAD_TAG_SIZE;
+    // A fresh nonce base per file, so the same key can seal any number of files without repeating a nonce.
+    if (RAND_bytes(trailer.m_nonce_base, AEAD_NONCE_SIZE) != 1)
+        return false;
+
+    file_descriptor output_file(::open(out_filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666));
+    if (!output_file.valid())
+        return false;
+
+    std::vector<uint8_t> index(trailer.m_chunk_count * 8 + CONTAINER_TRAILER_SIZE);
+    for (uint64_t i = 0; i < trailer.m_chunk_count; ++i)
+        store_le(index.data() + 8 * i, TGA_HEADER_SIZE + i * (trailer.m_chunk_size + AEAD_TAG_SIZE), 8);
+    trailer.store(index.data() + trailer.m_chunk_count * 8);
+
+    unsigned threads = (unsigned)std::min<uint64_t>(effective_thread_count(m_config), trailer.m_chunk_count);
+    std::atomic<uint64_t> next_chunk {0};
+    std::atomic<bool> failed {false};
+    bool sealed = run_workers(threads, [&]() -> bool
+    {
+        context_lease ctx = acquire(true);
+        chunk_binding binding(header, trailer);
+        size_t buffer_size = (size_t)std::min<uint64_t>(trailer.m_chunk_size, trailer.m_payload_size);
+        std::vector<uint8_t> plain(buffer_size), sealed_chunk(buffer_size + AEAD_TAG_SIZE);
+
+        for (uint64_t chunk = next_chunk++; chunk < trailer.m_chunk_count && !failed; chunk = next_chunk++)
+        {
+            uint64_t payload_offset = chunk * trailer.m_chunk_size;
+            uint64_t offset = TGA_HEADER_SIZE + chunk * (trailer.m_chunk_size + AEAD_TAG_SIZE);
+            size_t length = (size_t)std::min<uint64_t>(trailer.m_chunk_size, trailer.m_payload_size - payload_offset);
+            int out_len = 0, final_len = 0;
+            bool ok = ctx &&
+                      pread_full(input_file.get(), plain.data(), length, TGA_HEADER_SIZE + payload_offset) &&
+                      binding.apply(ctx.get(), chunk, offset, true) &&
+                      EVP_CipherUpdate(ctx.get(), sealed_chunk.data(), &out_len, plain.data(), (int)length) &&
+                      EVP_CipherFinal_ex(ctx.get(), sealed_chunk.data() + out_len, &final_len) &&
+                      EVP_CIPHER_CTX_ctrl(ctx.get(), EVP_CTRL_AEAD_GET_TAG, (int)AEAD_TAG_SIZE, sealed_chunk.data() + length) &&
+                      pwrite_full(output_file.get(), sealed_chunk.data(), length + AEAD_TAG_SIZE, offset);
+            if (!ok)
+            {
+                failed = true;
+                return false;
+            }
+        }
+        return true;
+    });
+
+    return sealed &&
+           pwrite_full(output_file.get(), header, TGA_HEADER_SIZE, 0) &&
+           pwrite_full(output_file.get(), index.data(), index.size(), trailer.m_index_offset) &&
+           output_file.close();
+}
+
+bool crypto_engine::decrypt_container(const std::string & in_filename, const std::string & out_filename)
+{
+    if (in_filename.empty() || out_filename.empty())
+        return false;
+
+    container_reader reader(*this, in_filename);
+    if (!reader.valid())
+        return false;
+
+    file_descriptor output_file(::open(out_filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666));
+    if (!output_file.valid() || !pwrite_full(output_file.get(), reader.header(), TGA_HEADER_SIZE, 0))
+        return false;
+
+    unsigned threads = (unsigned)std::min<uint64_t>(effective_thread_count(m_config), reader.chunk_count());
+    std::atomic<uint64_t> next_chunk {0};
+    std::atomic<bool> failed {false};
+    bool opened = run_workers(threads, [&]() -> bool
+    {
+        context_lease ctx = acquire(false);
+        std::vector<uint8_t> plain(reader.chunk_size()), sealed(reader.chunk_size() + AEAD_TAG_SIZE);
+        for (uint64_t chunk = next_chunk++; chunk < reader.chunk_count() && !failed; chunk = next_chunk++)
+        {
+            if (!ctx || !reader.read_chunk(ctx.get(), chunk, plain.data(), sealed.data()) ||
+                !pwrite_full(output_file.get(), plain.data(), reader.chunk_length(chunk), TGA_HEADER_SIZE + chunk * reader.chunk_size()))
+            {
+                failed = true;
+                return false;
+            }
+        }
+        return true;
+    });
+
+    return opened && ::ftruncate(output_file.get(), (off_t)reader.size()) == 0 && output_file.close();
+}
+
+bool crypto_engine::decrypt_range(const std::string & filename, uint64_t offset, size_t length, std::vector<uint8_t> & out)
+{
+    container_reader reader(*this, filename);
+    return reader.read(offset, length, out);
+}
+
+bool encrypt_data(const std::string & in_filename, const std::string & out_filename, crypto_config & config) {
+    crypto_engine engine(config);
+    return engine.encrypt_file(in_filename, out_filename);
+}
+
+bool decrypt_data(const std::string & in_filename, const std::string & out_filename, crypto_config & config) {
+    crypto_engine engine(config, false);
+    return engine.decrypt_file(in_filename, out_filename);
+}
+
+bool encrypt_fd(int in_fd, int out_fd, crypto_config & config) {
+    crypto_engine engine(config);
+    return engine.encrypt_fd(in_fd, out_fd);
+}
+
+bool decrypt_fd(int in_fd, int out_fd, crypto_config & config) {
+    crypto_engine engine(config, false);
+    return engine.decrypt_fd(in_fd, out_fd);
+}
+
+bool encrypt_buffer(std::span<const uint8_t> in, std::span<uint8_t> out, crypto_config & config, size_t & out_size) {
+    crypto_engine engine(config);
+    return engine.encrypt_buffer(in, out, out_size);
+}
+
+bool decrypt_buffer(std::span<const uint8_t> in, std::span<uint8_t> out, crypto_config & config, size_t & out_size) {
+    crypto_engine engine(config, false);
+    return engine.decrypt_buffer(in, out, out_size);
+}
+
+std::vector<batch_result> encrypt_batch(const std::vector<batch_job> & jobs, crypto_config & config) {
+    crypto_engine engine(config);
+    return engine.encrypt_batch(jobs);
+}
+
+std::vector<batch_result> decrypt_batch(const std::vector<batch_job> & jobs, crypto_config & config) {
+    crypto_engine engine(config, false);
+    return engine.decrypt_batch(jobs);
+}
+
+bool encrypt_container(const std::string & in_filename, const std::string & out_filename, crypto_config & config) {
+    crypto_engine engine(config);
+    return engine.encrypt_container(in_filename, out_filename);
+}
+
+bool decrypt_container(const std::string & in_filename, const std::string & out_filename, crypto_config & config) {
+    crypto_engine engine(config, false);
+    return engine.decrypt_container(in_filename, out_filename);
+}
+
+bool decrypt_range(const std::string & filename, uint64_t offset, size_t length, std::vector<uint8_t> & out, crypto_config & config) {
+    crypto_engine engine(config, false);
+    return engine.decrypt_range(filename, offset, length, out);
+}
+
+// Lookups of an engine_cache since its construction.
+struct engine_cache_stats {
+    uint64_t m_hits = 0;
+    uint64_t m_misses = 0;       // including loads that failed
+    uint64_t m_evictions = 0;
+    size_t m_size = 0;           // engines currently cached
+
+    double hit_rate() const { return m_hits + m_misses ? (double)m_hits / (double)(m_hits + m_misses) : 0.0; }
+};
+
+/**
+ * Bounded LRU cache of keyed crypto_engines for services holding one key per tenant, keyed by (cipher, key ID), so
+ * switching back to a recently used tenant skips the cipher fetch and the key schedule. The key ID only names the
+ * key; the material is fetched through the loader on a miss, outside of any lock. Entries are spread over
+ * independently locked shards by the hash of their key, each shard evicting its least recently used engine.
+ * An evicted engine stays usable by callers still holding it; its key, IV, contexts and round keys are wiped
+ * once the last of them lets go.
+ */
+class engine_cache {
+public:
+    // Fills in key and IV (and any option other than the cipher) for `key_id`, false when there is no such key.
+    using key_loader = std::function<bool(const std::string & key_id, crypto_config & config)>;
+
+    engine_cache(size_t capacity, key_loader loader, size_t shards = DEFAULT_ENGINE_CACHE_SHARDS)
+        : m_loader(std::move(loader)), m_shards(std::max<size_t>(1, std::min(shards, std::max<size_t>(capacity, 1))))
+    {
+        // The capacity is split evenly, every shard holds at least one engine.
+        for (size_t i = 0; i < m_shards.size(); ++i)
+            m_shards[i].m_capacity = std::max<size_t>(1, capacity / m_shards.size() + (i < capacity % m_shards.size()));
+    }
+
+    /**
+     * Engine for `key_id` with `cipher`, built and cached on a miss; nullptr when the loader fails or the key does
+     * not suit the cipher. The engine reads its options from a config owned by the cache.
+     */
+    std::shared_ptr<crypto_engine> get(const std::string & cipher, const std::string & key_id);
+
+    // Drops the engine of one key, e.g. after it was rotated, false when it was not cached.
+    bool erase(const std::string & cipher, const std::string & key_id);
+    void clear();
+    engine_cache_stats stats() const;
+
+private:
+    // The engine with the config it refers to; the key material is wiped with it.
+    struct entry {
+        entry(const std::string & cipher, crypto_config && config)
+            : m_cipher(cipher), m_config(std::move(config)), m_engine((m_config.m_crypto_function = m_cipher.c_str(), m_config), false) {}
+        ~entry()
+        {
+            if (m_config.m_key)
+                OPENSSL_cleanse(m_config.m_key.get(), m_config.m_key_len);
+            if (m_config.m_IV)
+                OPENSSL_cleanse(m_config.m_IV.get(), m_config.m_IV_len);
+        }
+
+        std::string m_cipher;
+        crypto_config m_config;
+        crypto_engine m_engine;
+    };
+
+    using lru_list = std::list<std::pair<std::string, std::shared_ptr<entry>>>;   // most recently used first
+
+    struct shard {
+        mutable std::mutex m_mutex;
+        lru_list m_lru;
+        std::unordered_map<std::string, lru_list::iterator> m_index;
+        size_t m_capacity = 1;
+    };
+
+    static std::string cache_key(const std::string & cipher, const std::string & key_id) { return cipher + '\0' + key_id; }
+    shard & shard_for(const std::string & key) { return m_shards[std::hash<std::string>{}(key) % m_shards.size()]; }
+
+    key_loader m_loader;
+    std::vector<shard> m_shards;
+    std::atomic<uint64_t> m_hits {0};
+    std::atomic<uint64_t> m_misses {0};
+    std::atomic<uint64_t> m_evictions {0};
+};
+
+std::shared_ptr<crypto_engine> engine_cache::get(const std::string & cipher, const std::string & key_id)
+{
+    std::string key = cache_key(cipher, key_id);
+    shard & part = shard_for(key);
+    {
+        std::lock_guard<std::mutex> lock(part.m_mutex);
+        auto found = part.m_index.find(key);
+        if (found != part.m_index.end())
+        {
+            part.m_lru.splice(part.m_lru.begin(), part.m_lru, found->second);
+            ++m_hits;
+            std::shared_ptr<entry> & cached = found->second->second;
+            return std::shared_ptr<crypto_engine>(cached, &cached->m_engine);
+        }
+    }
+
+    ++m_misses;
+    crypto_config config {nullptr, nullptr, nullptr, 0, 0};
+    if (!m_loader || !m_loader(key_id, config))
+        return nullptr;
+    auto loaded = std::make_shared<entry>(cipher, std::move(config));
+    if (!loaded->m_engine.valid())
+        return nullptr;
+
+    // Evicted engines are wiped as soon as no caller holds them any more.
+    std::lock_guard<std::mutex> lock(part.m_mutex);
+    auto found = part.m_index.find(key);
+    if (found != part.m_index.end())
+    {
+        // Another thread loaded the same key meanwhile, ours is dropped.
+        part.m_lru.splice(part.m_lru.begin(), part.m_lru, found->second);
+        loaded = found->second->second;
+    }
+    else
+    {
+        part.m_lru.emplace_front(key, loaded);
+        part.m_index.emplace(std::move(key), part.m_lru.begin());
+        while (part.m_lru.size() > part.m_capacity)
+        {
+            part.m_index.erase(part.m_lru.back().first);
+            part.m_lru.pop_back();
+            ++m_evictions;
+        }
+    }
+    return std::shared_ptr<crypto_engine>(loaded, &loaded->m_engine);
+}
+
+bool engine_cache::erase(const std::string & cipher, const std::string & key_id)
+{
+    std::string key = cache_key(cipher, key_id);
+    shard & part = shard_for(key);
+    std::lock_guard<std::mutex> lock(part.m_mutex);
+    auto found = part.m_index.find(key);
+    if (found == part.m_index.end())
+        return false;
+    part.m_lru.erase(found->second);
+    part.m_index.erase(found);
+    return true;
+}
+
+void engine_cache::clear()
+{
+    for (shard & part : m_shards)
+    {
+        std::lock_guard<std::mutex> lock(part.m_mutex);
+        part.m_index.clear();
+        part.m_lru.clear();
+    }
+}
+
+engine_cache_stats engine_cache::stats() const
+{
+    engine_cache_stats stats;
+    stats.m_hits = m_hits;
+    stats.m_misses = m_misses;
+    stats.m_evictions = m_evictions;
+    for (const shard & part : m_shards)
+    {
+        std::lock_guard<std::mutex> lock(part.m_mutex);
+        stats.m_size += part.m_lru.size();
+    }
+    return stats;
+}
+
+/**
+ * Checks every "<hex digest>  <path>" line of a manifest written with `m_digest` set (or by sha256sum/sha512sum)
+ * against the file on disk, picking SHA-256 or SHA-512 by the digest length. No key is needed. The names of missing
+ * or mismatching files are appended to `failed` when given.
+ */
+bool verify_digest_manifest(const std::string & manifest_filename, std::vector<std::string> * failed = nullptr)
+{
+    std::ifstream manifest(manifest_filename);
+    if (!manifest.is_open())
+        return false;
+
+    bool all_match = true;
+    size_t entries = 0;
+    std::string line;
+    while (std::getline(manifest, line))
+    {
+        if (line.empty())
+            continue;
+        ++entries;
+
+        size_t separator = line.find(' ');
+        // "  " marks text mode and " *" binary mode in sha*sum output, both hash the same bytes on POSIX.
+        std::string expected = line.substr(0, separator);
+        std::string path = separator == std::string::npos || separator + 2 > line.size() ? "" : line.substr(separator + 2);
+        const EVP_MD * md = digest_algorithm(expected.size() == 128 ? digest_kind::sha512
+                                             : expected.size() == 64 ? digest_kind::sha256 : digest_kind::none);
+
+        std::vector<uint8_t> digest;
+        bool match = md != nullptr && !path.empty() && digest_file(path, md, digest) && to_hex(digest.data(), digest.size()) == expected;
+        if (!match)
+        {
+            all_match = false;
+            if (failed)
+                failed->push_back(path.empty() ? line : path);
+        }
+    }
+    return all_match && entries > 0;
+}
+
+incremental_report encrypt_incremental(const std::vector<batch_job> & jobs, const std::string & index_filename, crypto_config & config) {
+    crypto_engine engine(config);
+    return engine.encrypt_incremental(jobs, index_filename);
+}
+
+// Every regular file below `in_dir`, written to the same relative path below `out_dir`.
+std::vector<batch_job> batch_jobs_from_directory(const std::string & in_dir, const std::string & out_dir)
+{
+    namespace fs = std::filesystem;
+    std::vector<batch_job> jobs;
+    std::error_code error;
+    for (fs::recursive_directory_iterator it(in_dir, error), end; !error && it != end; it.increment(error))
+    {
+        if (!it->is_regular_file(error))
+            continue;
+        fs::path output = fs::path(out_dir) / fs::relative(it->path(), in_dir, error);
+        fs::create_directories(output.parent_path(), error);
+        jobs.push_back({it->path().string(), output.string()});
+    }
+    return jobs;
+}
+
+// One input path per line, each written to `out_dir` under its file name.
+std::vector<batch_job> batch_jobs_from_manifest(const std::string & manifest, const std::string & out_dir)
+{
+    namespace fs = std::filesystem;
+    std::vector<batch_job> jobs;
+    std::ifstream file(manifest);
+    std::string line;
+    std::error_code error;
+    fs::create_directories(out_dir, error);
+    while (std::getline(file, line))
+    {
+        if (line.empty())
+            continue;
+        jobs.push_back({line, (fs::path(out_dir) / fs::path(line).filename()).string()});
+    }
+    return jobs;
+}
+
+static bool parse_hex(const std::string & hex, std::unique_ptr<uint8_t[]> & bytes, size_t & length)
+{
+    if (hex.empty() || hex.size() % 2 != 0)
+        return false;
+
+    length = hex.size() / 2;
+    bytes = std::make_unique<uint8_t[]>(length);
+    for (size_t i = 0; i < length; ++i)
+    {
+        unsigned value = 0;
+        if (std::sscanf(hex.c_str() + 2 * i, "%2x", &value) != 1 || !std::isxdigit((unsigned char)hex[2 * i + 1]))
+            return false;
+        bytes[i] = (uint8_t)value;
+    }
+    return true;
+}
+
+// A whole decimal number; trailing characters, signs and overflow make it fail.
+static bool parse_unsigned(const std::string & text, unsigned & value)
+{
+    auto [end, error] = std::from_chars(text.data(), text.data() + text.size(), value);
+    return error == std::errc() && end == text.data() + text.size();
+}
+
+// Key file: the key in hex, followed by the IV in hex (ciphers with an IV), separated by whitespace.
+static bool load_key_file(const std::string & filename, crypto_config & config)
+{
+    std::ifstream file(filename);
+    std::string key, iv;
+    if (!(file >> key) || !parse_hex(key, config.m_key, config.m_key_len))
+        return false;
+    if (file >> iv && !parse_hex(iv, config.m_IV, config.m_IV_len))
+        return false;
+    return true;
+}
+
+static int usage(const char * program)
+{
+    std::cerr << "usage: " << program << "                 run the self tests\n"
+              << "       " << program << " (encrypt|decrypt) --key-file FILE [--cipher NAME] [--threads N]\n"
+              << "              [--digest sha256|sha512] [--index FILE] [--stats] --batch (DIRECTORY|MANIFEST) OUT_DIRECTORY\n"
+              << "       " << program << " (encrypt|decrypt) --key-file FILE [--cipher NAME] [--stats] (INPUT|-) (OUTPUT|-)\n"
+              << "       " << program << " verify DIGEST_MANIFEST...\n";
+    return 2;
+}
+
+static int run_cli(int argc, char * argv[])
+{
+    std::string command = argv[1];
+    if (command == "verify" && argc > 2)
+    {
+        bool verified = true;
+        for (int i = 2; i < argc; ++i)
+        {
+            std::vector<std::string> failed;
+            bool manifest_ok = verify_digest_manifest(argv[i], &failed);
+            for (const std::string & file : failed)
+                std::cout << "FAILED " << file << std::endl;
+            std::cout << (manifest_ok ? "ok     " : "FAILED ") << argv[i] << std::endl;
+            verified = verified && manifest_ok;
+        }
+        return verified ? 0 : 1;
+    }
+    if (command != "encrypt" && command != "decrypt")
+        return usage(argv[0]);
+    bool encrypt = command == "encrypt";
+
+    crypto_config config {"AES-128-CBC", nullptr, nullptr, 0, 0};
+    std::string cipher_name, key_file, batch_source, out_dir, index_file;
+    std::vector<std::string> files;
+    cipher_stats stats;
+    for (int i = 2; i < argc; ++i)
+    {
+        std::string option = argv[i];
+        if (option == "--cipher" && i + 1 < argc)
+            cipher_name = argv[++i];
+        else if (option == "--key-file" && i + 1 < argc)
+            key_file = argv[++i];
+        else if (option == "--threads" && i + 1 < argc)
+        {
+            if (!parse_unsigned(argv[++i], config.m_threads))
+                return usage(argv[0]);
+        }
+        else if (option == "--digest" && i + 1 < argc && (std::string(argv[i + 1]) == "sha256" || std::string(argv[i + 1]) == "sha512"))
+            config.m_digest = std::string(argv[++i]) == "sha256" ? digest_kind::sha256 : digest_kind::sha512;
+        else if (option == "--stats")
+            config.m_stats = &stats;
+        else if (option == "--index" && i + 1 < argc && encrypt)
+            index_file = argv[++i];
+        else if (option == "--batch" && i + 2 < argc)
+        {
+            batch_source = argv[++i];
+            out_dir = argv[++i];
+        }
+        else if (files.size() < 2 && (option == "-" || option[0] != '-'))
+            files.push_back(option);
+        else
+            return usage(argv[0]);
+    }
+
+    if (!cipher_name.empty())
+        config.m_crypto_function = cipher_name.c_str();
+    if (key_file.empty() || batch_source.empty() == files.empty() || (!files.empty() && files.size() != 2))
+        return usage(argv[0]);
+    if (!load_key_file(key_file, config))
+    {
+        std::cerr << "cannot read key file " << key_file << std::endl;
+        return 1;
+    }
+
+    // The engine would replace a missing or short key/IV with random bytes that are never saved; refuse instead.
+    const EVP_CIPHER * cipher = EVP_get_cipherbyname(config.m_crypto_function);
+    if (!cipher)
+    {
+        std::cerr << "unknown cipher " << config.m_crypto_function << std::endl;
+        return 1;
+    }
+    int key_length = EVP_CIPHER_key_length(cipher), iv_length = EVP_CIPHER_iv_length(cipher);
+    if ((int)config.m_key_len != key_length || (iv_length != 0 && (int)config.m_IV_len != iv_length))
+    {
+        std::cerr << "key file " << key_file << " must hold a " << key_length << "-byte key";
+        if (iv_length != 0)
+            std::cerr << " and a " << iv_length << "-byte IV";
+        std::cerr << " for " << config.m_crypto_function << std::endl;
+        return 1;
+    }
+
+    // A single image; "-" streams from stdin or to stdout, so nothing else may be printed there (stats go to stderr).
+    if (!files.empty())
+    {
+        bool success = false;
+        if (files[0] != "-" && files[1] != "-")
+            success = encrypt ? encrypt_data(files[0], files[1], config) : decrypt_data(files[0], files[1], config);
+        else
+        {
+            file_descriptor input(files[0] == "-" ? ::dup(STDIN_FILENO) : ::open(files[0].c_str(), O_RDONLY | O_CLOEXEC));
+            file_descriptor output(files[1] == "-" ? ::dup(STDOUT_FILENO)
+                                                   : ::open(files[1].c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666));
+            success = input.valid() && output.valid() &&
+                      (encrypt ? encrypt_fd(input.get(), output.get(), config) : decrypt_fd(input.get(), output.get(), config)) &&
+                      output.close();
+        }
+        if (!success)
+            std::cerr << (encrypt ? "encryption" : "decryption") << " failed" << std::endl;
+        if (config.m_stats)
+            std::cerr << stats.to_json() << std::endl;
+        return success ? 0 : 1;
+    }
+
+    std::vector<batch_job> jobs = std::filesystem::is_directory(batch_source)
+                                  ? batch_jobs_from_directory(batch_source, out_dir)
+                                  : batch_jobs_from_manifest(batch_source, out_dir);
+    incremental_report report;
+    if (!index_file.empty())
+        report = encrypt_incremental(jobs, index_file, config);
+    else
+        report.m_results = encrypt ? encrypt_batch(jobs, config) : decrypt_batch(jobs, config);
+    const std::vector<batch_result> & results = report.m_results;
+
+    size_t failed = 0;
+    uint64_t bytes = 0;
+    for (const batch_result & result : results)
+    {
+        std::cout << (!result.m_success ? "FAILED " : result.m_skipped ? "skip   " : "ok     ") << result.m_input << " -> " << result.m_output << std::endl;
+        failed += result.m_success ? 0 : 1;
+        bytes += result.m_success ? result.m_size : 0;
+    }
+    std::cout << results.size() << " files, " << failed << " failed, " << bytes - report.m_bytes_saved << " bytes processed";
+    if (!index_file.empty())
+        std::cout << ", " << report.m_skipped << " unchanged files skipped (" << report.m_bytes_saved << " bytes saved)";
+    std::cout << std::endl;
+    if (config.m_stats)
+        std::cerr << stats.to_json() << std::endl;
+    return failed == 0 ? 0 : 1;
+}
+
+static std::vector<uint8_t> read_file(const std::string & filename)
+{
+    std::ifstream file(filename, std::ios::binary);
+    return std::vector<uint8_t>(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+}
+
+/**
+ * Runs `in_filename` through engine.encrypt_fd()/decrypt_fd() and returns the output. With `input_pipe` the file is fed
+ * through a pipe by a second thread in small writes, with `output_pipe` the output is drained from a pipe in small
+ * reads by another one; regular files are used otherwise.
+ */
+static std::vector<uint8_t> cipher_through_pipes(crypto_engine & engine, bool encrypt, const std::string & in_filename,
+                                                 bool input_pipe, bool output_pipe, bool & success)
+{
+    int in_pipe[2] = {-1, -1}, out_pipe[2] = {-1, -1};
+    if ((input_pipe && ::pipe(in_pipe) != 0) || (output_pipe && ::pipe(out_pipe) != 0))
+    {
+        success = false;
+        return {};
+    }
+    file_descriptor input(input_pipe ? in_pipe[0] : ::open(in_filename.c_str(), O_RDONLY | O_CLOEXEC));
+    file_descriptor feed(in_pipe[1]), drain(out_pipe[0]);
+    file_descriptor output(output_pipe ? out_pipe[1] : ::open("testfiles/out_file.TGA", O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666));
+
+    std::thread feeder([&] {
+        std::vector<uint8_t> data = read_file(in_filename);
+        for (size_t offset = 0; input_pipe && offset < data.size(); offset += 1000)
+            if (!write_full(feed.get(), data.data() + offset, std::min<size_t>(1000, data.size() - offset)))
+                break;
+        feed.close();
+    });
+    std::vector<uint8_t> drained;
+    std::thread drainer([&] {
+        uint8_t piece[777];
+        ssize_t res = 0;
+        while (output_pipe && (res = ::read(drain.get(), piece, sizeof(piece))) > 0)
+            drained.insert(drained.end(), piece, piece + res);
+    });
+
+    success = encrypt ? engine.encrypt_fd(input.get(), output.get()) : engine.decrypt_fd(input.get(), output.get());
+    output.close();
+    // Whatever the engine did not consume is read here so that the feeder never blocks.
+    uint8_t rest[4096];
+    while (input_pipe && ::read(input.get(), rest, sizeof(rest)) > 0) {}
+    feeder.join();
+    drainer.join();
+    return output_pipe ? drained : read_file("testfiles/out_file.TGA");
+}
+
+// Index of the first differing byte of `a` and `b`, `length` when they are equal.
+static size_t mismatch_scalar(const uint8_t * a, const uint8_t * b, size_t length)
+{
+    size_t i = 0;
+    for (; i + sizeof(uint64_t) <= length; i += sizeof(uint64_t))
+    {
+        uint64_t x = 0, y = 0;
+        std::memcpy(&x, a + i, sizeof(x));
+        std::memcpy(&y, b + i, sizeof(y));
+        if (x != y)
+            break;
+    }
+    while (i < length && a[i] == b[i])
+        ++i;
+    return i;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("sse2")))
+static size_t mismatch_sse2(const uint8_t * a, const uint8_t * b, size_t length)
+{
+    size_t i = 0;
+    for (; i + 64 <= length; i += 64)
+    {
+        __m128i eq0 = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(a + i)), _mm_loadu_si128((const __m128i*)(b + i)));
+        __m128i eq1 = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(a + i + 16)), _mm_loadu_si128((const __m128i*)(b + i + 16)));
+        __m128i eq2 = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(a + i + 32)), _mm_loadu_si128((const __m128i*)(b + i + 32)));
+        __m128i eq3 = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(a + i + 48)), _mm_loadu_si128((const __m128i*)(b + i + 48)));
+        if (_mm_movemask_epi8(_mm_and_si128(_mm_and_si128(eq0, eq1), _mm_and_si128(eq2, eq3))) != 0xffff)
+            break;
+    }
+    for (; i + 16 <= length; i += 16)
+    {
+        unsigned differing = ~(unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(a + i)),
+                                                                          _mm_loadu_si128((const __m128i*)(b + i)))) & 0xffff;
+        if (differing != 0)
+            return i + (size_t)__builtin_ctz(differing);
+    }
+    return i + mismatch_scalar(a + i, b + i, length - i);
+}
+
+__attribute__((target("avx2")))
+static size_t mismatch_avx2(const uint8_t * a, const uint8_t * b, size_t length)
+{
+    size_t i = 0;
+    for (; i + 128 <= length; i += 128)
+    {
+        __m256i eq0 = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*)(a + i)), _mm256_loadu_si256((const __m256i*)(b + i)));
+        __m256i eq1 = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*)(a + i + 32)), _mm256_loadu_si256((const __m256i*)(b + i + 32)));
+        __m256i eq2 = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*)(a + i + 64)), _mm256_loadu_si256((const __m256i*)(b + i + 64)));
+        __m256i eq3 = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*)(a + i + 96)), _mm256_loadu_si256((const __m256i*)(b + i + 96)));
+        if ((unsigned)_mm256_movemask_epi8(_mm256_and_si256(_mm256_and_si256(eq0, eq1), _mm256_and_si256(eq2, eq3))) != 0xffffffffu)
+            break;
+    }
+    for (; i + 32 <= length; i += 32)
+    {
+        unsigned differing = ~(unsigned)_mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*)(a + i)),
+                                                                                _mm256_loadu_si256((const __m256i*)(b + i))));
+        if (differing != 0)
+            return i + (size_t)__builtin_ctz(differing);
+    }
+    return i + mismatch_sse2(a + i, b + i, length - i);
+}
+#endif
+
+using mismatch_function = size_t (*)(const uint8_t *, const uint8_t *, size_t);
+
+// Widest kernel the running CPU supports, picked once.
+static mismatch_function select_mismatch()
+{
+    static const mismatch_function selected = []
+    {
+#if defined(__x86_64__) || defined(__i386__)
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx2"))
+            return &mismatch_avx2;
+        if (__builtin_cpu_supports("sse2"))
+            return &mismatch_sse2;
+#endif
+        return &mismatch_scalar;
+    }();
+    return selected;
+}
+
+struct file_comparison {
+    bool m_readable = false;            // both files could be opened and read
+    bool m_equal = false;
+    uint64_t m_mismatch_offset = 0;     // first differing byte; the size of the shorter file when it is a prefix of the other
+};
+
+/**
+ * Compares two files and reports where they first differ. Different sizes already make them unequal, the common
+ * prefix is still scanned for the first difference; both files are mapped and scanned with the widest SIMD kernel
+ * available. Files that can not be mapped (pipes, devices, ...) are read in DEFAULT_CHUNK_SIZE pieces instead.
+ */
+static file_comparison compare_file_contents(const std::string & a, const std::string & b)
+{
+    file_comparison result;
+    file_descriptor file_a(::open(a.c_str(), O_RDONLY | O_CLOEXEC));
+    file_descriptor file_b(::open(b.c_str(), O_RDONLY | O_CLOEXEC));
+    struct stat stat_a {}, stat_b {};
+    if (!file_a.valid() || !file_b.valid() || ::fstat(file_a.get(), &stat_a) != 0 || ::fstat(file_b.get(), &stat_b) != 0)
+        return result;
+
+    mismatch_function mismatch = select_mismatch();
+    if (S_ISREG(stat_a.st_mode) && S_ISREG(stat_b.st_mode))
+    {
+        uint64_t size = (uint64_t)std::min(stat_a.st_size, stat_b.st_size);
+        bool same_size = stat_a.st_size == stat_b.st_size;
+        result.m_readable = true;
+        if (size == 0)
+        {
+            result.m_equal = same_size;
+            return result;
+        }
+
+        memory_mapping map_a(file_a.get(), (size_t)size, PROT_READ);
+        memory_mapping map_b(file_b.get(), (size_t)size, PROT_READ);
+        if (map_a.valid() && map_b.valid())
+        {
+            result.m_mismatch_offset = mismatch(map_a.data(), map_b.data(), (size_t)size);
+            result.m_equal = same_size && result.m_mismatch_offset == size;
+            return result;
+        }
+        result.m_readable = false;
+    }
+
+    std::vector<uint8_t> chunk_a(DEFAULT_CHUNK_SIZE), chunk_b(DEFAULT_CHUNK_SIZE);
+    uint64_t offset = 0;
+    while (true)
+    {
+        size_t read_a = 0, read_b = 0;
+        if (!read_full(file_a.get(), chunk_a.data(), chunk_a.size(), read_a) || !read_full(file_b.get(), chunk_b.data(), chunk_b.size(), read_b))
+            return result;
+
+        size_t common = std::min(read_a, read_b);
+        size_t position = mismatch(chunk_a.data(), chunk_b.data(), common);
+        if (position < common || read_a != read_b)
+        {
+            result.m_readable = true;
+            result.m_mismatch_offset = offset + position;
+            return result;
+        }
+        offset += common;
+        if (read_a < chunk_a.size())
+            break;
+    }
+    result.m_readable = true;
+    result.m_equal = true;
+    result.m_mismatch_offset = offset;
+    return result;
+}
+
+// compare_file_contents() over many pairs on `threads` workers (0 = all cores), results in the order of `pairs`.
+static std::vector<file_comparison> compare_file_pairs(const std::vector<std::pair<std::string, std::string>> & pairs, unsigned threads)
+{
+    std::vector<file_comparison> results(pairs.size());
+    if (threads == 0)
+        threads = std::max(1u, std::thread::hardware_concurrency());
+    threads = (unsigned)std::min<size_t>(threads, std::max<size_t>(1, pairs.size()));
+
+    std::atomic<size_t> next_pair {0};
+    run_workers(threads, [&]
+    {
+        for (size_t i = next_pair++; i < pairs.size(); i = next_pair++)
+            results[i] = compare_file_contents(pairs[i].first, pairs[i].second);
+        return true;
+    });
+    return results;
+}
+
+static bool compare_files(const std::string& a, const std::string& b)
+{
+    return compare_file_contents(a, b).m_equal;
+}
+
+#ifdef TGA_BENCHMARK
+static const char * io_mode_name(io_mode mode)
+{
+    switch (mode)
+    {
+        case io_mode::stream:   return "stream";
+        case io_mode::mmap:     return "mmap";
+        case io_mode::pipeline: return "pipeline";
+        case io_mode::uring:    return "uring";
+        case io_mode::direct:   return "direct";
+    }
+    return "unknown";
+}
+
+static bool parse_io_mode(const std::string & name, io_mode & mode)
+{
+    for (io_mode candidate : {io_mode::stream, io_mode::mmap, io_mode::pipeline, io_mode::uring, io_mode::direct})
+        if (name == io_mode_name(candidate))
+        {
+            mode = candidate;
+            return true;
+        }
+    return false;
+}
+
+// Plain bytes or a number with a K, M or G (binary) suffix.
+static bool parse_size(const std::string & text, uint64_t & size)
+{
+    size_t digits = 0;
+    while (digits < text.size() && std::isdigit((unsigned char)text[digits]))
+        ++digits;
+    if (digits == 0 || digits + 1 < text.size() ||
+        std::from_chars(text.data(), text.data() + digits, size).ec != std::errc())
+        return false;
+    if (digits < text.size())
+    {
+        const std::string units = "KMG";
+        size_t unit = units.find((char)std::toupper((unsigned char)text[digits]));
+        if (unit == std::string::npos || size > UINT64_MAX >> 10 * (unit + 1))
+            return false;
+        size <<= 10 * (unit + 1);
+    }
+    return true;
+}
+
+static std::vector<std::string> split_list(const std::string & text)
+{
+    std::vector<std::string> items;
+    std::stringstream stream(text);
+    std::string item;
+    while (std::getline(stream, item, ','))
+        if (!item.empty())
+            items.push_back(item);
+    return items;
+}
+
+struct benchmark_options {
+    std::vector<std::string> m_ciphers {"AES-128-ECB", "AES-192-ECB", "AES-256-ECB", "AES-128-CBC", "AES-192-CBC", "AES-256-CBC",
+                                        "AES-128-CTR", "AES-192-CTR", "AES-256-CTR", "AES-128-GCM", "AES-256-GCM"};
+    std::vector<io_mode> m_io_modes {io_mode::stream, io_mode::mmap, io_mode::pipeline, io_mode::uring, io_mode::direct};
+    std::vector<unsigned> m_threads;
+    std::vector<uint64_t> m_sizes {1024, 64 * 1024, 1024 * 1024, 16 * 1024 * 1024};
+    std::vector<bool> m_cold {false, true};
+    unsigned m_min_iterations = 3;
+    uint64_t m_target_bytes = 16 * 1024 * 1024;     // small files are repeated until this much was processed (at most 1000 times)
+    std::string m_directory;
+    std::string m_output;                           // stdout when empty
+};
+
+static int benchmark_usage(const char * program)
+{
+    std::cerr << "usage: " << program << " [--sizes 1K,64K,1M,16M] [--ciphers AES-128-CBC,...] [--io-modes stream,mmap,...]\n"
+              << "              [--threads 1,8] [--cache warm,cold] [--min-iterations N] [--target-bytes SIZE]\n"
+              << "              [--dir DIRECTORY] [--output FILE.json]\n";
+    return 2;
+}
+
+static bool parse_benchmark_options(int argc, char * argv[], benchmark_options & options)
+{
+    for (int i = 1; i < argc; ++i)
+    {
+        std::string option = argv[i];
+        if (i + 1 >= argc)
+            return false;
+        std::vector<std::string> values = split_list(argv[++i]);
+        if (values.empty())
+            return false;
+
+        if (option == "--sizes")
+        {
+            options.m_sizes.clear();
+            for (const std::string & value : values)
+            {
+                uint64_t size = 0;
+                if (!parse_size(value, size) || size < TGA_HEADER_SIZE)
+                    return false;
+                options.m_sizes.push_back(size);
+            }
+        }
+        else if (option == "--ciphers")
+            options.m_ciphers = values;
+        else if (option == "--io-modes")
+        {
+            options.m_io_modes.clear();
+            for (const std::string & value : values)
+            {
+                io_mode mode = io_mode::stream;
+                if (!parse_io_mode(value, mode))
+                    return false;
+                options.m_io_modes.push_back(mode);
+            }
+        }
+        else if (option == "--threads")
+        {
+            options.m_threads.clear();
+            for (const std::string & value : values)
+            {
+                unsigned threads = 0;
+                if (!parse_unsigned(value, threads))
+                    return false;
+                options.m_threads.push_back(threads);
+            }
+        }
+        else if (option == "--cache")
+        {
+            options.m_cold.clear();
+            for (const std::string & value : values)
+            {
+                if (value != "warm" && value != "cold")
+                    return false;
+                options.m_cold.push_back(value == "cold");
+            }
+        }
+        else if (option == "--min-iterations")
+        {
+            if (!parse_unsigned(values[0], options.m_min_iterations))
+                return false;
+            options.m_min_iterations = std::max(1u, options.m_min_iterations);
+        }
+        else if (option == "--target-bytes")
+        {
+            if (!parse_size(values[0], options.m_target_bytes))
+                return false;
+        }
+        else if (option == "--dir")
+            options.m_directory = argv[i];
+        else if (option == "--output")
+            options.m_output = argv[i];
+        else
+            return false;
+    }
+    return true;
+}
+
+// `size` bytes (header included) of random data, written a chunk at a time so that multi-GB inputs need no memory.
+static bool generate_input(const std::string & filename, uint64_t size)
+{
+    file_descriptor file(::open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666));
+    std::vector<uint8_t> chunk((size_t)std::min<uint64_t>(size, DEFAULT_CHUNK_SIZE));
+    if (!file.valid() || RAND_bytes(chunk.data(), (int)chunk.size()) != 1)
+        return false;
+    for (uint64_t written = 0; written < size; written += chunk.size())
+        if (!write_full(file.get(), chunk.data(), (size_t)std::min<uint64_t>(chunk.size(), size - written)))
+            return false;
+    return file.close();
+}
+
+// Written back and dropped from the page cache, which POSIX_FADV_DONTNEED allows without root for a single file.
+static void drop_cached(const std::string & filename)
+{
+    file_descriptor file(::open(filename.c_str(), O_RDONLY | O_CLOEXEC));
+    if (!file.valid())
+        return;
+    ::fsync(file.get());
+#ifdef POSIX_FADV_DONTNEED
+    ::posix_fadvise(file.get(), 0, 0, POSIX_FADV_DONTNEED);
+#endif
+}
+
+struct benchmark_case {
+    std::string m_cipher;
+    const char * m_io_mode = "stream";
+    unsigned m_threads = 1;
+    bool m_cold = false;
+    bool m_encrypt = true;
+    uint64_t m_size = 0;
+};
+
+/**
+ * Runs `process` (one encryption or decryption of `input`) until `target_bytes` were processed, at least
+ * `min_iterations` and at most 1000 times, after an untimed warm-up run for a warm cache or with `input` dropped
+ * from the page cache before every run for a cold one. Appends the result to `json` as one object.
+ */
+template<typename Process>
+static bool measure_case(const benchmark_case & test, const std::string & input, unsigned min_iterations, uint64_t target_bytes,
+                         Process process, const cipher_stats & stats, std::ostringstream & json)
+{
+    uint64_t iterations = std::clamp<uint64_t>(target_bytes / test.m_size, min_iterations, 1000);
+    std::vector<uint64_t> latencies;
+    bool success = test.m_cold || process();
+    for (uint64_t i = 0; i < iterations && success; ++i)
+    {
+        if (test.m_cold)
+            drop_cached(input);
+        auto start = std::chrono::steady_clock::now();
+        success = process();
+        latencies.push_back(elapsed_ns(start));
+    }
+
+    std::sort(latencies.begin(), latencies.end());
+    uint64_t median = latencies.empty() ? 0 : latencies[latencies.size() / 2];
+    uint64_t mean = latencies.empty() ? 0 : std::accumulate(latencies.begin(), latencies.end(), (uint64_t)0) / latencies.size();
+    double mb_per_s = median == 0 ? 0.0 : (double)test.m_size * 1000.0 / (double)median;
+
+    json << "    {\"cipher\": \"" << test.m_cipher << "\", \"operation\": \"" << (test.m_encrypt ? "encrypt" : "decrypt")
+         << "\", \"io_mode\": \"" << test.m_io_mode << "\", \"threads\": " << test.m_threads
+         << ", \"cache\": \"" << (test.m_cold ? "cold" : "warm") << "\", \"size\": " << test.m_size
+         << ", \"success\": " << (success ? "true" : "false") << ", \"iterations\": " << latencies.size()
+         << ", \"latency_ns\": {\"min\": " << (latencies.empty() ? 0 : latencies.front()) << ", \"median\": " << median
+         << ", \"mean\": " << mean << ", \"max\": " << (latencies.empty() ? 0 : latencies.back()) << "}"
+         << ", \"mb_per_s\": " << std::fixed << std::setprecision(1) << mb_per_s << ", \"stats\": " << stats.to_json() << "}";
+
+    std::cerr << test.m_cipher << ' ' << (test.m_encrypt ? "encrypt" : "decrypt") << ' ' << test.m_io_mode << " threads="
+              << test.m_threads << ' ' << (test.m_cold ? "cold" : "warm") << ' ' << test.m_size << " B: "
+              << std::fixed << std::setprecision(1) << mb_per_s << " MB/s, " << median << " ns per file"
+              << (success ? "" : " FAILED") << std::endl;
+    return success;
+}
+
+/**
+ * Throughput (MB/s of input, from the median run) and per-file latency of encrypt_data()/decrypt_data() over
+ * cipher x I/O mode x thread count x cache state x input size, AEAD ciphers going through encrypt_container()/
+ * decrypt_container() instead. Inputs are generated in the working directory and removed afterwards; the results
+ * are written as JSON to --output or stdout, progress to stderr.
+ */
+static int run_benchmark(int argc, char * argv[])
+{
+    namespace fs = std::filesystem;
+    benchmark_options options;
+    options.m_threads = {1};
+    if (std::thread::hardware_concurrency() > 1)
+        options.m_threads.push_back(std::thread::hardware_concurrency());
+    if (!parse_benchmark_options(argc, argv, options))
+        return benchmark_usage(argv[0]);
+
+    std::error_code error;
+    fs::path directory = options.m_directory.empty() ? fs::temp_directory_path(error) / ("tga-benchmark-" + std::to_string(::getpid()))
+                                                     : fs::path(options.m_directory);
+    bool created = fs::create_directories(directory, error);
+    const std::string plain = (directory / "plain.tga").string();
+    const std::string reference = (directory / "reference.tga").string();
+    const std::string output = (directory / "output.tga").string();
+
+    uint8_t key[32], iv[16];
+    if (RAND_bytes(key, sizeof(key)) != 1 || RAND_bytes(iv, sizeof(iv)) != 1)
+        return 1;
+    auto make_config = [&](const std::string & cipher, cipher_stats & stats)
+    {
+        crypto_config config {cipher.c_str(), std::make_unique<uint8_t[]>(sizeof(key)), std::make_unique<uint8_t[]>(sizeof(iv)), sizeof(key), sizeof(iv)};
+        std::memcpy(config.m_key.get(), key, sizeof(key));
+        std::memcpy(config.m_IV.get(), iv, sizeof(iv));
+        config.m_stats = &stats;
+        return config;
+    };
+
+    std::ostringstream json;
+    json << "{\n  \"benchmark\": \"aes-file-encryption-openssl\",\n  \"timestamp\": "
+         << std::chrono::duration_cast<std::chrono::seconds>(std::chrono::system_clock::now().time_since_epoch()).count()
+         << ",\n  \"openssl\": \"" << OpenSSL_version(OPENSSL_VERSION) << "\",\n  \"compiler\": \"" << __VERSION__
+         << "\",\n  \"hardware_threads\": " << std::thread::hardware_concurrency() << ",\n  \"chunk_size\": " << DEFAULT_CHUNK_SIZE
+         << ",\n  \"results\": [\n";
+
+    size_t failures = 0;
+    bool first = true;
+    for (uint64_t size : options.m_sizes)
+    {
+        if (!generate_input(plain, size))
+        {
+            std::cerr << "cannot write " << plain << std::endl;
+            return 1;
+        }
+        for (const std::string & cipher : options.m_ciphers)
+        {
+            const EVP_CIPHER * evp_cipher = EVP_get_cipherbyname(cipher.c_str());
+            if (evp_cipher == nullptr)
+            {
+                std::cerr << "unknown cipher " << cipher << ", skipped" << std::endl;
+                continue;
+            }
+            bool container = is_container_cipher(evp_cipher);
+            cipher_stats stats;
+            crypto_config reference_config = make_config(cipher, stats);
+            if (!(container ? encrypt_container(plain, reference, reference_config) : encrypt_data(plain, reference, reference_config)))
+            {
+                std::cerr << "cannot encrypt with " << cipher << ", skipped" << std::endl;
+                ++failures;
+                continue;
+            }
+
+            // Containers have a single I/O path of their own.
+            std::vector<io_mode> io_modes = container ? std::vector<io_mode> {io_mode::stream} : options.m_io_modes;
+            for (io_mode mode : io_modes)
+                for (unsigned threads : options.m_threads)
+                    for (bool cold : options.m_cold)
+                        for (bool encrypt : {true, false})
+                        {
+                            crypto_config config = make_config(cipher, stats);
+                            config.m_io_mode = mode;
+                            config.m_threads = threads;
+                            const std::string & input = encrypt ? plain : reference;
+                            auto process = [&]
+                            {
+                                if (container)
+                                    return encrypt ? encrypt_container(input, output, config) : decrypt_container(input, output, config);
+                                return encrypt ? encrypt_data(input, output, config) : decrypt_data(input, output, config);
+                            };
+
+                            benchmark_case test {cipher, container ? "container" : io_mode_name(mode), threads, cold, encrypt, size};
+                            json << (first ? "" : ",\n");
+                            first = false;
+                            if (!measure_case(test, input, options.m_min_iterations, options.m_target_bytes, process, stats, json))
+                                ++failures;
+                        }
+        }
+    }
+    json << "\n  ]\n}\n";
+
+    for (const std::string & file : {plain, reference, output})
+        fs::remove(file, error);
+    if (created)
+        fs::remove(directory, error);
+
+    if (options.m_output.empty())
+        std::cout << json.str();
+    else
+    {
+        std::ofstream file(options.m_output, std::ios::trunc);
+        file << json.str();
+        if (!file)
+        {
+            std::cerr << "cannot write " << options.m_output << std::endl;
+            return 1;
+        }
+    }
+    return failures == 0 ? 0 : 1;
+}
+#endif
+
+int main (int argc, char * argv[])
+{
+#ifdef TGA_BENCHMARK
+    return run_benchmark(argc, argv);
+#endif
+    if (argc > 1)
+        return run_cli(argc, argv);
+
+    crypto_config config {nullptr, nullptr, nullptr, 0, 0};
+
+    // ECB mode
+    config.m_crypto_function = "AES-128-ECB";
+    config.m_key = std::make_unique<uint8_t[]>(16);
+    memset(config.m_key.get(), 0, 16);
+    config.m_key_len = 16;
+
+    assert( encrypt_data  ("testfiles/homer-simpson.TGA", "testfiles/out_file.TGA", config) &&
+            compare_files ("testfiles/out_file.TGA", "testfiles/homer-simpson_enc_ecb.TGA") );
+
+    assert( decrypt_data  ("testfiles/homer-simpson_enc_ecb.TGA", "testfiles/out_file.TGA", config) &&
+            compare_files ("testfiles/out_file.TGA", "testfiles/homer-simpson.TGA") );
+
+    assert( encrypt_data  ("testfiles/UCM8.TGA", "testfiles/out_file.TGA", config) &&
+            compare_files ("testfiles/out_file.TGA", "testfiles/UCM8_enc_ecb.TGA") );
+
+    assert( decrypt_data  ("testfiles/UCM8_enc_ecb.TGA", "testfiles/out_file.TGA", config) &&
+            compare_files ("testfiles/out_file.TGA", "testfiles/UCM8.TGA") );
+
+    assert( encrypt_data  ("testfiles/image_1.TGA", "testfiles/out_file.TGA", config) &&
+            compare_files ("testfiles/out_file.TGA", "testfiles/ref_1_enc_ecb.TGA") );
+
+    assert( encrypt_data  ("testfiles/image_2.TGA", "testfiles/out_file.TGA", config) &&
+            compare_files ("testfiles/out_file.TGA", "testfiles/ref_2_enc_ecb.TGA") );
+
+    assert( decrypt_data ("testfiles/image_3_enc_ecb.TGA", "testfiles/out_file.TGA", config)  &&
+            compare_files("testfiles/out_file.TGA", "testfiles/ref_3_dec_ecb.TGA") );
+
+    assert( decrypt_data ("testfiles/image_4_enc_ecb.TGA", "testfiles/out_file.TGA", config)  &&
+            compare_files("testfiles/out_file.TGA", "testfiles/ref_4_dec_ecb.TGA") );
+
+    // CBC mode
+    config.m_crypto_function = "AES-128-CBC";
+    config.m_IV = std::make_unique<uint8_t[]>(16);
+    config.m_IV_len = 16;
+    memset(config.m_IV.get(), 0, 16);
+
+    assert( encrypt_data  ("testfiles/UCM8.TGA", "testfiles/out_file.TGA", config) &&
+            compare_files ("testfiles/out_file.TGA", "testfiles/UCM8_enc_cbc.TGA") );
+
+    assert( decrypt_data  ("testfiles/UCM8_enc_cbc.TGA", "testfiles/out_file.TGA", config) &&
+            compare_files ("testfiles/out_file.TGA", "testfiles/UCM8.TGA") );
+
+    assert( encrypt_data  ("testfiles/homer-simpson.TGA", "testfiles/out_file.TGA", config) &&
+            compare_files ("testfiles/out_file.TGA", "testfiles/homer-simpson_enc_cbc.TGA") );
+
+    assert( decrypt_data  ("testfiles/homer-simpson_enc_cbc.TGA", "testfiles/out_file.TGA", config) &&
+            compare_files ("testfiles/out_file.TGA", "testfiles/homer-simpson.TGA") );
+
+    assert( encrypt_data  ("testfiles/image_1.TGA", "testfiles/out_file.TGA", config) &&
+            compare_files ("testfiles/out_file.TGA", "testfiles/ref_5_enc_cbc.TGA") );
+
+    assert( encrypt_data  ("testfiles/image_2.TGA", "testfiles/out_file.TGA", config) &&
+            compare_files ("testfiles/out_file.TGA", "testfiles/ref_6_enc_cbc.TGA") );
+
+    assert( decrypt_data ("testfiles/image_7_enc_cbc.TGA", "testfiles/out_file.TGA", config)  &&
+            compare_files("testfiles/out_file.TGA", "testfiles/ref_7_dec_cbc.TGA") );
+
+    assert( decrypt_data ("testfiles/image_8_enc_cbc.TGA", "testfiles/out_file.TGA", config)  &&
+            compare_files("testfiles/out_file.TGA", "testfiles/ref_8_dec_cbc.TGA") );
+
+    // Chunk size must not change the output
+    for (size_t chunk_size : {MIN_CHUNK_SIZE, MAX_CHUNK_SIZE, (size_t)1})
+    {
+        config.m_chunk_size = chunk_size;
+
+        config.m_crypto_function = "AES-128-ECB";
+        assert( encrypt_data  ("testfiles/homer-simpson.TGA", "testfiles/out_file.TGA", config) &&
+                compare_files ("testfiles/out_file.TGA", "testfiles/homer-simpson_enc_ecb.TGA") );
+
+        assert( decrypt_data  ("testfiles/homer-simpson_enc_ecb.TGA", "testfiles/out_file.TGA", config) &&
+                compare_files ("testfiles/out_file.TGA", "testfiles/homer-simpson.TGA") );
+
+        config.m_crypto_function = "AES-128-CBC";
+        assert( encrypt_data  ("testfiles/homer-simpson.TGA", "testfiles/out_file.TGA", config) &&
+                compare_files ("testfiles/out_file.TGA", "testfiles/homer-simpson_enc_cbc.TGA") );
+
+        assert( decrypt_data  ("testfiles/homer-simpson_enc_cbc.TGA", "testfiles/out_file.TGA", config) &&
+                compare_files ("testfiles/out_file.TGA", "testfiles/homer-simpson.TGA") );
+    }
+    config.m_chunk_size = DEFAULT_CHUNK_SIZE;
+
+    // Memory-mapped mode
+    config.m_io_mode = io_mode::mmap;
+
+    config.m_crypto_function = "AES-128-ECB";
+    assert( encrypt_data  ("testfiles/homer-simpson.TGA", "testfiles/out_file.TGA", config) &&
+            compare_files ("testfiles/out_file.TGA", "testfiles/homer-simpson_enc_ecb.TGA") );
+
+    assert( decrypt_data ("testfiles/image_4_enc_ecb.TGA", "testfiles/out_file.TGA", config)  &&
+            compare_files("testfiles/out_file.TGA", "testfiles/ref_4_dec_ecb.TGA") );
+
+    config.m_crypto_function = "AES-128-CBC";
+    assert( encrypt_data  ("testfiles/image_2.TGA", "testfiles/out_file.TGA", config) &&
+            compare_files ("testfiles/out_file.TGA", "testfiles/ref_6_enc_cbc.TGA") );
+
+    assert( decrypt_data  ("testfiles/homer-simpson_enc_cbc.TGA", "testfiles/out_file.TGA", config) &&
+            compare_files ("testfiles/out_file.TGA", "testfiles/homer-simpson.TGA") );
+
+    assert( decrypt_data ("testfiles/image_8_enc_cbc.TGA", "testfiles/out_file.TGA", config)  &&
+            compare_files("testfiles/out_file.TGA", "testfiles/ref_8_dec_cbc.TGA") );
+
+    // Non-regular output falls back to the streaming path
+    assert( encrypt_data  ("testfiles/UCM8.TGA", "/dev/null", config) );
+
+    config.m_io_mode = io_mode::stream;
+
+    // Segmented ECB on several threads
+    config.m_crypto_function = "AES-128-ECB";
+    config.m_threads = 4;
+    config.m_chunk_size = MIN_CHUNK_SIZE;
+
+    assert( encrypt_data  ("testfiles/homer-simpson.TGA", "testfiles/out_file.TGA", config) &&
+            compare_files ("testfiles/out_file.TGA", "testfiles/homer-simpson_enc_ecb.TGA") );
+
+    assert( decrypt_data  ("testfiles/homer-simpson_enc_ecb.TGA", "testfiles/out_file.TGA", config) &&
+            compare_files ("testfiles/out_file.TGA", "testfiles/homer-simpson.TGA") );
+
+    assert( encrypt_data  ("testfiles/image_2.TGA", "testfiles/out_file.TGA", config) &&
+            compare_files ("testfiles/out_file.TGA", "testfiles/ref_2_enc_ecb.TGA") );
+
+    assert( decrypt_data ("testfiles/image_3_enc_ecb.TGA", "testfiles/out_file.TGA", config)  &&
+            compare_files("testfiles/out_file.TGA", "testfiles/ref_3_dec_ecb.TGA") );
+
+    // Segmented CTR must match the single-threaded result, including a counter that carries into the upper bytes
+    config.m_crypto_function = "AES-128-CTR";
+    memset(config.m_IV.get(), 0xFF, 16);
+    config.m_IV[0] = 0x00;
+
+    config.m_threads = 1;
+    assert( encrypt_data  ("testfiles/homer-simpson.TGA", "testfiles/out_file_ref.TGA", config) );
+
+    config.m_threads = 4;
+    assert( encrypt_data  ("testfiles/homer-simpson.TGA", "testfiles/out_file.TGA", config) &&
+            compare_files ("testfiles/out_file.TGA", "testfiles/out_file_ref.TGA") );
+
+    assert( decrypt_data  ("testfiles/out_file_ref.TGA", "testfiles/out_file.TGA", config) &&
+            compare_files ("testfiles/out_file.TGA", "testfiles/homer-simpson.TGA") );
+
+    memset(config.m_IV.get(), 0, 16);
+
+    // Parallel CBC decryption, encryption stays serial
+    config.m_crypto_function = "AES-128-CBC";
+
+    assert( decrypt_data  ("testfiles/homer-simpson_enc_cbc.TGA", "testfiles/out_file.TGA", config) &&
+            compare_files ("testfiles/out_file.TGA", "testfiles/homer-simpson.TGA") );
+
+    assert( decrypt_data  ("testfiles/UCM8_enc_cbc.TGA", "testfiles/out_file.TGA", config) &&
+            compare_files ("testfiles/out_file.TGA", "testfiles/UCM8.TGA") );
+
+    assert( decrypt_data ("testfiles/image_7_enc_cbc.TGA", "testfiles/out_file.TGA", config)  &&
+            compare_files("testfiles/out_file.TGA", "testfiles/ref_7_dec_cbc.TGA") );
+
+    assert( decrypt_data ("testfiles/image_8_enc_cbc.TGA", "testfiles/out_file.TGA", config)  &&
+            compare_files("testfiles/out_file.TGA", "testfiles/ref_8_dec_cbc.TGA") );
+
+    assert( !decrypt_data ("testfiles/homer-simpson.TGA", "testfiles/out_file.TGA", config) );
+
+    assert( encrypt_data  ("testfiles/homer-simpson.TGA", "testfiles/out_file.TGA", config) &&
+            compare_files ("testfiles/out_file.TGA", "testfiles/homer-simpson_enc_cbc.TGA") );
+
+    config.m_threads = 1;
+
+    // Pipelined reader / cipher / writer
+    pipeline_stats stats;
+    config.m_io_mode = io_mode::pipeline;
+    config.m_pipeline_stats = &stats;
+
+    assert( encrypt_data  ("testfiles/homer-simpson.TGA", "testfiles/out_file.TGA", config) &&
+            compare_files ("testfiles/out_file.TGA", "testfiles/homer-simpson_enc_cbc.TGA") );
+    assert( stats.m_chunks == 36 );
+
+    assert( decrypt_data  ("testfiles/homer-simpson_enc_cbc.TGA", "testfiles/out_file.TGA", config) &&
+            compare_files ("testfiles/out_file.TGA", "testfiles/homer-simpson.TGA") );
+
+    assert( encrypt_data  ("testfiles/image_1.TGA", "testfiles/out_file.TGA", config) &&
+            compare_files ("testfiles/out_file.TGA", "testfiles/ref_5_enc_cbc.TGA") );
+    assert( stats.m_chunks == 1 );
+
+    assert( decrypt_data ("testfiles/image_7_enc_cbc.TGA", "testfiles/out_file.TGA", config)  &&
+            compare_files("testfiles/out_file.TGA", "testfiles/ref_7_dec_cbc.TGA") );
+
+    assert( !decrypt_data ("testfiles/homer-simpson.TGA", "testfiles/out_file.TGA", config) );
+
+    config.m_pipeline_depth = 2;
+    config.m_crypto_function = "AES-128-ECB";
+    assert( decrypt_data  ("testfiles/UCM8_enc_ecb.TGA", "testfiles/out_file.TGA", config) &&
+            compare_files ("testfiles/out_file.TGA", "testfiles/UCM8.TGA") );
+
+    config.m_pipeline_depth = DEFAULT_PIPELINE_DEPTH;
+    config.m_pipeline_stats = nullptr;
+
+    // io_uring, or the streaming fallback where it is not available
+    config.m_io_mode = io_mode::uring;
+
+    assert( decrypt_data  ("testfiles/homer-simpson_enc_ecb.TGA", "testfiles/out_file.TGA", config) &&
+            compare_files ("testfiles/out_file.TGA", "testfiles/homer-simpson.TGA") );
+
+    assert( encrypt_data  ("testfiles/UCM8.TGA", "testfiles/out_file.TGA", config) &&
+            compare_files ("testfiles/out_file.TGA", "testfiles/UCM8_enc_ecb.TGA") );
+
+    config.m_crypto_function = "AES-128-CBC";
+    assert( encrypt_data  ("testfiles/homer-simpson.TGA", "testfiles/out_file.TGA", config) &&
+            compare_files ("testfiles/out_file.TGA", "testfiles/homer-simpson_enc_cbc.TGA") );
+
+    assert( decrypt_data  ("testfiles/homer-simpson_enc_cbc.TGA", "testfiles/out_file.TGA", config) &&
+            compare_files ("testfiles/out_file.TGA", "testfiles/homer-simpson.TGA") );
+
+    assert( encrypt_data  ("testfiles/image_2.TGA", "testfiles/out_file.TGA", config) &&
+            compare_files ("testfiles/out_file.TGA", "testfiles/ref_6_enc_cbc.TGA") );
+
+    assert( decrypt_data ("testfiles/image_8_enc_cbc.TGA", "testfiles/out_file.TGA", config)  &&
+            compare_files("testfiles/out_file.TGA", "testfiles/ref_8_dec_cbc.TGA") );
+
+    assert( !decrypt_data ("testfiles/homer-simpson.TGA", "testfiles/out_file.TGA", config) );
+
+    // O_DIRECT through aligned buffers, or the streaming fallback where the file system refuses it
+    config.m_io_mode = io_mode::direct;
+    config.m_crypto_function = "AES-128-ECB";
+
+    assert( encrypt_data  ("testfiles/homer-simpson.TGA", "testfiles/out_file.TGA", config) &&
+            compare_files ("testfiles/out_file.TGA", "testfiles/homer-simpson_enc_ecb.TGA") );
+
+    assert( decrypt_data  ("testfiles/homer-simpson_enc_ecb.TGA", "testfiles/out_file.TGA", config) &&
+            compare_files ("testfiles/out_file.TGA", "testfiles/homer-simpson.TGA") );
+
+    assert( encrypt_data  ("testfiles/image_1.TGA", "testfiles/out_file.TGA", config) &&
+            compare_files ("testfiles/out_file.TGA", "testfiles/ref_1_enc_ecb.TGA") );
+
+    assert( encrypt_data  ("testfiles/image_1.TGA", "/dev/null", config) );
+
+    config.m_crypto_function = "AES-128-CBC";
+    config.m_chunk_size = DEFAULT_CHUNK_SIZE;
+    assert( encrypt_data  ("testfiles/homer-simpson.TGA", "testfiles/out_file.TGA", config) &&
+            compare_files ("testfiles/out_file.TGA", "testfiles/homer-simpson_enc_cbc.TGA") );
+
+    assert( decrypt_data  ("testfiles/UCM8_enc_cbc.TGA", "testfiles/out_file.TGA", config) &&
+            compare_files ("testfiles/out_file.TGA", "testfiles/UCM8.TGA") );
+
+    assert( decrypt_data ("testfiles/image_8_enc_cbc.TGA", "testfiles/out_file.TGA", config)  &&
+            compare_files("testfiles/out_file.TGA", "testfiles/ref_8_dec_cbc.TGA") );
+
+    assert( !decrypt_data ("testfiles/homer-simpson.TGA", "testfiles/out_file.TGA", config) );
+
+    config.m_io_mode = io_mode::stream;
+    config.m_chunk_size = DEFAULT_CHUNK_SIZE;
+
+    // Arbitrary descriptors: pipes on either or both sides, written and read in small pieces
+    {
+        config.m_crypto_function = "AES-128-ECB";
+        config.m_chunk_size = MIN_CHUNK_SIZE;
+        crypto_engine ecb(config);
+        config.m_crypto_function = "AES-128-CBC";
+        crypto_engine cbc(config, false);
+        bool success = false;
+
+        assert( cipher_through_pipes(ecb, true, "testfiles/homer-simpson.TGA", true, false, success) ==
+                read_file("testfiles/homer-simpson_enc_ecb.TGA") && success );
+        assert( cipher_through_pipes(ecb, true, "testfiles/homer-simpson.TGA", false, true, success) ==
+                read_file("testfiles/homer-simpson_enc_ecb.TGA") && success );
+        assert( cipher_through_pipes(ecb, false, "testfiles/homer-simpson_enc_ecb.TGA", true, true, success) ==
+                read_file("testfiles/homer-simpson.TGA") && success );
+        assert( cipher_through_pipes(ecb, true, "testfiles/image_1.TGA", true, true, success) ==
+                read_file("testfiles/ref_1_enc_ecb.TGA") && success );
+        assert( cipher_through_pipes(cbc, false, "testfiles/homer-simpson_enc_cbc.TGA", true, true, success) ==
+                read_file("testfiles/homer-simpson.TGA") && success );
+        assert( cipher_through_pipes(cbc, false, "testfiles/UCM8_enc_cbc.TGA", false, true, success) ==
+                read_file("testfiles/UCM8.TGA") && success );
+
+        cipher_through_pipes(cbc, false, "testfiles/homer-simpson.TGA", true, true, success);
+        assert( !success );
+        // Shorter than the TGA header
+        std::ofstream("testfiles/out_short.TGA", std::ios::binary).write("TGA header", 10);
+        cipher_through_pipes(ecb, true, "testfiles/out_short.TGA", true, true, success);
+        assert( !success );
+        cipher_through_pipes(ecb, true, "testfiles/out_short.TGA", false, true, success);
+        assert( !success );
+        assert( !ecb.encrypt_fd(-1, -1) );
+
+        config.m_chunk_size = DEFAULT_CHUNK_SIZE;
+    }
+
+    // RLE stage: uncompressed images shrink before encryption and come back byte for byte
+    {
+        config.m_tga_rle = true;
+        config.m_crypto_function = "AES-128-ECB";
+        auto image_type = [](const std::string & filename) { std::vector<uint8_t> data = read_file(filename); return std::make_pair(data[2], data[17]); };
+
+        assert( encrypt_data  ("testfiles/homer-simpson.TGA", "testfiles/out_file_rle.TGA", config) );
+        assert( image_type("testfiles/out_file_rle.TGA") == std::make_pair((uint8_t)10, (uint8_t)(0x00 | TGA_RLE_STAGE_MARK)) );
+        assert( std::filesystem::file_size("testfiles/out_file_rle.TGA") * 2 < std::filesystem::file_size("testfiles/homer-simpson.TGA") );
+        assert( decrypt_data  ("testfiles/out_file_rle.TGA", "testfiles/out_file.TGA", config) &&
+                compare_files ("testfiles/out_file.TGA", "testfiles/homer-simpson.TGA") );
+
+        // Image ID, color map and the footer after the pixels pass through
+        config.m_crypto_function = "AES-128-CBC";
+        assert( encrypt_data  ("testfiles/UCM8.TGA", "testfiles/out_file_rle.TGA", config) );
+        assert( image_type("testfiles/out_file_rle.TGA").first == 9 );
+        assert( decrypt_data  ("testfiles/out_file_rle.TGA", "testfiles/out_file.TGA", config) &&
+                compare_files ("testfiles/out_file.TGA", "testfiles/UCM8.TGA") );
+
+        // Every pixel depth, runs longer than a packet and crossing scan lines, literals longer than a packet
+        uint32_t state = 12345;
+        auto next = [&state] { state = state * 1103515245u + 12345u; return state >> 8; };
+        for (uint8_t depth : {8, 15, 24, 32})
+        {
+            size_t pixel_size = (depth + 7) / 8;
+            uint16_t width = 300, height = 7;
+            std::vector<uint8_t> image = {3, 0, (uint8_t)(depth == 8 ? 3 : 2), 0, 0, 0, 0, 0, 0, 0, 0, 0,
+                                          (uint8_t)width, (uint8_t)(width >> 8), (uint8_t)height, 0, depth, 0x20, 'I', 'D', '!'};
+            while (image.size() < 21 + (size_t)width * height * pixel_size)
+            {
+                size_t run = next() % 3 == 0 ? next() % 400 + 1 : 1;
+                uint32_t pixel = next() % 4;
+                for (size_t i = 0; i < run * pixel_size && image.size() < 21 + (size_t)width * height * pixel_size; ++i)
+                    image.push_back((uint8_t)(pixel * 0x55 + i % pixel_size));
+            }
+            image.insert(image.end(), {'T', 'R', 'U', 'E', 'V', 'I', 'S', 'I', 'O', 'N'});
+            std::ofstream("testfiles/out_image.TGA", std::ios::binary).write((const char*)image.data(), (std::streamsize)image.size());
+
+            assert( encrypt_data  ("testfiles/out_image.TGA", "testfiles/out_file_rle.TGA", config) );
+            assert( image_type("testfiles/out_file_rle.TGA").first == image[2] + 8 );
+            assert( decrypt_data  ("testfiles/out_file_rle.TGA", "testfiles/out_file.TGA", config) &&
+                    compare_files ("testfiles/out_file.TGA", "testfiles/out_image.TGA") );
+        }
+
+        // Marked packets running past the image are rejected
+        std::vector<uint8_t> broken = {0, 0, 10, 0, 0, 0, 0, 0, 0, 0, 0, 0, 2, 0, 1, 0, 24, TGA_RLE_STAGE_MARK, 0xff, 1, 2, 3};
+        std::ofstream("testfiles/out_image.TGA", std::ios::binary).write((const char*)broken.data(), (std::streamsize)broken.size());
+        config.m_tga_rle = false;
+        assert( encrypt_data  ("testfiles/out_image.TGA", "testfiles/out_file_rle.TGA", config) );
+        config.m_tga_rle = true;
+        assert( !decrypt_data ("testfiles/out_file_rle.TGA", "testfiles/out_file.TGA", config) );
+
+        // A genuine RLE image carrying the mark would be mistaken for a staged one, the stage refuses to encrypt it
+        std::vector<uint8_t> marked = {0, 0, 10, 0, 0, 0, 0, 0, 0, 0, 0, 0, 2, 0, 1, 0, 24, TGA_RLE_STAGE_MARK, 0x81, 1, 2, 3};
+        std::ofstream("testfiles/out_image.TGA", std::ios::binary).write((const char*)marked.data(), (std::streamsize)marked.size());
+        assert( !encrypt_data ("testfiles/out_image.TGA", "testfiles/out_file_rle.TGA", config) );
+        config.m_tga_rle = false;
+        assert( encrypt_data  ("testfiles/out_image.TGA", "testfiles/out_file_rle.TGA", config) );
+        assert( decrypt_data  ("testfiles/out_file_rle.TGA", "testfiles/out_file.TGA", config) &&
+                compare_files ("testfiles/out_file.TGA", "testfiles/out_image.TGA") );
+        config.m_tga_rle = true;
+
+        // Truncated images, unmarked ciphertexts and pipes of unknown length take the plain path
+        config.m_crypto_function = "AES-128-ECB";
+        assert( encrypt_data  ("testfiles/image_1.TGA", "testfiles/out_file.TGA", config) &&
+                compare_files ("testfiles/out_file.TGA", "testfiles/ref_1_enc_ecb.TGA") );
+        assert( decrypt_data  ("testfiles/homer-simpson_enc_ecb.TGA", "testfiles/out_file.TGA", config) &&
+                compare_files ("testfiles/out_file.TGA", "testfiles/homer-simpson.TGA") );
+
+        crypto_engine engine(config);
+        bool success = false;
+        assert( cipher_through_pipes(engine, true, "testfiles/homer-simpson.TGA", true, true, success) ==
+                read_file("testfiles/homer-simpson_enc_ecb.TGA") && success );
+        assert( engine.encrypt_file("testfiles/homer-simpson.TGA", "testfiles/out_file_rle.TGA") );
+        assert( cipher_through_pipes(engine, false, "testfiles/out_file_rle.TGA", true, true, success) ==
+                read_file("testfiles/homer-simpson.TGA") && success );
+
+        config.m_tga_rle = false;
+    }
+
+    // Per-call stats of the streaming loops, summed over batches
+#if TGA_CIPHER_STATS
+    {
+        cipher_stats stats;
+        config.m_stats = &stats;
+        config.m_crypto_function = "AES-128-ECB";
+        uint64_t image_size = std::filesystem::file_size("testfiles/homer-simpson.TGA");
+        uint64_t encrypted_size = std::filesystem::file_size("testfiles/homer-simpson_enc_ecb.TGA");
+
+        assert( encrypt_data  ("testfiles/homer-simpson.TGA", "testfiles/out_file.TGA", config) &&
+                compare_files ("testfiles/out_file.TGA", "testfiles/homer-simpson_enc_ecb.TGA") );
+        assert( stats.m_files == 1 && stats.m_chunks == 3 );
+        assert( stats.m_bytes_read == image_size && stats.m_bytes_written == encrypted_size );
+        // Header, three chunks and the EOF read; header, three chunks and the final block.
+        assert( stats.m_read_calls == 5 && stats.m_write_calls == 5 );
+        assert( stats.m_open_ns > 0 && stats.m_cipher_ns > 0 && stats.m_final_ns > 0 );
+        assert( stats.m_total_ns >= stats.m_open_ns + stats.m_init_ns + stats.m_read_ns + stats.m_cipher_ns + stats.m_write_ns + stats.m_final_ns );
+
+        assert( !decrypt_data ("testfiles/homer-simpson.TGA", "testfiles/out_file.TGA", config) );
+        assert( stats.m_files == 0 && stats.m_bytes_read == image_size && stats.m_bytes_written < image_size );
+
+        std::vector<batch_job> jobs = {{"testfiles/homer-simpson.TGA", "testfiles/out_file.TGA"},
+                                       {"testfiles/UCM8.TGA", "testfiles/out_file_ucm8.TGA"}};
+        std::vector<batch_result> results = encrypt_batch(jobs, config);
+        assert( results[0].m_success && results[1].m_success );
+        assert( results[0].m_stats.m_files == 1 && results[0].m_stats.m_bytes_read == image_size );
+        assert( stats.m_files == 2 && stats.m_bytes_read == image_size + std::filesystem::file_size("testfiles/UCM8.TGA") );
+        assert( stats.to_json().find("\"files\": 2}") != std::string::npos );
+
+        crypto_engine engine(config);
+        bool success = false;
+        cipher_through_pipes(engine, true, "testfiles/homer-simpson.TGA", true, true, success);
+        assert( success && stats.m_files == 1 && stats.m_bytes_written == encrypted_size && stats.m_chunks > 0 );
+        config.m_stats = nullptr;
+    }
+#endif
+    {
+        cipher_stats untouched;
+        stats_recorder<false> disabled(&untouched);
+        disabled.start();
+        disabled.stop(&cipher_stats::m_read_ns);
+        disabled.count(&cipher_stats::m_chunks);
+        assert( disabled.calls(&cipher_stats::m_read_calls) == nullptr && untouched.m_read_ns == 0 && untouched.m_chunks == 0 );
+    }
+
+    // One engine reused across files, directions and I/O modes
+    {
+        config.m_crypto_function = "AES-128-CBC";
+        crypto_engine engine(config);
+        assert( engine.valid() );
+
+        for (int round = 0; round < 2; ++round)
+        {
+            assert( engine.encrypt_file ("testfiles/UCM8.TGA", "testfiles/out_file.TGA") &&
+                    compare_files       ("testfiles/out_file.TGA", "testfiles/UCM8_enc_cbc.TGA") );
+
+            assert( engine.decrypt_file ("testfiles/image_8_enc_cbc.TGA", "testfiles/out_file.TGA") &&
+                    compare_files       ("testfiles/out_file.TGA", "testfiles/ref_8_dec_cbc.TGA") );
+
+            assert( !engine.decrypt_file("testfiles/image_2.TGA", "testfiles/out_file.TGA") );
+
+            assert( engine.encrypt_file ("testfiles/image_1.TGA", "testfiles/out_file.TGA") &&
+                    compare_files       ("testfiles/out_file.TGA", "testfiles/ref_5_enc_cbc.TGA") );
+
+            config.m_threads = 4;
+            config.m_chunk_size = MIN_CHUNK_SIZE;
+            assert( engine.decrypt_file ("testfiles/homer-simpson_enc_cbc.TGA", "testfiles/out_file.TGA") &&
+                    compare_files       ("testfiles/out_file.TGA", "testfiles/homer-simpson.TGA") );
+            config.m_threads = 1;
+            config.m_chunk_size = DEFAULT_CHUNK_SIZE;
+        }
+
+        // Key material is captured at construction
+        config.m_key[0] = 0x42;
+        assert( engine.encrypt_file ("testfiles/image_2.TGA", "testfiles/out_file.TGA") &&
+                compare_files       ("testfiles/out_file.TGA", "testfiles/ref_6_enc_cbc.TGA") );
+        config.m_key[0] = 0x00;
+    }
+
+    {
+        crypto_config missing_key {"AES-128-CBC", nullptr, nullptr, 0, 0};
+        assert( !crypto_engine(missing_key, false).valid() );
+        assert( !decrypt_data ("testfiles/UCM8_enc_cbc.TGA", "testfiles/out_file.TGA", missing_key) );
+
+        crypto_config unknown_cipher {"AES-128-XYZ", nullptr, nullptr, 0, 0};
+        assert( !crypto_engine(unknown_cipher).valid() );
+    }
+
+    // Engine cache: one key per tenant, looked up by key ID
+    {
+        std::atomic<int> loads {0};
+        auto loader = [&loads](const std::string & key_id, crypto_config & tenant) {
+            if (key_id.rfind("tenant-", 0) != 0)
+                return false;
+            ++loads;
+            tenant.m_key = std::make_unique<uint8_t[]>(16);
+            tenant.m_IV = std::make_unique<uint8_t[]>(16);
+            tenant.m_key_len = tenant.m_IV_len = 16;
+            std::memset(tenant.m_key.get(), 0, 16);
+            std::memset(tenant.m_IV.get(), 0, 16);
+            tenant.m_key[0] = (uint8_t)std::stoi(key_id.substr(7));
+            return true;
+        };
+        engine_cache cache(2, loader, 1);
+
+        std::shared_ptr<crypto_engine> first = cache.get("AES-128-CBC", "tenant-0");
+        assert( first && first.get() == cache.get("AES-128-CBC", "tenant-0").get() && loads == 1 );
+        assert( first->encrypt_file ("testfiles/UCM8.TGA", "testfiles/out_file.TGA") &&
+                compare_files       ("testfiles/out_file.TGA", "testfiles/UCM8_enc_cbc.TGA") );
+
+        // Same key ID under another cipher is another engine
+        std::shared_ptr<crypto_engine> ecb = cache.get("AES-128-ECB", "tenant-0");
+        assert( ecb && ecb != first && loads == 2 );
+        assert( ecb->encrypt_file ("testfiles/UCM8.TGA", "testfiles/out_file.TGA") &&
+                compare_files     ("testfiles/out_file.TGA", "testfiles/UCM8_enc_ecb.TGA") );
+
+        // tenant-0/CBC is the least recently used and goes, but stays usable while held
+        std::shared_ptr<crypto_engine> other = cache.get("AES-128-CBC", "tenant-5");
+        assert( other && loads == 3 );
+        assert( other->encrypt_file ("testfiles/UCM8.TGA", "testfiles/out_file.TGA") &&
+                !compare_files      ("testfiles/out_file.TGA", "testfiles/UCM8_enc_cbc.TGA") &&
+                other->decrypt_file ("testfiles/out_file.TGA", "testfiles/out_image.TGA") &&
+                compare_files       ("testfiles/out_image.TGA", "testfiles/UCM8.TGA") );
+        assert( first->decrypt_file ("testfiles/UCM8_enc_cbc.TGA", "testfiles/out_file.TGA") &&
+                compare_files       ("testfiles/out_file.TGA", "testfiles/UCM8.TGA") );
+        assert( cache.get("AES-128-CBC", "tenant-0") != first && loads == 4 );
+
+        assert( cache.get("AES-128-CBC", "unknown") == nullptr );
+        assert( cache.get("AES-128-XYZ", "tenant-1") == nullptr );
+
+        engine_cache_stats stats = cache.stats();
+        assert( stats.m_hits == 1 && stats.m_misses == 6 && stats.m_evictions == 2 && stats.m_size == 2 );
+        assert( cache.erase("AES-128-CBC", "tenant-0") && !cache.erase("AES-128-CBC", "tenant-0") );
+        cache.clear();
+        assert( cache.stats().m_size == 0 );
+
+        // Concurrent lookups over several shards, with more tenants than fit
+        engine_cache shared(8, loader, 4);
+        std::atomic<bool> all_valid {true};
+        std::vector<std::thread> workers;
+        for (int thread = 0; thread < 4; ++thread)
+            workers.emplace_back([&shared, &all_valid, thread] {
+                for (int i = 0; i < 200; ++i)
+                {
+                    std::shared_ptr<crypto_engine> engine = shared.get("AES-128-CTR", "tenant-" + std::to_string((i * 7 + thread) % 12));
+                    all_valid = all_valid && engine && engine->acquire(true);
+                }
+            });
+        for (std::thread & worker : workers)
+            worker.join();
+        stats = shared.stats();
+        // A miss that lost the race against another thread's load of the same key inserts nothing
+        assert( all_valid && stats.m_hits + stats.m_misses == 800 && stats.m_size <= 8 && stats.m_evictions > 0 &&
+                stats.m_size + stats.m_evictions <= stats.m_misses );
+    }
+
+    // In-memory buffers
+    {
+        config.m_crypto_function = "AES-128-CBC";
+        crypto_engine engine(config);
+
+        std::vector<uint8_t> plain = read_file("testfiles/homer-simpson.TGA");
+        std::vector<uint8_t> encrypted = read_file("testfiles/homer-simpson_enc_cbc.TGA");
+        std::vector<uint8_t> out;
+        size_t out_size = 0;
+
+        assert( !engine.encrypt_buffer(plain, out, out_size) && out_size == encrypted.size() );
+        assert( engine.output_size(plain.size(), true) == encrypted.size() );
+        assert( engine.output_size(encrypted.size(), false) == encrypted.size() );
+
+        out.resize(out_size);
+        assert( engine.encrypt_buffer(plain, out, out_size) && out == encrypted );
+        assert( engine.decrypt_buffer(encrypted, out, out_size) && out_size == plain.size() &&
+                std::equal(plain.begin(), plain.end(), out.begin()) );
+
+        // In place, the buffer only has to leave room for the padding
+        std::vector<uint8_t> in_place = plain;
+        in_place.resize(encrypted.size());
+        assert( engine.encrypt_buffer(std::span(in_place).first(plain.size()), in_place, out_size) && in_place == encrypted );
+        assert( engine.decrypt_buffer(in_place, in_place, out_size) && out_size == plain.size() &&
+                std::equal(plain.begin(), plain.end(), in_place.begin()) );
+
+        // Partially overlapping buffers are refused
+        assert( !engine.encrypt_buffer(std::span(in_place).first(plain.size()), std::span(in_place).subspan(16), out_size) );
+
+        std::vector<uint8_t> small = read_file("testfiles/image_7_enc_cbc.TGA");
+        out.assign(small.size(), 0);
+        assert( decrypt_buffer(small, out, config, out_size) );
+        out.resize(out_size);
+        assert( out == read_file("testfiles/ref_7_dec_cbc.TGA") );
+
+        std::vector<uint8_t> too_short(TGA_HEADER_SIZE - 1);
+        assert( !encrypt_buffer(too_short, out, config, out_size) );
+
+        config.m_crypto_function = "AES-128-ECB";
+        std::vector<uint8_t> image = read_file("testfiles/image_1.TGA");
+        out.assign(64, 0);
+        assert( encrypt_buffer(image, out, config, out_size) );
+        out.resize(out_size);
+        assert( out == read_file("testfiles/ref_1_enc_ecb.TGA") );
+    }
+
+    // Batches from a manifest and from a directory
+    {
+        config.m_crypto_function = "AES-128-ECB";
+        config.m_threads = 3;
+        std::filesystem::remove_all("testfiles/out_batch");
+
+        std::ofstream("testfiles/out_manifest.txt") << "testfiles/homer-simpson.TGA\n"
+                                                    << "testfiles/image_1.TGA\n"
+                                                    << "testfiles/missing.TGA\n"
+                                                    << "testfiles/UCM8.TGA\n"
+                                                    << "testfiles/image_2.TGA\n";
+        std::vector<batch_job> jobs = batch_jobs_from_manifest("testfiles/out_manifest.txt", "testfiles/out_batch/encrypted");
+        assert( jobs.size() == 5 && jobs[1].m_output == "testfiles/out_batch/encrypted/image_1.TGA" );
+
+        std::vector<batch_result> results = encrypt_batch(jobs, config);
+        assert( results.size() == 5 );
+        assert( results[0].m_success && results[0].m_size == 2353941 &&
+                compare_files(results[0].m_output, "testfiles/homer-simpson_enc_ecb.TGA") );
+        assert( results[1].m_success && compare_files(results[1].m_output, "testfiles/ref_1_enc_ecb.TGA") );
+        assert( !results[2].m_success );
+        assert( results[3].m_success && compare_files(results[3].m_output, "testfiles/UCM8_enc_ecb.TGA") );
+        assert( results[4].m_success && compare_files(results[4].m_output, "testfiles/ref_2_enc_ecb.TGA") );
+
+        jobs = batch_jobs_from_directory("testfiles/out_batch/encrypted", "testfiles/out_batch/decrypted");
+        assert( jobs.size() == 4 );
+        results = decrypt_batch(jobs, config);
+        for (const batch_result & result : results)
+        {
+            std::string original = "testfiles/" + std::filesystem::path(result.m_input).filename().string();
+            assert( result.m_success && compare_files(result.m_output, original) );
+        }
+
+        std::filesystem::remove_all("testfiles/out_batch");
+        std::filesystem::remove("testfiles/out_manifest.txt");
+        config.m_threads = 1;
+    }
+
+    // Multi-buffer AES against EVP: every key size and mode, lanes refilled with jobs of different lengths and keys
+    if (has_aes_ni())
+    {
+        const char * ciphers[3][2] = {{"AES-128-ECB", "AES-128-CTR"}, {"AES-192-ECB", "AES-192-CTR"}, {"AES-256-ECB", "AES-256-CTR"}};
+        for (size_t key_size = 0; key_size < 3; ++key_size)
+            for (aes_lane_mode mode : {aes_lane_mode::ecb_encrypt, aes_lane_mode::ecb_decrypt, aes_lane_mode::ctr})
+            {
+                const EVP_CIPHER * evp = EVP_get_cipherbyname(ciphers[key_size][mode == aes_lane_mode::ctr]);
+                size_t key_length = (size_t)EVP_CIPHER_key_length(evp);
+                std::vector<aes_round_keys> keys(3);
+                std::vector<std::vector<uint8_t>> key_bytes(3, std::vector<uint8_t>(key_length)), in(21), out(21);
+                std::vector<aes_lane_job> lanes(21);
+                for (size_t k = 0; k < keys.size(); ++k)
+                    assert( RAND_bytes(key_bytes[k].data(), (int)key_length) == 1 && keys[k].expand(key_bytes[k].data(), key_length) );
+                for (size_t job = 0; job < lanes.size(); ++job)
+                {
+                    in[job].resize(16 * ((job * 7) % 23));
+                    out[job].resize(in[job].size());
+                    assert( RAND_bytes(in[job].data(), (int)in[job].size()) == 1 );
+                    lanes[job] = {&keys[job % 3], in[job].data(), out[job].data(), in[job].size() / 16, {}};
+                    assert( RAND_bytes(lanes[job].m_counter, 16) == 1 );
+                    if (job == 5)
+                        std::memset(lanes[job].m_counter + 8, 0xff, 8);     // carry into the upper half
+                }
+                assert( aes_multi_buffer(lanes, mode) );
+
+                for (size_t job = 0; job < lanes.size(); ++job)
+                {
+                    cipher_ctx_ptr ctx(EVP_CIPHER_CTX_new(), EVP_CIPHER_CTX_free);
+                    std::vector<uint8_t> expected(in[job].size() + 16);
+                    int out_len = 0;
+                    assert( EVP_CipherInit_ex(ctx.get(), evp, nullptr, key_bytes[job % 3].data(), lanes[job].m_counter,
+                                              mode == aes_lane_mode::ecb_decrypt ? 0 : 1) &&
+                            EVP_CIPHER_CTX_set_padding(ctx.get(), 0) &&
+                            EVP_CipherUpdate(ctx.get(), expected.data(), &out_len, in[job].data(), (int)in[job].size()) );
+                    assert( (size_t)out_len == in[job].size() && std::equal(out[job].begin(), out[job].end(), expected.begin()) );
+                }
+            }
+
+        // A job without keys, first or later, is refused rather than dereferenced
+        aes_round_keys keys;
+        uint8_t block[16] {};
+        assert( keys.expand(block, 16) );
+        aes_lane_job lanes[2] = {{nullptr, block, block, 1, {}}, {&keys, block, block, 1, {}}};
+        assert( !aes_multi_buffer(lanes, aes_lane_mode::ctr) );
+        std::swap(lanes[0], lanes[1]);
+        assert( !aes_multi_buffer(lanes, aes_lane_mode::ctr) );
+
+        // Tiny files through the batch path agree with the per-file path, including a failing decryption
+        config.m_crypto_function = "AES-256-CTR";
+        config.m_key = std::make_unique<uint8_t[]>(32);
+        config.m_key_len = 32;
+        std::memset(config.m_key.get(), 0x5a, 32);
+        std::filesystem::create_directories("testfiles/out_small");
+        std::vector<batch_job> jobs;
+        for (int i = 0; i < 600; ++i)
+            jobs.push_back({i % 3 == 0 ? "testfiles/image_1.TGA" : i % 3 == 1 ? "testfiles/image_2.TGA" : "testfiles/UCM8.TGA",
+                            "testfiles/out_small/" + std::to_string(i) + ".TGA"});
+        for (const batch_result & result : encrypt_batch(jobs, config))
+            assert( result.m_success );
+        for (int i = 0; i < 3; ++i)
+            assert( encrypt_data(jobs[i].m_input, "testfiles/out_file.TGA", config) &&
+                    compare_files("testfiles/out_file.TGA", jobs[597 + i].m_output) );
+
+        config.m_crypto_function = "AES-256-ECB";
+        jobs = {{"testfiles/image_2.TGA", "testfiles/out_small/ecb.TGA"}};
+        assert( encrypt_batch(jobs, config)[0].m_success );
+        assert( encrypt_data("testfiles/image_2.TGA", "testfiles/out_file.TGA", config) && compare_files("testfiles/out_file.TGA", "testfiles/out_small/ecb.TGA") );
+        jobs = {{"testfiles/out_small/ecb.TGA", "testfiles/out_small/dec.TGA"}, {"testfiles/image_2.TGA", "testfiles/out_small/bad.TGA"},
+                {"testfiles/ref_2_enc_ecb.TGA", "testfiles/out_small/wrong_key.TGA"}};
+        std::vector<batch_result> results = decrypt_batch(jobs, config);
+        assert( results[0].m_success && compare_files("testfiles/out_small/dec.TGA", "testfiles/image_2.TGA") );
+        assert( !results[1].m_success && !results[2].m_success );
+
+        std::filesystem::remove_all("testfiles/out_small");
+        config.m_key = std::make_unique<uint8_t[]>(16);
+        config.m_key_len = 16;
+        std::memset(config.m_key.get(), 0, 16);
+    }
+
+    // Incremental encryption skips what the index records as unchanged
+    {
+        namespace fs = std::filesystem;
+        config.m_crypto_function = "AES-128-ECB";
+        config.m_threads = 2;
+        fs::remove_all("testfiles/out_incremental");
+        fs::create_directories("testfiles/out_incremental/source");
+        for (const char * name : {"image_1.TGA", "image_2.TGA", "UCM8.TGA"})
+            fs::copy_file(std::string("testfiles/") + name, std::string("testfiles/out_incremental/source/") + name);
+        const std::string index = "testfiles/out_incremental/index.bin";
+        std::vector<batch_job> jobs = batch_jobs_from_directory("testfiles/out_incremental/source", "testfiles/out_incremental/encrypted");
+        uint64_t total = 0;
+        for (const batch_job & job : jobs)
+            total += fs::file_size(job.m_input);
+
+        incremental_report report = encrypt_incremental(jobs, index, config);
+        assert( report.m_results.size() == 3 && report.m_skipped == 0 && report.m_bytes_saved == 0 );
+        for (const batch_result & result : report.m_results)
+            assert( result.m_success && !result.m_skipped );
+        assert( compare_files("testfiles/out_incremental/encrypted/UCM8.TGA", "testfiles/UCM8_enc_ecb.TGA") );
+        assert( fs::file_size(index) == sizeof(index_header) + 3 * sizeof(index_entry) );
+
+        report = encrypt_incremental(jobs, index, config);
+        assert( report.m_skipped == 3 && report.m_bytes_saved == total );
+
+        // A touched file is recognised by its content, a modified one and one with a missing output are redone
+        fs::last_write_time("testfiles/out_incremental/source/image_1.TGA",
+                            fs::last_write_time("testfiles/out_incremental/source/image_1.TGA") + std::chrono::hours(1));
+        fs::copy_file("testfiles/image_2.TGA", "testfiles/out_incremental/source/UCM8.TGA", fs::copy_options::overwrite_existing);
+        fs::remove("testfiles/out_incremental/encrypted/image_2.TGA");
+        report = encrypt_incremental(jobs, index, config);
+        assert( report.m_skipped == 1 && report.m_bytes_saved == fs::file_size("testfiles/image_1.TGA") );
+        for (const batch_result & result : report.m_results)
+            assert( result.m_success && result.m_skipped == (fs::path(result.m_input).filename() == "image_1.TGA") );
+        assert( compare_files("testfiles/out_incremental/encrypted/UCM8.TGA", "testfiles/ref_2_enc_ecb.TGA") );
+        assert( compare_files("testfiles/out_incremental/encrypted/image_2.TGA", "testfiles/ref_2_enc_ecb.TGA") );
+
+        // So does a changed RLE stage or digest kind, and a digest manifest that went missing redoes its file
+        config.m_tga_rle = true;
+        assert( encrypt_incremental(jobs, index, config).m_skipped == 0 );
+        config.m_tga_rle = false;
+        assert( encrypt_incremental(jobs, index, config).m_skipped == 0 );
+        assert( compare_files("testfiles/out_incremental/encrypted/UCM8.TGA", "testfiles/ref_2_enc_ecb.TGA") );
+        config.m_digest = digest_kind::sha256;
+        assert( encrypt_incremental(jobs, index, config).m_skipped == 0 );
+        fs::remove("testfiles/out_incremental/encrypted/UCM8.TGA.sha256");
+        assert( encrypt_incremental(jobs, index, config).m_skipped == 2 );
+        assert( fs::exists("testfiles/out_incremental/encrypted/UCM8.TGA.sha256") );
+        config.m_digest = digest_kind::none;
+        assert( encrypt_incremental(jobs, index, config).m_skipped == 0 );
+
+        // Another key invalidates every entry, and a damaged index reads as empty
+        config.m_key[0] = 0x42;
+        assert( encrypt_incremental(jobs, index, config).m_skipped == 0 );
+        config.m_key[0] = 0x00;
+        assert( encrypt_incremental(jobs, index, config).m_skipped == 0 );
+        assert( encrypt_incremental(jobs, index, config).m_skipped == 3 );
+        fs::resize_file(index, fs::file_size(index) - 1);
+        assert( encrypt_incremental(jobs, index, config).m_skipped == 0 );
+        assert( fs::file_size(index) == sizeof(index_header) + 3 * sizeof(index_entry) );
+
+        fs::remove_all("testfiles/out_incremental");
+        config.m_threads = 1;
+    }
+
+    // Digests of plaintext and ciphertext computed during the cipher pass
+    {
+        config.m_crypto_function = "AES-128-ECB";
+        config.m_digest = digest_kind::sha256;
+        config.m_threads = 4;
+        assert( encrypt_data  ("testfiles/homer-simpson.TGA", "testfiles/out_file.TGA", config) &&
+                compare_files ("testfiles/out_file.TGA", "testfiles/homer-simpson_enc_ecb.TGA") );
+
+        std::ifstream manifest("testfiles/out_file.TGA.sha256");
+        std::string input_line, output_line;
+        assert( std::getline(manifest, input_line) && std::getline(manifest, output_line) );
+        assert( input_line == "21beb892f32dcdec73223dbceb2b30865fbe6e22067a5453bbb8485d45c6b49b  testfiles/homer-simpson.TGA" );
+        assert( output_line == "c90230464b281e01d2be2297a8dc21c29414a0f34cf02bedfbfd862a7f788329  testfiles/out_file.TGA" );
+        assert( verify_digest_manifest("testfiles/out_file.TGA.sha256") );
+
+        config.m_digest = digest_kind::sha512;
+        config.m_crypto_function = "AES-128-CBC";
+        assert( decrypt_data  ("testfiles/image_8_enc_cbc.TGA", "testfiles/out_file.TGA", config) &&
+                compare_files ("testfiles/out_file.TGA", "testfiles/ref_8_dec_cbc.TGA") );
+        assert( verify_digest_manifest("testfiles/out_file.TGA.sha512") );
+
+        std::vector<std::string> failed;
+        std::ofstream("testfiles/out_file.TGA", std::ios::app) << 'x';
+        assert( !verify_digest_manifest("testfiles/out_file.TGA.sha512", &failed) );
+        assert( failed.size() == 1 && failed[0] == "testfiles/out_file.TGA" );
+        assert( !verify_digest_manifest("testfiles/missing.sha512") );
+
+        std::filesystem::remove("testfiles/out_file.TGA.sha256");
+        std::filesystem::remove("testfiles/out_file.TGA.sha512");
+        config.m_digest = digest_kind::none;
+        config.m_threads = 1;
+    }
+
+    // File comparison: every kernel against std::mismatch, then mismatch offsets on real files
+    {
+        std::vector<uint8_t> a(1000), b;
+        for (size_t i = 0; i < a.size(); ++i)
+            a[i] = (uint8_t)(i * 131 + 7);
+        std::vector<mismatch_function> kernels = {&mismatch_scalar, select_mismatch()};
+#if defined(__x86_64__) || defined(__i386__)
+        if (__builtin_cpu_supports("sse2"))
+            kernels.push_back(&mismatch_sse2);
+        if (__builtin_cpu_supports("avx2"))
+            kernels.push_back(&mismatch_avx2);
+#endif
+        for (mismatch_function kernel : kernels)
+            for (size_t length : {0, 1, 15, 16, 33, 127, 128, 129, 640, 1000})
+                for (size_t position : {0, 1, 17, 31, 32, 100, 127, 128, 500, 999, 1000})
+                {
+                    b = a;
+                    if (position < length)
+                        b[position] ^= 0x40;
+                    size_t expected = (size_t)(std::mismatch(a.begin(), a.begin() + (ptrdiff_t)length, b.begin()).first - a.begin());
+                    assert( kernel(a.data(), b.data(), length) == expected );
+                }
+
+        std::vector<uint8_t> image = read_file("testfiles/homer-simpson.TGA");
+        image[1234567] ^= 1;
+        std::ofstream("testfiles/out_compare.TGA", std::ios::binary).write((const char *)image.data(), (std::streamsize)image.size());
+        file_comparison comparison = compare_file_contents("testfiles/homer-simpson.TGA", "testfiles/out_compare.TGA");
+        assert( comparison.m_readable && !comparison.m_equal && comparison.m_mismatch_offset == 1234567 );
+
+        comparison = compare_file_contents("testfiles/homer-simpson.TGA", "testfiles/homer-simpson.TGA");
+        assert( comparison.m_readable && comparison.m_equal && comparison.m_mismatch_offset == image.size() );
+        comparison = compare_file_contents("testfiles/homer-simpson.TGA", "testfiles/UCM8.TGA");
+        assert( comparison.m_readable && !comparison.m_equal );
+
+        // Different sizes still report the first differing byte, or the shorter size for a prefix
+        std::ofstream("testfiles/out_compare.TGA", std::ios::binary).write((const char *)image.data(), 2000000);
+        comparison = compare_file_contents("testfiles/homer-simpson.TGA", "testfiles/out_compare.TGA");
+        assert( comparison.m_readable && !comparison.m_equal && comparison.m_mismatch_offset == 1234567 );
+        image[1234567] ^= 1;
+        std::ofstream("testfiles/out_compare.TGA", std::ios::binary).write((const char *)image.data(), 2000000);
+        comparison = compare_file_contents("testfiles/out_compare.TGA", "testfiles/homer-simpson.TGA");
+        assert( comparison.m_readable && !comparison.m_equal && comparison.m_mismatch_offset == 2000000 );
+        image[1234567] ^= 1;
+        std::ofstream("testfiles/out_compare.TGA", std::ios::binary).write((const char *)image.data(), (std::streamsize)image.size());
+        comparison = compare_file_contents("testfiles/homer-simpson.TGA", "testfiles/missing.TGA");
+        assert( !comparison.m_readable && !comparison.m_equal );
+
+        // Streams that can not be mapped are compared chunk by chunk
+        comparison = compare_file_contents("/dev/null", "testfiles/out_compare.TGA");
+        assert( comparison.m_readable && !comparison.m_equal && comparison.m_mismatch_offset == 0 );
+
+        std::vector<file_comparison> results = compare_file_pairs({
+            {"testfiles/homer-simpson.TGA", "testfiles/out_compare.TGA"},
+            {"testfiles/UCM8.TGA", "testfiles/UCM8.TGA"},
+            {"testfiles/image_1.TGA", "testfiles/missing.TGA"},
+            {"testfiles/ref_1_enc_ecb.TGA", "testfiles/ref_1_enc_ecb.TGA"},
+        }, 3);
+        assert( results.size() == 4 );
+        assert( !results[0].m_equal && results[0].m_mismatch_offset == 1234567 );
+        assert( results[1].m_equal && !results[2].m_readable && results[3].m_equal );
+
+        std::filesystem::remove("testfiles/out_compare.TGA");
+    }
+
+    // Sealed chunk containers and random access
+    {
+        crypto_config sealed {"AES-256-GCM", nullptr, nullptr, 0, 0};
+        sealed.m_chunk_size = MIN_CHUNK_SIZE;
+        sealed.m_threads = 4;
+        std::vector<uint8_t> plain = read_file("testfiles/homer-simpson.TGA");
+
+        assert( encrypt_container("testfiles/homer-simpson.TGA", "testfiles/out_container.TGA", sealed) && sealed.m_key_len == 32 );
+        assert( decrypt_container("testfiles/out_container.TGA", "testfiles/out_file.TGA", sealed) &&
+                compare_files("testfiles/out_file.TGA", "testfiles/homer-simpson.TGA") );
+
+        std::vector<uint8_t> range;
+        const std::pair<uint64_t, size_t> ranges[] = {
+            {0, TGA_HEADER_SIZE + 100}, {5, 3}, {TGA_HEADER_SIZE + MIN_CHUNK_SIZE - 7, 20},
+            {TGA_HEADER_SIZE + 2 * MIN_CHUNK_SIZE, 5 * MIN_CHUNK_SIZE + 1}, {plain.size() - 1000, 1000}, {plain.size(), 0},
+        };
+        for (const auto & [offset, length] : ranges)
+        {
+            assert( decrypt_range("testfiles/out_container.TGA", offset, length, range, sealed) );
+            assert( std::equal(range.begin(), range.end(), plain.begin() + (ptrdiff_t)offset) && range.size() == length );
+        }
+        assert( !decrypt_range("testfiles/out_container.TGA", plain.size() - 10, 11, range, sealed) );
+
+        // A flipped bit only fails the chunk it lands in
+        std::vector<uint8_t> tampered = read_file("testfiles/out_container.TGA");
+        tampered[TGA_HEADER_SIZE + 3 * (MIN_CHUNK_SIZE + AEAD_TAG_SIZE) + 42] ^= 1;
+        std::ofstream("testfiles/out_tampered.TGA", std::ios::binary).write((const char *)tampered.data(), (std::streamsize)tampered.size());
+        assert( decrypt_range("testfiles/out_tampered.TGA", 0, TGA_HEADER_SIZE + 3 * MIN_CHUNK_SIZE, range, sealed) );
+        assert( !decrypt_range("testfiles/out_tampered.TGA", TGA_HEADER_SIZE + 3 * MIN_CHUNK_SIZE + 10, 1, range, sealed) && range.empty() );
+        assert( !decrypt_container("testfiles/out_tampered.TGA", "testfiles/out_file.TGA", sealed) );
+
+        // The header is authenticated as well, and a truncated container is not recognised at all
+        tampered = read_file("testfiles/out_container.TGA");
+        tampered[2] ^= 1;
+        std::ofstream("testfiles/out_tampered.TGA", std::ios::binary).write((const char *)tampered.data(), (std::streamsize)tampered.size());
+        assert( !decrypt_range("testfiles/out_tampered.TGA", TGA_HEADER_SIZE, 1, range, sealed) );
+        std::ofstream("testfiles/out_tampered.TGA", std::ios::binary).write((const char *)tampered.data(), (std::streamsize)tampered.size() - 8);
+        assert( !decrypt_range("testfiles/out_tampered.TGA", 0, 1, range, sealed) );
+
+        // Neither is a trailer whose index offset and file size only match the real size after wrapping around 64 bits
+        std::vector<uint8_t> wrapped(tampered.begin(), tampered.begin() + TGA_HEADER_SIZE + 18);
+        container_trailer trailer;
+        assert( trailer.load(tampered.data() + tampered.size() - CONTAINER_TRAILER_SIZE) );
+        trailer.m_chunk_size = COUNTER_BLOCK_SIZE;
+        trailer.m_chunk_count = (UINT64_MAX - 15) / 40 + 1;
+        trailer.m_payload_size = (trailer.m_chunk_count - 1) * COUNTER_BLOCK_SIZE + 10;
+        trailer.m_index_offset = TGA_HEADER_SIZE + trailer.m_payload_size + trailer.m_chunk_count * AEAD_TAG_SIZE;
+        wrapped.resize(wrapped.size() + CONTAINER_TRAILER_SIZE);
+        trailer.store(wrapped.data() + wrapped.size() - CONTAINER_TRAILER_SIZE);
+        assert( trailer.m_index_offset + trailer.m_chunk_count * 8 + CONTAINER_TRAILER_SIZE == wrapped.size() );
+        assert( !trailer.consistent(wrapped.size()) );
+        std::ofstream("testfiles/out_tampered.TGA", std::ios::binary).write((const char *)wrapped.data(), (std::streamsize)wrapped.size());
+        assert( !decrypt_range("testfiles/out_tampered.TGA", 0, 1, range, sealed) );
+        assert( !decrypt_container("testfiles/out_tampered.TGA", "testfiles/out_file.TGA", sealed) );
+
+        crypto_config other_key {"AES-256-GCM", nullptr, nullptr, 0, 0};
+        other_key.m_key = std::make_unique<uint8_t[]>(32);
+        other_key.m_key_len = 32;
+        assert( !decrypt_container("testfiles/out_container.TGA", "testfiles/out_file.TGA", other_key) );
+
+        sealed.m_crypto_function = "ChaCha20-Poly1305";
+        sealed.m_threads = 1;
+        assert( encrypt_container("testfiles/image_1.TGA", "testfiles/out_container.TGA", sealed) &&
+                decrypt_container("testfiles/out_container.TGA", "testfiles/out_file.TGA", sealed) &&
+                compare_files("testfiles/out_file.TGA", "testfiles/image_1.TGA") );
+
+        // Only AEAD ciphers can seal containers
+        sealed.m_crypto_function = "AES-128-CBC";
+        assert( !encrypt_container("testfiles/image_1.TGA", "testfiles/out_container.TGA", sealed) );
+
+        std::filesystem::remove("testfiles/out_container.TGA");
+        std::filesystem::remove("testfiles/out_tampered.TGA");
+    }
 
     return 0;
 }
@@ -5,11 +5,39 @@
 #include <string_view>
 #include <vector>
 #include <iostream>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <cstring>
+#include <algorithm>
+#include <bit>
 #include <openssl/evp.h>
 #include <openssl/rand.h>
 
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
 using namespace std;
 
+constexpr size_t NONCE_SIZE = 8;                    // big-endian counter appended to the random prefix of a candidate
+constexpr uint64_t CANCEL_CHECK_INTERVAL = 4096;    // candidates a worker hashes between two looks at the cancel flag and the clock
+constexpr size_t SHA512_BLOCK_SIZE = 128;
+constexpr size_t SHA512_DIGEST_SIZE = 64;
+constexpr size_t MAX_SHA512_LANES = 8;              // widest kernel (AVX-512), CANCEL_CHECK_INTERVAL is a multiple of it
+
+struct sha512_kernel;
+
+// Limits of a findHash() search.
+struct search_options
+{
+    unsigned m_threads = 0;                             // workers, 0 picks std::thread::hardware_concurrency()
+    const atomic<bool> * m_cancel = nullptr;            // the search gives up once the caller sets it
+    chrono::steady_clock::time_point m_deadline = chrono::steady_clock::time_point::max();
+    atomic<uint64_t> * m_hashes = nullptr;              // optional, receives the number of candidates hashed
+    const sha512_kernel * m_kernel = nullptr;           // nullptr picks the widest one the CPU supports
+};
+
 string bytesvector_to_hex(const vector<unsigned char> & bytes)
 {
     string hex_string;
@@ -46,105 +74,475 @@ vector<unsigned char> get_random_string()
     return buffer;
 }
 
-vector<unsigned char> create_bitmask(int bits_amount)
+static const uint64_t SHA512_K[80] = {
+    0x428a2f98d728ae22ULL, 0x7137449123ef65cdULL, 0xb5c0fbcfec4d3b2fULL, 0xe9b5dba58189dbbcULL,
+    0x3956c25bf348b538ULL, 0x59f111f1b605d019ULL, 0x923f82a4af194f9bULL, 0xab1c5ed5da6d8118ULL,
+    0xd807aa98a3030242ULL, 0x12835b0145706fbeULL, 0x243185be4ee4b28cULL, 0x550c7dc3d5ffb4e2ULL,
+    0x72be5d74f27b896fULL, 0x80deb1fe3b1696b1ULL, 0x9bdc06a725c71235ULL, 0xc19bf174cf692694ULL,
+    0xe49b69c19ef14ad2ULL, 0xefbe4786384f25e3ULL, 0x0fc19dc68b8cd5b5ULL, 0x240ca1cc77ac9c65ULL,
+    0x2de92c6f592b0275ULL, 0x4a7484aa6ea6e483ULL, 0x5cb0a9dcbd41fbd4ULL, 0x76f988da831153b5ULL,
+    0x983e5152ee66dfabULL, 0xa831c66d2db43210ULL, 0xb00327c898fb213fULL, 0xbf597fc7beef0ee4ULL,
+    0xc6e00bf33da88fc2ULL, 0xd5a79147930aa725ULL, 0x06ca6351e003826fULL, 0x142929670a0e6e70ULL,
+    0x27b70a8546d22ffcULL, 0x2e1b21385c26c926ULL, 0x4d2c6dfc5ac42aedULL, 0x53380d139d95b3dfULL,
+    0x650a73548baf63deULL, 0x766a0abb3c77b2a8ULL, 0x81c2c92e47edaee6ULL, 0x92722c851482353bULL,
+    0xa2bfe8a14cf10364ULL, 0xa81a664bbc423001ULL, 0xc24b8b70d0f89791ULL, 0xc76c51a30654be30ULL,
+    0xd192e819d6ef5218ULL, 0xd69906245565a910ULL, 0xf40e35855771202aULL, 0x106aa07032bbd1b8ULL,
+    0x19a4c116b8d2d0c8ULL, 0x1e376c085141ab53ULL, 0x2748774cdf8eeb99ULL, 0x34b0bcb5e19b48a8ULL,
+    0x391c0cb3c5c95a63ULL, 0x4ed8aa4ae3418acbULL, 0x5b9cca4f7763e373ULL, 0x682e6ff3d6b2b8a3ULL,
+    0x748f82ee5defb2fcULL, 0x78a5636f43172f60ULL, 0x84c87814a1f0ab72ULL, 0x8cc702081a6439ecULL,
+    0x90befffa23631e28ULL, 0xa4506cebde82bde9ULL, 0xbef9a3f7b2c67915ULL, 0xc67178f2e372532bULL,
+    0xca273eceea26619cULL, 0xd186b8c721c0c207ULL, 0xeada7dd6cde0eb1eULL, 0xf57d4f7fee6ed178ULL,
+    0x06f067aa72176fbaULL, 0x0a637dc5a2c898a6ULL, 0x113f9804bef90daeULL, 0x1b710b35131c471bULL,
+    0x28db77f523047d84ULL, 0x32caab7b40c72493ULL, 0x3c9ebe0a15c9bebcULL, 0x431d67c49c100d4cULL,
+    0x4cc5d4becb3e42b6ULL, 0x597f299cfc657e2aULL, 0x5fcb6fab3ad6faecULL, 0x6c44198c4a475817ULL,
+};
+
+static const uint64_t SHA512_IV[8] = {
+    0x6a09e667f3bcc908ULL, 0xbb67ae8584caa73bULL, 0x3c6ef372fe94f82bULL, 0xa54ff53a5f1d36f1ULL,
+    0x510e527fade682d1ULL, 0x9b05688c2b3e6c1fULL, 0x1f83d9abfb41bd6bULL, 0x5be0cd19137e2179ULL,
+};
+
+/**
+ * Native SHA-512 compression over several independent messages at once: `m_compress` runs `blocks` blocks of
+ * messages[lane] through state[lane] for each of the `m_lanes` lanes. Padding is up to the caller.
+ */
+struct sha512_kernel
 {
-    vector<unsigned char> mask;
-    int full_bytes = bits_amount / 8;
-    int part_bytes = bits_amount % 8;
+    const char * m_name;
+    size_t m_lanes;
+    void (*m_compress)(uint64_t (*state)[8], const unsigned char * const * messages, size_t blocks);
+};
 
-    for(int i = 0; i < full_bytes; i++)
-        mask.push_back(0x00);
+static inline uint64_t load_be64(const unsigned char * data)
+{
+    uint64_t value;
+    memcpy(&value, data, sizeof(value));
+    if constexpr (endian::native == endian::little)
+        value = __builtin_bswap64(value);
+    return value;
+}
+
+static inline void store_be64(unsigned char * data, uint64_t value)
+{
+    if constexpr (endian::native == endian::little)
+        value = __builtin_bswap64(value);
+    memcpy(data, &value, sizeof(value));
+}
 
-    if (part_bytes > 0) {
-        unsigned char temp = 0xFF;
-        temp >>= part_bytes;
-        mask.push_back(temp);
+static inline uint64_t rotr64(uint64_t x, int n) { return (x >> n) | (x << (64 - n)); }
+
+static void sha512_compress_scalar(uint64_t (*state)[8], const unsigned char * const * messages, size_t blocks)
+{
+    for (size_t block = 0; block < blocks; ++block)
+    {
+        const unsigned char * data = messages[0] + block * SHA512_BLOCK_SIZE;
+        uint64_t w[80];
+        for (int t = 0; t < 16; ++t)
+            w[t] = load_be64(data + 8 * t);
+        for (int t = 16; t < 80; ++t)
+            w[t] = (rotr64(w[t - 2], 19) ^ rotr64(w[t - 2], 61) ^ (w[t - 2] >> 6)) + w[t - 7] +
+                   (rotr64(w[t - 15], 1) ^ rotr64(w[t - 15], 8) ^ (w[t - 15] >> 7)) + w[t - 16];
+
+        uint64_t a = state[0][0], b = state[0][1], c = state[0][2], d = state[0][3];
+        uint64_t e = state[0][4], f = state[0][5], g = state[0][6], h = state[0][7];
+        for (int t = 0; t < 80; ++t)
+        {
+            uint64_t t1 = h + (rotr64(e, 14) ^ rotr64(e, 18) ^ rotr64(e, 41)) + ((e & f) ^ (~e & g)) + SHA512_K[t] + w[t];
+            uint64_t t2 = (rotr64(a, 28) ^ rotr64(a, 34) ^ rotr64(a, 39)) + ((a & b) ^ (a & c) ^ (b & c));
+            h = g; g = f; f = e; e = d + t1;
+            d = c; c = b; b = a; a = t1 + t2;
+        }
+        state[0][0] += a; state[0][1] += b; state[0][2] += c; state[0][3] += d;
+        state[0][4] += e; state[0][5] += f; state[0][6] += g; state[0][7] += h;
     }
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+// Four lanes in the 64-bit elements of a __m256i, AVX2 has no rotate so it is two shifts and an or.
+#define SHA512_ROTR256(x, n) _mm256_or_si256(_mm256_srli_epi64(x, n), _mm256_slli_epi64(x, 64 - (n)))
 
-    if(full_bytes == 0 && part_bytes == 0)
-        mask.push_back(0x80);
+__attribute__((target("avx2")))
+static void sha512_compress_avx2(uint64_t (*state)[8], const unsigned char * const * messages, size_t blocks)
+{
+    __m256i v[8];
+    for (int i = 0; i < 8; ++i)
+        v[i] = _mm256_set_epi64x((long long)state[3][i], (long long)state[2][i], (long long)state[1][i], (long long)state[0][i]);
 
-    return mask;
+    for (size_t block = 0; block < blocks; ++block)
+    {
+        size_t offset = block * SHA512_BLOCK_SIZE;
+        __m256i w[80];
+        for (int t = 0; t < 16; ++t)
+            w[t] = _mm256_set_epi64x((long long)load_be64(messages[3] + offset + 8 * t), (long long)load_be64(messages[2] + offset + 8 * t),
+                                     (long long)load_be64(messages[1] + offset + 8 * t), (long long)load_be64(messages[0] + offset + 8 * t));
+        for (int t = 16; t < 80; ++t)
+        {
+            __m256i s0 = _mm256_xor_si256(_mm256_xor_si256(SHA512_ROTR256(w[t - 15], 1), SHA512_ROTR256(w[t - 15], 8)), _mm256_srli_epi64(w[t - 15], 7));
+            __m256i s1 = _mm256_xor_si256(_mm256_xor_si256(SHA512_ROTR256(w[t - 2], 19), SHA512_ROTR256(w[t - 2], 61)), _mm256_srli_epi64(w[t - 2], 6));
+            w[t] = _mm256_add_epi64(_mm256_add_epi64(s1, w[t - 7]), _mm256_add_epi64(s0, w[t - 16]));
+        }
+
+        __m256i a = v[0], b = v[1], c = v[2], d = v[3], e = v[4], f = v[5], g = v[6], h = v[7];
+        for (int t = 0; t < 80; ++t)
+        {
+            __m256i sigma1 = _mm256_xor_si256(_mm256_xor_si256(SHA512_ROTR256(e, 14), SHA512_ROTR256(e, 18)), SHA512_ROTR256(e, 41));
+            __m256i choice = _mm256_xor_si256(_mm256_and_si256(e, f), _mm256_andnot_si256(e, g));
+            __m256i t1 = _mm256_add_epi64(_mm256_add_epi64(h, sigma1), _mm256_add_epi64(choice, _mm256_add_epi64(_mm256_set1_epi64x((long long)SHA512_K[t]), w[t])));
+            __m256i sigma0 = _mm256_xor_si256(_mm256_xor_si256(SHA512_ROTR256(a, 28), SHA512_ROTR256(a, 34)), SHA512_ROTR256(a, 39));
+            __m256i majority = _mm256_or_si256(_mm256_and_si256(a, b), _mm256_and_si256(c, _mm256_or_si256(a, b)));
+            h = g; g = f; f = e; e = _mm256_add_epi64(d, t1);
+            d = c; c = b; b = a; a = _mm256_add_epi64(t1, _mm256_add_epi64(sigma0, majority));
+        }
+        v[0] = _mm256_add_epi64(v[0], a); v[1] = _mm256_add_epi64(v[1], b); v[2] = _mm256_add_epi64(v[2], c); v[3] = _mm256_add_epi64(v[3], d);
+        v[4] = _mm256_add_epi64(v[4], e); v[5] = _mm256_add_epi64(v[5], f); v[6] = _mm256_add_epi64(v[6], g); v[7] = _mm256_add_epi64(v[7], h);
+    }
+
+    for (int i = 0; i < 8; ++i)
+    {
+        alignas(32) uint64_t words[4];
+        _mm256_store_si256((__m256i*)words, v[i]);
+        for (size_t lane = 0; lane < 4; ++lane)
+            state[lane][i] = words[lane];
+    }
 }
 
+#undef SHA512_ROTR256
 
-bool findHash (int numberZeroBits, string & outputMessage, string & outputHash)
+// Eight lanes in a __m512i, with native rotates and three-input logic (0x96 xor, 0xca choice, 0xe8 majority).
+// GCC 12 warns about the _mm512_undefined_epi32() placeholder inside its own rotate and shift intrinsics.
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+__attribute__((target("avx512f")))
+static void sha512_compress_avx512(uint64_t (*state)[8], const unsigned char * const * messages, size_t blocks)
 {
-    if(numberZeroBits < 0 || numberZeroBits > 512) return 0;
-    vector<unsigned char> random_string = get_random_string();
-    unsigned char hash[EVP_MAX_MD_SIZE];
-    unsigned int hash_size = 0;
-    OpenSSL_add_all_digests();
-    vector<unsigned char> bitmask = create_bitmask(numberZeroBits);
+    __m512i v[8];
+    for (int i = 0; i < 8; ++i)
+        v[i] = _mm512_set_epi64((long long)state[7][i], (long long)state[6][i], (long long)state[5][i], (long long)state[4][i],
+                                (long long)state[3][i], (long long)state[2][i], (long long)state[1][i], (long long)state[0][i]);
 
-    while (true)
+    for (size_t block = 0; block < blocks; ++block)
     {
-        EVP_MD_CTX* context = EVP_MD_CTX_new();
-        if (context == nullptr) return false;
-        if(!EVP_DigestInit_ex(context, EVP_sha512(), nullptr)) return false;
-        if(!EVP_DigestUpdate(context, random_string.data(), random_string.size())) return false;
-        if(!EVP_DigestFinal_ex(context, hash, &hash_size)) return false;
+        size_t offset = block * SHA512_BLOCK_SIZE;
+        __m512i w[80];
+        for (int t = 0; t < 16; ++t)
+        {
+            alignas(64) uint64_t words[8];
+            for (size_t lane = 0; lane < 8; ++lane)
+                words[lane] = load_be64(messages[lane] + offset + 8 * t);
+            w[t] = _mm512_load_si512(words);
+        }
+        for (int t = 16; t < 80; ++t)
+        {
+            __m512i s0 = _mm512_ternarylogic_epi64(_mm512_ror_epi64(w[t - 15], 1), _mm512_ror_epi64(w[t - 15], 8), _mm512_srli_epi64(w[t - 15], 7), 0x96);
+            __m512i s1 = _mm512_ternarylogic_epi64(_mm512_ror_epi64(w[t - 2], 19), _mm512_ror_epi64(w[t - 2], 61), _mm512_srli_epi64(w[t - 2], 6), 0x96);
+            w[t] = _mm512_add_epi64(_mm512_add_epi64(s1, w[t - 7]), _mm512_add_epi64(s0, w[t - 16]));
+        }
 
-        vector<unsigned char> hash_vector;
-        for (unsigned char i : hash)
-            hash_vector.push_back(i);
+        __m512i a = v[0], b = v[1], c = v[2], d = v[3], e = v[4], f = v[5], g = v[6], h = v[7];
+        for (int t = 0; t < 80; ++t)
+        {
+            __m512i sigma1 = _mm512_ternarylogic_epi64(_mm512_ror_epi64(e, 14), _mm512_ror_epi64(e, 18), _mm512_ror_epi64(e, 41), 0x96);
+            __m512i choice = _mm512_ternarylogic_epi64(e, f, g, 0xca);
+            __m512i t1 = _mm512_add_epi64(_mm512_add_epi64(h, sigma1), _mm512_add_epi64(choice, _mm512_add_epi64(_mm512_set1_epi64((long long)SHA512_K[t]), w[t])));
+            __m512i sigma0 = _mm512_ternarylogic_epi64(_mm512_ror_epi64(a, 28), _mm512_ror_epi64(a, 34), _mm512_ror_epi64(a, 39), 0x96);
+            __m512i majority = _mm512_ternarylogic_epi64(a, b, c, 0xe8);
+            h = g; g = f; f = e; e = _mm512_add_epi64(d, t1);
+            d = c; c = b; b = a; a = _mm512_add_epi64(t1, _mm512_add_epi64(sigma0, majority));
+        }
+        v[0] = _mm512_add_epi64(v[0], a); v[1] = _mm512_add_epi64(v[1], b); v[2] = _mm512_add_epi64(v[2], c); v[3] = _mm512_add_epi64(v[3], d);
+        v[4] = _mm512_add_epi64(v[4], e); v[5] = _mm512_add_epi64(v[5], f); v[6] = _mm512_add_epi64(v[6], g); v[7] = _mm512_add_epi64(v[7], h);
+    }
 
-        string hash_string = bytesvector_to_hex(hash_vector);
-        bool found_hash = true;
+    for (int i = 0; i < 8; ++i)
+    {
+        alignas(64) uint64_t words[8];
+        _mm512_store_si512(words, v[i]);
+        for (size_t lane = 0; lane < 8; ++lane)
+            state[lane][i] = words[lane];
+    }
+}
+#pragma GCC diagnostic pop
+#endif
+
+static const sha512_kernel SHA512_SCALAR {"scalar", 1, sha512_compress_scalar};
+#if defined(__x86_64__) || defined(__i386__)
+static const sha512_kernel SHA512_AVX2 {"avx2", 4, sha512_compress_avx2};
+static const sha512_kernel SHA512_AVX512 {"avx512", 8, sha512_compress_avx512};
+#endif
+
+// Every kernel this CPU can run, widest first; the scalar one is always there.
+vector<const sha512_kernel *> available_sha512_kernels()
+{
+    vector<const sha512_kernel *> kernels;
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f"))
+        kernels.push_back(&SHA512_AVX512);
+    if (__builtin_cpu_supports("avx2"))
+        kernels.push_back(&SHA512_AVX2);
+#endif
+    kernels.push_back(&SHA512_SCALAR);
+    return kernels;
+}
+
+const sha512_kernel & select_sha512_kernel()
+{
+    static const sha512_kernel * selected = available_sha512_kernels().front();
+    return *selected;
+}
+
+/**
+ * Pads the last `length` bytes of a message of `total_length` bytes into one or two whole blocks at `blocks`
+ * (room for 2 * SHA512_BLOCK_SIZE bytes, `tail` may point there too) and returns their number.
+ */
+size_t sha512_pad(const unsigned char * tail, size_t length, uint64_t total_length, unsigned char * blocks)
+{
+    size_t count = length + 1 + 16 <= SHA512_BLOCK_SIZE ? 1 : 2;
+    if (length > 0)
+        memmove(blocks, tail, length);
+    memset(blocks + length, 0, count * SHA512_BLOCK_SIZE - length);
+    blocks[length] = 0x80;
+    store_be64(blocks + count * SHA512_BLOCK_SIZE - 16, total_length >> 61);
+    store_be64(blocks + count * SHA512_BLOCK_SIZE - 8, total_length << 3);
+    return count;
+}
+
+
+/**
+ * 512-bit difficulty threshold as big-endian 64-bit words: a digest, read as a big-endian number, meets it when it is
+ * not greater. target_for_bits(n) is the classic "n leading zero bits", any other value tunes the difficulty finer.
+ */
+struct hash_target
+{
+    uint64_t m_words[8];
+};
+
+hash_target target_for_bits(int bits)
+{
+    hash_target target;
+    for (int i = 0; i < 8; ++i)
+    {
+        int zero_bits = min(max(bits - 64 * i, 0), 64);
+        target.m_words[i] = zero_bits == 64 ? 0 : UINT64_MAX >> zero_bits;
+    }
+    return target;
+}
+
+static inline void load_digest_words(const unsigned char * digest, uint64_t * words)
+{
+    for (size_t i = 0; i < 8; ++i)
+        words[i] = load_be64(digest + 8 * i);
+}
+
+static inline int leading_zero_bits(const uint64_t * words)
+{
+    int bits = 0;
+    for (size_t i = 0; i < 8; ++i)
+    {
+        bits += countl_zero(words[i]);
+        if (words[i] != 0)
+            break;
+    }
+    return bits;
+}
+
+static inline bool meets_target(const uint64_t * words, const hash_target & target)
+{
+    for (size_t i = 0; i < 8; ++i)
+        if (words[i] != target.m_words[i])
+            return words[i] < target.m_words[i];
+    return true;
+}
 
-        for(int i = 0; i < (int)bitmask.size(); i++)
+// Binary verification of a SHA-512 digest (SHA512_DIGEST_SIZE bytes): at least `bits` leading zero bits.
+bool checkDigest(const unsigned char * digest, int bits)
+{
+    if (bits > 512) return false;
+    uint64_t words[8];
+    load_digest_words(digest, words);
+    return leading_zero_bits(words) >= bits;
+}
+
+bool checkDigest(const unsigned char * digest, const hash_target & target)
+{
+    uint64_t words[8];
+    load_digest_words(digest, words);
+    return meets_target(words, target);
+}
+
+
+/**
+ * Candidates are the challenge followed by a NONCE_SIZE big-endian counter. The whole blocks of the challenge are
+ * hashed once: every attempt starts from that SHA-512 state and only compresses the padded tail holding the nonce,
+ * so the hash rate does not depend on the challenge length. Each of the n workers counts up from its own 1/n of
+ * the nonce space, a batch of consecutive nonces per call of the SIMD kernel, so no candidate is tried twice; the
+ * first one for which `matches` accepts the digest words stops the others. The loop allocates nothing and only
+ * the winner is converted to hex. False once `m_cancel` is set or `m_deadline` has passed before a match was found.
+ */
+template <typename Match>
+static bool search_challenge(const vector<unsigned char> & challenge, Match matches, string & outputMessage, string & outputHash,
+                             const search_options & options)
+{
+    unsigned threads = options.m_threads != 0 ? options.m_threads : max(1u, thread::hardware_concurrency());
+    const sha512_kernel & kernel = options.m_kernel != nullptr ? *options.m_kernel : select_sha512_kernel();
+
+    uint64_t midstate[1][8];
+    memcpy(midstate[0], SHA512_IV, sizeof(SHA512_IV));
+    size_t absorbed = challenge.size() / SHA512_BLOCK_SIZE * SHA512_BLOCK_SIZE;
+    const unsigned char * challenge_data = challenge.data();
+    sha512_compress_scalar(midstate, &challenge_data, absorbed / SHA512_BLOCK_SIZE);
+
+    // The rest of the challenge, a nonce placeholder and the padding; only the nonce differs between candidates.
+    unsigned char tail[2 * SHA512_BLOCK_SIZE];
+    size_t nonce_offset = challenge.size() - absorbed;
+    copy(challenge.begin() + (ptrdiff_t)absorbed, challenge.end(), tail);
+    size_t tail_blocks = sha512_pad(tail, nonce_offset + NONCE_SIZE, challenge.size() + NONCE_SIZE, tail);
+
+    atomic<bool> stop {false};
+    atomic<bool> found {false};
+
+    auto worker = [&](unsigned index)
+    {
+        unsigned char nonce[NONCE_SIZE];
+        uint64_t first = (uint64_t)index * (UINT64_MAX / threads);
+        for (size_t i = 0; i < NONCE_SIZE; ++i)
+            nonce[i] = (unsigned char)(first >> (8 * (NONCE_SIZE - 1 - i)));
+
+        unsigned char blocks[MAX_SHA512_LANES][2 * SHA512_BLOCK_SIZE];
+        const unsigned char * messages[MAX_SHA512_LANES];
+        for (size_t lane = 0; lane < kernel.m_lanes; ++lane)
         {
-            if((bitmask[i] & hash_vector[i]) != hash_vector[i])
-            {
-                found_hash = false;
+            memcpy(blocks[lane], tail, tail_blocks * SHA512_BLOCK_SIZE);
+            messages[lane] = blocks[lane];
+        }
+
+        uint64_t state[MAX_SHA512_LANES][8];
+        uint64_t tried = 0;
+
+        while (!stop.load(memory_order_relaxed))
+        {
+            if (tried % CANCEL_CHECK_INTERVAL == 0 &&
+                ((options.m_cancel != nullptr && options.m_cancel->load(memory_order_relaxed)) ||
+                 chrono::steady_clock::now() >= options.m_deadline))
                 break;
+
+            for (size_t lane = 0; lane < kernel.m_lanes; ++lane)
+            {
+                memcpy(blocks[lane] + nonce_offset, nonce, NONCE_SIZE);
+                memcpy(state[lane], midstate[0], sizeof(midstate[0]));
+                for (size_t i = NONCE_SIZE; i-- > 0 && ++nonce[i] == 0;)
+                    ;
             }
+            kernel.m_compress(state, messages, tail_blocks);
+            tried += kernel.m_lanes;
 
-            if(numberZeroBits == 0 && (bitmask[i] & hash_vector[i]) == 0)
+            // The state words are the big-endian words of the digest, they are checked without serializing them.
+            for (size_t lane = 0; lane < kernel.m_lanes; ++lane)
             {
-                found_hash = false;
+                if(!matches(state[lane]))
+                    continue;
+
+                // Only the first match is reported, the outputs are read after every worker has been joined.
+                if (!found.exchange(true))
+                {
+                    vector<unsigned char> message(challenge);
+                    message.insert(message.end(), blocks[lane] + nonce_offset, blocks[lane] + nonce_offset + NONCE_SIZE);
+                    vector<unsigned char> hash(SHA512_DIGEST_SIZE);
+                    for (size_t i = 0; i < 8; ++i)
+                        store_be64(hash.data() + 8 * i, state[lane][i]);
+                    outputMessage = bytesvector_to_hex(message);
+                    outputHash = bytesvector_to_hex(hash);
+                }
+                stop = true;
                 break;
             }
         }
 
-        if(found_hash)
-        {
-            outputMessage = bytesvector_to_hex(random_string);
-            outputHash = hash_string;
-            EVP_MD_CTX_free(context);
-            return true;
-        }
+        if (options.m_hashes != nullptr)
+            *options.m_hashes += tried;
+        stop = true;
+    };
 
-        random_string.clear();
-        random_string.swap(hash_vector);
-        EVP_MD_CTX_free(context);
-    }
+    vector<thread> workers;
+    for (unsigned index = 1; index < threads; ++index)
+        workers.emplace_back(worker, index);
+    worker(0);
+    for (thread & t : workers)
+        t.join();
+
+    return found;
 }
 
+// Search for a digest that meets `target`.
+bool findHash (const vector<unsigned char> & challenge, const hash_target & target, string & outputMessage, string & outputHash,
+               const search_options & options = search_options())
+{
+    return search_challenge(challenge, [&target](const uint64_t * words) { return meets_target(words, target); },
+                            outputMessage, outputHash, options);
+}
 
-int checkHash(int bits, const std::string & hash)
+// Search for a digest starting with `numberZeroBits` zero bits, 0 asks for a first byte of exactly 0x80.
+bool findHash (const vector<unsigned char> & challenge, int numberZeroBits, string & outputMessage, string & outputHash,
+               const search_options & options = search_options())
 {
-    int bytesToCheck = bits / 8;
-    int extraBits = bits % 8;
+    if(numberZeroBits < 0 || numberZeroBits > 512) return 0;
+    if(numberZeroBits == 0)
+        return search_challenge(challenge, [](const uint64_t * words) { return words[0] >> 56 == 0x80; },
+                                outputMessage, outputHash, options);
+    return findHash(challenge, target_for_bits(numberZeroBits), outputMessage, outputHash, options);
+}
 
-    for (int i = 0; i < bytesToCheck; ++i)
-    {
-        std::string byteString = hash.substr(i * 2, 2);
-        auto byte = static_cast<unsigned char>(std::stoul(byteString, nullptr, 16));
+// findHash() with a random challenge of 8 to 32 bytes.
+bool findHash (int numberZeroBits, string & outputMessage, string & outputHash, const search_options & options)
+{
+    if(numberZeroBits < 0 || numberZeroBits > 512) return 0;
+    return findHash(get_random_string(), numberZeroBits, outputMessage, outputHash, options);
+}
 
-        if (byte != 0) return 0;
-    }
+bool findHash (int numberZeroBits, string & outputMessage, string & outputHash)
+{
+    return findHash(numberZeroBits, outputMessage, outputHash, search_options());
+}
 
-    if (extraBits > 0)
-    {
-        std::string byteString = hash.substr(bytesToCheck * 2, 2);
-        auto byte = static_cast<unsigned char>(std::stoul(byteString, nullptr, 16));
-        auto mask = static_cast<unsigned char>(0xFF << (8 - extraBits));
 
-        if ((byte & mask) != 0) return 0;
+static int hex_digit(char c)
+{
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+// checkDigest() on a hex digest. Only the bytes holding the first `bits` bits are read, they have to be valid hex.
+int checkHash(int bits, const std::string & hash)
+{
+    if (bits > 512) return 0;
+    size_t needed = bits > 0 ? ((size_t)bits + 7) / 8 : 0;
+    if (hash.size() < 2 * needed) return 0;
+
+    unsigned char digest[SHA512_DIGEST_SIZE] {};
+    for (size_t i = 0; i < needed; ++i)
+    {
+        int high = hex_digit(hash[2 * i]), low = hex_digit(hash[2 * i + 1]);
+        if (high < 0 || low < 0) return 0;
+        digest[i] = (unsigned char)(high << 4 | low);
     }
+    return checkDigest(digest, bits);
+}
+
 
-    return 1;
+// Whether `hash` is the SHA-512 of `message`, both in hex.
+bool is_sha512_of(const string & hash, const string & message)
+{
+    vector<unsigned char> message_bytes;
+    for (size_t i = 0; i < message.size(); i += 2)
+        message_bytes.push_back((unsigned char)stoul(message.substr(i, 2), nullptr, 16));
+    vector<unsigned char> digest(EVP_MAX_MD_SIZE);
+    unsigned int digest_size = 0;
+    if (!EVP_Digest(message_bytes.data(), message_bytes.size(), digest.data(), &digest_size, EVP_sha512(), nullptr))
+        return false;
+    digest.resize(digest_size);
+    return bytesvector_to_hex(digest) == hash;
 }
 
 
@@ -152,6 +550,43 @@ int main ()
 {
     string hash, message;
 
+    // Every kernel the CPU supports against EVP_sha512, on random messages around the block boundaries
+    for (const sha512_kernel * kernel : available_sha512_kernels())
+    {
+        for (int trial = 0; trial < 200; ++trial)
+        {
+            size_t length = trial < 130 ? (size_t)trial * 3 % 260 : (size_t)get_random_size() * 13;
+            vector<vector<unsigned char>> inputs(kernel->m_lanes, vector<unsigned char>(length));
+            uint64_t state[MAX_SHA512_LANES][8];
+            unsigned char tails[MAX_SHA512_LANES][2 * SHA512_BLOCK_SIZE];
+            const unsigned char * messages[MAX_SHA512_LANES];
+            size_t full_blocks = length / SHA512_BLOCK_SIZE, tail_blocks = 0;
+            for (size_t lane = 0; lane < kernel->m_lanes; ++lane)
+            {
+                assert(length == 0 || RAND_bytes(inputs[lane].data(), (int)length) == 1);
+                memcpy(state[lane], SHA512_IV, sizeof(SHA512_IV));
+                messages[lane] = inputs[lane].data();
+            }
+            kernel->m_compress(state, messages, full_blocks);
+            for (size_t lane = 0; lane < kernel->m_lanes; ++lane)
+            {
+                tail_blocks = sha512_pad(inputs[lane].data() + full_blocks * SHA512_BLOCK_SIZE, length % SHA512_BLOCK_SIZE, length, tails[lane]);
+                messages[lane] = tails[lane];
+            }
+            kernel->m_compress(state, messages, tail_blocks);
+
+            for (size_t lane = 0; lane < kernel->m_lanes; ++lane)
+            {
+                unsigned char expected[EVP_MAX_MD_SIZE], digest[SHA512_DIGEST_SIZE];
+                unsigned int expected_size = 0;
+                assert(EVP_Digest(inputs[lane].data(), length, expected, &expected_size, EVP_sha512(), nullptr));
+                for (size_t i = 0; i < 8; ++i)
+                    store_be64(digest + 8 * i, state[lane][i]);
+                assert(expected_size == SHA512_DIGEST_SIZE && memcmp(digest, expected, SHA512_DIGEST_SIZE) == 0);
+            }
+        }
+    }
+
 	cout << "Trying to find a hash strating with 0 zeros" << endl;
     findHash(0,message, hash);
     assert(findHash(0, message, hash));
@@ -182,6 +617,85 @@ int main ()
     hash.clear();
 
     assert(!findHash(-1, message, hash));
+
+    // Several workers: the message is the input of the reported hash
+    search_options options;
+    options.m_threads = 4;
+    cout << "Trying to find a hash strating with 16 zero bits on " << options.m_threads << " threads" << endl;
+    assert(findHash(16, message, hash, options));
+    assert(checkHash(16, hash) && is_sha512_of(hash, message));
+	cout << "Hash found: " << hash << endl << "String is: " << message << endl << endl;
+    message.clear();
+    hash.clear();
+
+    // A server-provided challenge is the start of the message, followed by the nonce; with every kernel,
+    // and with the nonce and padding in one or two blocks after the absorbed ones
+    for (const sha512_kernel * kernel : available_sha512_kernels())
+        for (size_t challenge_size : {700, 120, 0})
+        {
+            vector<unsigned char> challenge(challenge_size);
+            for (size_t i = 0; i < challenge.size(); ++i)
+                challenge[i] = (unsigned char)(i * 31);
+            options.m_kernel = kernel;
+            assert(findHash(challenge, 12, message, hash, options));
+            assert(checkHash(12, hash) && is_sha512_of(hash, message));
+            assert(message.size() == 2 * (challenge.size() + NONCE_SIZE) && message.rfind(bytesvector_to_hex(challenge), 0) == 0);
+            message.clear();
+            hash.clear();
+        }
+    options.m_kernel = nullptr;
+
+    // Binary verification against a byte by byte count of the leading zero bits, and the hex wrapper on top of it
+    for (int trial = 0; trial < 200; ++trial)
+    {
+        unsigned char digest[SHA512_DIGEST_SIZE];
+        assert(RAND_bytes(digest, sizeof(digest)) == 1);
+        int zero_bits = trial < 190 ? trial * 3 % 520 : 512;
+        for (int i = 0; i < min(zero_bits, 512); ++i)
+            digest[i / 8] &= (unsigned char)~(0x80 >> (i % 8));
+        int expected = 0;
+        while (expected < 512 && !(digest[expected / 8] & (0x80 >> (expected % 8))))
+            ++expected;
+        string digest_hex = bytesvector_to_hex(vector<unsigned char>(digest, digest + sizeof(digest)));
+
+        for (int bits = 0; bits <= 512; ++bits)
+        {
+            assert(checkDigest(digest, bits) == (expected >= bits));
+            assert(checkDigest(digest, target_for_bits(bits)) == (expected >= bits));
+            assert(checkHash(bits, digest_hex) == (expected >= bits ? 1 : 0));
+        }
+        assert(!checkDigest(digest, 513) && !checkHash(513, digest_hex));
+    }
+    assert(!checkHash(16, "00") && !checkHash(8, "zz00") && checkHash(8, "00zz"));
+
+    // Targets between powers of two: the digest equal to the target passes, the next one up does not
+    hash_target target {{0x0003000000000000ULL, 0, 0, 0, 0, 0, 0, 0x10}};
+    unsigned char at_target[SHA512_DIGEST_SIZE];
+    for (size_t i = 0; i < 8; ++i)
+        store_be64(at_target + 8 * i, target.m_words[i]);
+    assert(checkDigest(at_target, target));
+    at_target[SHA512_DIGEST_SIZE - 1] = 0x11;
+    assert(!checkDigest(at_target, target));
+
+    target = {{0x000a000000000000ULL, 0, 0, 0, 0, 0, 0, 0}};
+    assert(findHash(vector<unsigned char>(40, 7), target, message, hash, options) && is_sha512_of(hash, message));
+    unsigned char found_digest[SHA512_DIGEST_SIZE];
+    for (size_t i = 0; i < SHA512_DIGEST_SIZE; ++i)
+        found_digest[i] = (unsigned char)stoul(hash.substr(2 * i, 2), nullptr, 16);
+    assert(checkDigest(found_digest, target) && checkHash(12, hash));
+    message.clear();
+    hash.clear();
+
+    // Cancellation and deadline end a search that can not succeed
+    atomic<bool> cancel {true};
+    options.m_cancel = &cancel;
+    assert(!findHash(512, message, hash, options) && message.empty() && hash.empty());
+
+    options.m_cancel = nullptr;
+    auto started = chrono::steady_clock::now();
+    options.m_deadline = started + chrono::milliseconds(100);
+    assert(!findHash(512, message, hash, options) && message.empty() && hash.empty());
+    assert(chrono::steady_clock::now() - started < chrono::seconds(2));
     return 0;
 }
 